@@ -6,6 +6,61 @@
 static quad_mode_t g_quad_mode = SPI_MODE;
 static spi_chip_vendor_t g_vendor = VENDOR_MX;
 
+// Until the chip is probed, assume the stock MX25U8035F
+flash_info_t g_flash_info = {
+  .manufacturer = 0xC2,
+  .memory_type  = 0x25,
+  .capacity     = 0x34,
+  .has_sfdp     = 0,
+  .size_log2    = 20,
+  .quad_enable  = QE_SR1_BIT6,
+  .quad_read    = 0xEB,
+  .quad_dummy   = 6,
+  .erase_32k    = 0x52,
+};
+
+#define OSPI_QUEUE_SIZE 8
+
+typedef enum {
+  OSPI_OP_READ,
+  OSPI_OP_PROGRAM,
+} ospi_op_t;
+
+typedef struct {
+  OSPI_HandleTypeDef *hospi;
+  ospi_op_t op;
+  uint32_t address;
+  uint8_t *buffer;
+  uint32_t size;
+  ospi_callback_t callback;
+  void *context;
+} ospi_request_t;
+
+// Queued requests run one after another from the OSPI and MDMA interrupts
+static ospi_request_t g_queue[OSPI_QUEUE_SIZE];
+static volatile uint32_t g_queue_head = 0;
+static volatile uint32_t g_queue_tail = 0;
+static volatile uint8_t g_queue_busy = 0;
+static uint32_t g_queue_chunk;
+static OSPI_HandleTypeDef *g_queue_hospi;
+
+static void ospi_queue_done(int status);
+
+// Clock cycles between status reads while waiting for the flash, about the
+// time a page program, a sector or block erase and a chip erase take / 100
+#define OSPI_POLL_PROGRAM 0x0100
+#define OSPI_POLL_ERASE   0x4000
+#define OSPI_POLL_CHIP    0xFFFF
+
+static volatile uint8_t g_poll_waiting = 0;
+
+// Rough typical erase times in ms, to weigh one large erase against several small ones
+#define ERASE_TIME_4K  40
+#define ERASE_TIME_32K 150
+#define ERASE_TIME_64K 300
+
+static uint32_t g_erase_check[64];
+
 /**
   * @brief  Set the command lines based on the chip used.
   * @param  cmd: Command handle.
@@ -37,14 +92,30 @@ void set_cmd_lines(OSPI_RegularCmdTypeDef *cmd, quad_mode_t quad_mode, spi_chip_
 }
 
 /**
-  * @brief  Read raw data from the flash memory.
+  * @brief  Set up a command from a read plan.
+  * @param  cmd: Command handle.
+  * @param  plan: Instruction, lines and length, see ospi_plan_read().
+  * @return Nothing.
+  */
+void set_read_cmd(OSPI_RegularCmdTypeDef *cmd, const ospi_read_plan_t *plan)
+{
+  cmd->Instruction     = plan->instruction;
+  cmd->DummyCycles     = plan->dummy_cycles;
+  cmd->InstructionMode = (plan->instruction_lines == 4) ? HAL_OSPI_INSTRUCTION_4_LINES : HAL_OSPI_INSTRUCTION_1_LINE;
+  cmd->AddressMode     = (plan->address_lines == 4) ? HAL_OSPI_ADDRESS_4_LINES : HAL_OSPI_ADDRESS_1_LINE;
+  cmd->DataMode        = (plan->data_lines == 4) ? HAL_OSPI_DATA_4_LINES : HAL_OSPI_DATA_1_LINE;
+  cmd->Address         = plan->address;
+  cmd->NbData          = plan->length;
+}
+
+/**
+  * @brief  Send a command that reads raw data, the data follows it.
   * @param  hospi: OSPI handle.
   * @param  instruction: Flash instrucion. Refer to the flash datasheet.
-  * @param  data: Pointer to a data buffer.
   * @param  len: Number of bytes to read.
   * @return Nothing.
   */
-void OSPI_ReadBytes(OSPI_HandleTypeDef *hospi, uint8_t instruction, uint8_t *data, size_t len)
+void send_read_bytes_cmd(OSPI_HandleTypeDef *hospi, uint8_t instruction, size_t len)
 {
   OSPI_RegularCmdTypeDef  sCommand;
   memset(&sCommand, 0x0, sizeof(sCommand));
@@ -70,12 +141,67 @@ void OSPI_ReadBytes(OSPI_HandleTypeDef *hospi, uint8_t instruction, uint8_t *dat
   {
     Error_Handler();
   }
+}
+
+/**
+  * @brief  Read raw data from the flash memory.
+  * @param  hospi: OSPI handle.
+  * @param  instruction: Flash instrucion. Refer to the flash datasheet.
+  * @param  data: Pointer to a data buffer.
+  * @param  len: Number of bytes to read.
+  * @return Nothing.
+  */
+void OSPI_ReadBytes(OSPI_HandleTypeDef *hospi, uint8_t instruction, uint8_t *data, size_t len)
+{
+  send_read_bytes_cmd(hospi, instruction, len);
 
   if(HAL_OSPI_Receive(hospi, data, HAL_OSPI_TIMEOUT_DEFAULT_VALUE) != HAL_OK) {
     Error_Handler();
   }
 }
 
+/**
+  * @brief  Let the OSPI poll the status register until the Write In Progress bit is zero.
+  *         HAL_OSPI_StatusMatchCallback() is called once it is.
+  * @param  hospi: OSPI handle.
+  * @param  interval: Number of clock cycles between status reads.
+  * @return 0 on success, -1 if polling could not be started.
+  */
+int start_wip_polling(OSPI_HandleTypeDef *hospi, uint16_t interval)
+{
+  OSPI_AutoPollingTypeDef sConfig;
+
+  sConfig.Match         = 0x00;
+  sConfig.Mask          = 0x01; // WIP
+  sConfig.MatchMode     = HAL_OSPI_MATCH_MODE_AND;
+  sConfig.AutomaticStop = HAL_OSPI_AUTOMATIC_STOP_ENABLE;
+  sConfig.Interval      = interval;
+
+  send_read_bytes_cmd(hospi, 0x05, 1);
+
+  return (HAL_OSPI_AutoPolling_IT(hospi, &sConfig) == HAL_OK) ? 0 : -1;
+}
+
+/**
+  * @brief  Sleep until the flash is done with a program, erase or status register write.
+  * @param  hospi: OSPI handle.
+  * @param  interval: Number of clock cycles between status reads.
+  * @return Nothing.
+  */
+void OSPI_WaitWhileBusy(OSPI_HandleTypeDef *hospi, uint16_t interval)
+{
+  g_poll_waiting = 1;
+
+  if (start_wip_polling(hospi, interval) != 0) {
+    Error_Handler();
+  }
+
+  // The status match interrupt wakes the CPU up, the bus is left alone in between
+  while (g_poll_waiting) {
+    __WFI();
+  }
+}
+
 /**
   * @brief  Write raw data to the flash memory.
   * @param  hospi: OSPI handle.
@@ -116,6 +242,72 @@ void OSPI_WriteBytes(OSPI_HandleTypeDef *hospi, uint8_t instruction, uint8_t dum
   }
 }
 
+/**
+  * @brief  Set the quad enable bit of the flash. The status registers are
+  *         non-volatile, so they are only written if the bit is not set yet.
+  * @param  hospi: OSPI handle.
+  * @param  method: Where the bit is, see quad_enable_t.
+  * @return 0 if the bit is set, -1 otherwise.
+  */
+int OSPI_QuadEnable(OSPI_HandleTypeDef *hospi, quad_enable_t method)
+{
+  uint8_t status[2] = {0, 0};
+  uint8_t read_cmd, write_cmd, mask, len = 1, done;
+
+  switch (method) {
+    case QE_SR1_BIT6:
+      read_cmd = 0x05;
+      write_cmd = 0x01;
+      mask = 1<<6;
+      OSPI_ReadBytes(hospi, read_cmd, &status[0], 1);
+      // Other bits = 0, which also clears the block protection
+      done = (status[0] & 0xFC) == mask;
+      status[0] = mask;
+      break;
+    case QE_SR2_BIT1:
+      read_cmd = 0x35;
+      write_cmd = 0x01;
+      mask = 1<<1;
+      len = 2;
+      OSPI_ReadBytes(hospi, 0x05, &status[0], 1);
+      OSPI_ReadBytes(hospi, read_cmd, &status[1], 1);
+      done = status[1] & mask;
+      status[1] |= mask;
+      break;
+    case QE_SR2_BIT1_31H:
+      read_cmd = 0x35;
+      write_cmd = 0x31;
+      mask = 1<<1;
+      OSPI_ReadBytes(hospi, read_cmd, &status[0], 1);
+      done = status[0] & mask;
+      status[0] |= mask;
+      break;
+    case QE_SR2_BIT7:
+      read_cmd = 0x3F;
+      write_cmd = 0x3E;
+      mask = 1<<7;
+      OSPI_ReadBytes(hospi, read_cmd, &status[0], 1);
+      done = status[0] & mask;
+      status[0] |= mask;
+      break;
+    default:
+      return 0;
+  }
+
+  if (done) {
+    return 0;
+  }
+
+  OSPI_NOR_WriteEnable(hospi);
+  OSPI_WriteBytes(hospi, write_cmd, 0, status, len, SPI_MODE);
+
+  OSPI_WaitWhileBusy(hospi, OSPI_POLL_PROGRAM);
+
+  OSPI_ReadBytes(hospi, read_cmd, &status[0], 1);
+
+  return (status[0] & mask) ? 0 : -1;
+}
+
 /**
   * @brief  Initialize OSPI.
   * @param  hospi: OSPI handle.
@@ -140,26 +332,172 @@ void OSPI_Init(OSPI_HandleTypeDef *hospi, quad_mode_t quad_mode, spi_chip_vendor
   HAL_Delay(20);
 
   g_vendor = vendor;
-  g_quad_mode = quad_mode;
+  g_quad_mode = SPI_MODE;
 
   if (quad_mode == QUAD_MODE) {
     if (vendor == VENDOR_MX) {
-      // WRSR - Write Status Register
-      // Set Quad Enable bit (6) in status register. Other bits = 0.
-      uint8_t wr_status = 1<<6;
-      uint8_t rd_status = 0xff;
-
-      // Enable write to be allowed to change the status register
-      OSPI_NOR_WriteEnable(hospi);
-
-      // Loop until rd_status is updated
-      while ((rd_status & wr_status) != wr_status) {
-        OSPI_WriteBytes(hospi, 0x01, 0, &wr_status, 1, SPI_MODE);
-        OSPI_ReadBytes(hospi, 0x05, &rd_status, 1);
+      // Stays in 1-line mode if the quad enable bit does not stick
+      if (OSPI_QuadEnable(hospi, g_flash_info.quad_enable) == 0) {
+        g_quad_mode = QUAD_MODE;
       }
     } else if (vendor == VENDOR_ISSI) {
       // Enable QPI mode
       OSPI_WriteBytes(hospi, 0x35, 0, NULL, 0, SPI_MODE);
+      g_quad_mode = QUAD_MODE;
+    }
+  }
+}
+
+/**
+  * @brief  Read the SFDP tables of the flash.
+  * @param  hospi: OSPI handle.
+  * @param  address: Address within the SFDP area.
+  * @param  buffer: Pointer to a data buffer.
+  * @param  buffer_size: Number of bytes to read.
+  * @return Nothing.
+  */
+void OSPI_ReadSFDP(OSPI_HandleTypeDef *hospi, uint32_t address, uint8_t *buffer, size_t buffer_size)
+{
+  OSPI_RegularCmdTypeDef  sCommand;
+
+  memset(&sCommand, 0x0, sizeof(sCommand));
+  sCommand.OperationType         = HAL_OSPI_OPTYPE_COMMON_CFG;
+  sCommand.FlashId               = 0;
+  sCommand.Instruction           = 0x5A; // RDSFDP
+  sCommand.InstructionSize       = HAL_OSPI_INSTRUCTION_8_BITS;
+  sCommand.Address               = address;
+  sCommand.AddressSize           = HAL_OSPI_ADDRESS_24_BITS;
+  sCommand.AlternateBytesMode    = HAL_OSPI_ALTERNATE_BYTES_NONE;
+  sCommand.NbData                = buffer_size;
+  sCommand.DummyCycles           = 8;
+  sCommand.DQSMode               = HAL_OSPI_DQS_DISABLE;
+  sCommand.SIOOMode              = HAL_OSPI_SIOO_INST_EVERY_CMD;
+  sCommand.InstructionDtrMode    = HAL_OSPI_INSTRUCTION_DTR_DISABLE;
+
+  // SFDP is always read in 1-line mode
+  set_cmd_lines(&sCommand, SPI_MODE, g_vendor, 1, 1);
+
+  if (HAL_OSPI_Command(hospi, &sCommand, HAL_OSPI_TIMEOUT_DEFAULT_VALUE) != HAL_OK)
+  {
+    Error_Handler();
+  }
+
+  if(HAL_OSPI_Receive(hospi, buffer, HAL_OSPI_TIMEOUT_DEFAULT_VALUE) != HAL_OK) {
+    Error_Handler();
+  }
+}
+
+/**
+  * @brief  Identify the flash from its JEDEC ID and SFDP tables.
+  *         Anything the chip does not report keeps its current value.
+  * @param  hospi: OSPI handle. The chip has to be in 1-line mode.
+  * @param  info: Flash parameters to fill in.
+  * @return Nothing.
+  */
+void OSPI_Probe(OSPI_HandleTypeDef *hospi, flash_info_t *info)
+{
+  uint8_t id[3];
+  uint32_t header[4], table[16];
+  uint32_t length, density, erase_type;
+  int i;
+
+  OSPI_ReadBytes(hospi, 0x9F, id, 3);
+
+  // No chip answering reads as all 0x00 or all 0xFF
+  if (id[0] == 0x00 || id[0] == 0xFF) {
+    return;
+  }
+
+  info->manufacturer = id[0];
+  info->memory_type = id[1];
+  info->capacity = id[2];
+  info->has_sfdp = 0;
+
+  // The capacity is usually the size as a power of two, Macronix 1.8V parts count from 0x30 instead
+  if (id[2] >= 0x30 && id[2] < 0x40) {
+    info->size_log2 = (id[2] & 0x0F) + 16;
+  } else if (id[2] >= 16 && id[2] < 0x20) {
+    info->size_log2 = id[2];
+  }
+
+  // The quad enable bit of the chips without a JESD216A table
+  if (id[0] == 0xEF || id[0] == 0xC8) {
+    info->quad_enable = QE_SR2_BIT1; // Winbond, GigaDevice
+  } else {
+    info->quad_enable = QE_SR1_BIT6;
+  }
+
+  // The SFDP header is followed by the header of the basic parameter table
+  OSPI_ReadSFDP(hospi, 0, (uint8_t *)header, sizeof(header));
+
+  if (header[0] != 0x50444653 || (header[2] & 0xFF) != 0x00) {
+    return;
+  }
+
+  length = header[2] >> 24;
+
+  if (length > 16) {
+    length = 16;
+  }
+
+  memset(table, 0, sizeof(table));
+  OSPI_ReadSFDP(hospi, header[3] & 0xFFFFFF, (uint8_t *)table, length * 4);
+
+  info->has_sfdp = 1;
+
+  // DWORD 2: density in bits, either minus one or as a power of two
+  density = table[1];
+
+  if (density & 0x80000000) {
+    info->size_log2 = (density & 0x7FFFFFFF) - 3;
+  } else {
+    for (info->size_log2 = 0; (1UL << (info->size_log2 + 3)) <= density; info->size_log2++);
+  }
+
+  // Only 3-byte addresses are used
+  if (info->size_log2 > 24) {
+    info->size_log2 = 24;
+  }
+
+  // DWORD 1 bit 21 and DWORD 3: 1-4-4 fast read
+  if (table[0] & (1 << 21)) {
+    info->quad_read = (table[2] >> 8) & 0xFF;
+    info->quad_dummy = (table[2] & 0x1F) + ((table[2] >> 5) & 0x07);
+  } else {
+    info->quad_read = 0;
+  }
+
+  // DWORD 8 and 9: up to four erase types, each a size as a power of two and an instruction
+  if (length >= 9) {
+    info->erase_32k = 0;
+
+    for (i = 0; i < 4; i++) {
+      erase_type = table[7 + i / 2] >> ((i % 2) * 16);
+
+      if ((erase_type & 0xFF) == 15) {
+        info->erase_32k = (erase_type >> 8) & 0xFF;
+      }
+    }
+  }
+
+  // DWORD 15 (JESD216A and later): quad enable requirements
+  if (length >= 15) {
+    switch ((table[14] >> 20) & 0x07) {
+      case 0:
+        info->quad_enable = QE_NONE;
+        break;
+      case 2:
+        info->quad_enable = QE_SR1_BIT6;
+        break;
+      case 3:
+        info->quad_enable = QE_SR2_BIT7;
+        break;
+      case 6:
+        info->quad_enable = QE_SR2_BIT1_31H;
+        break;
+      default:
+        info->quad_enable = QE_SR2_BIT1;
+        break;
     }
   }
 }
@@ -171,33 +509,27 @@ void OSPI_Init(OSPI_HandleTypeDef *hospi, quad_mode_t quad_mode, spi_chip_vendor
   */
 void OSPI_ChipErase(OSPI_HandleTypeDef *hospi)
 {
-  uint8_t status;
-
   // Send Chip Erase command
   OSPI_WriteBytes(hospi, 0x60, 0, NULL, 0, g_quad_mode);
 
-  // Wait for Write In Progress Bit to be zero
-  do {
-    OSPI_ReadBytes(hospi, 0x05, &status, 1);
-    HAL_Delay(100);
-  } while((status & 0x01) == 0x01);
+  OSPI_WaitWhileBusy(hospi, OSPI_POLL_CHIP);
 }
 
 /**
-  * @brief  Erase a 64 kB block.
+  * @brief  Erase a block or sector and wait until it is done.
   * @param  hospi: OSPI handle.
-  * @param  address: Block address.
+  * @param  instruction: Erase instruction.
+  * @param  address: Block or sector address.
   * @return Nothing.
   */
-void OSPI_BlockErase(OSPI_HandleTypeDef *hospi, uint32_t address)
+void send_erase_cmd(OSPI_HandleTypeDef *hospi, uint8_t instruction, uint32_t address)
 {
-  uint8_t status;
   OSPI_RegularCmdTypeDef  sCommand;
 
   memset(&sCommand, 0x0, sizeof(sCommand));
   sCommand.OperationType         = HAL_OSPI_OPTYPE_COMMON_CFG;
   sCommand.FlashId               = 0;
-  sCommand.Instruction           = 0xD8; // BE Block Erase
+  sCommand.Instruction           = instruction;
   sCommand.InstructionSize       = HAL_OSPI_INSTRUCTION_8_BITS;
   sCommand.Address               = address;
   sCommand.AddressSize           = HAL_OSPI_ADDRESS_24_BITS;
@@ -208,17 +540,37 @@ void OSPI_BlockErase(OSPI_HandleTypeDef *hospi, uint32_t address)
   sCommand.SIOOMode              = HAL_OSPI_SIOO_INST_ONLY_FIRST_CMD;
   sCommand.InstructionDtrMode    = HAL_OSPI_INSTRUCTION_DTR_DISABLE;
 
-  set_cmd_lines(&sCommand, g_quad_mode, g_vendor, 1, 0);
+  // Only the quad read and 4PP take the address on four lines on MX chips
+  set_cmd_lines(&sCommand, g_vendor == VENDOR_MX ? SPI_MODE : g_quad_mode, g_vendor, 1, 0);
 
   if (HAL_OSPI_Command(hospi, &sCommand, HAL_OSPI_TIMEOUT_DEFAULT_VALUE) != HAL_OK)
   {
     Error_Handler();
   }
 
-  // Wait for Write In Progress Bit to be zero
-  do {
-    OSPI_ReadBytes(hospi, 0x05, &status, 1);
-  } while((status & 0x01) == 0x01);
+  OSPI_WaitWhileBusy(hospi, OSPI_POLL_ERASE);
+}
+
+/**
+  * @brief  Erase a 64 kB block.
+  * @param  hospi: OSPI handle.
+  * @param  address: Block address.
+  * @return Nothing.
+  */
+void OSPI_BlockErase(OSPI_HandleTypeDef *hospi, uint32_t address)
+{
+  send_erase_cmd(hospi, 0xD8, address); // BE Block Erase
+}
+
+/**
+  * @brief  Erase a 32 kB block, if the chip supports it (see g_flash_info.erase_32k).
+  * @param  hospi: OSPI handle.
+  * @param  address: Block address.
+  * @return Nothing.
+  */
+void OSPI_Block32Erase(OSPI_HandleTypeDef *hospi, uint32_t address)
+{
+  send_erase_cmd(hospi, g_flash_info.erase_32k, address); // BE32K, usually 0x52
 }
 
 /**
@@ -229,39 +581,177 @@ void OSPI_BlockErase(OSPI_HandleTypeDef *hospi, uint32_t address)
   */
 void OSPI_SectorErase(OSPI_HandleTypeDef *hospi, uint32_t address)
 {
-  uint8_t status;
-  OSPI_RegularCmdTypeDef  sCommand;
+  send_erase_cmd(hospi, 0x20, address); // Sector Erase (4kB)
+}
 
-  memset(&sCommand, 0x0, sizeof(sCommand));
-  sCommand.OperationType         = HAL_OSPI_OPTYPE_COMMON_CFG;
-  sCommand.FlashId               = 0;
-  sCommand.Instruction           = 0x20; // Sector Erase (4kB)
-  sCommand.InstructionSize       = HAL_OSPI_INSTRUCTION_8_BITS;
-  sCommand.Address               = address;
-  sCommand.AddressSize           = HAL_OSPI_ADDRESS_24_BITS;
-  sCommand.AlternateBytesMode    = HAL_OSPI_ALTERNATE_BYTES_NONE;
-  sCommand.NbData                = 0;
-  sCommand.DummyCycles           = 0;
-  sCommand.DQSMode               = HAL_OSPI_DQS_DISABLE;
-  sCommand.SIOOMode              = HAL_OSPI_SIOO_INST_ONLY_FIRST_CMD;
-  sCommand.InstructionDtrMode    = HAL_OSPI_INSTRUCTION_DTR_DISABLE;
+/**
+  * @brief  Check if an area of the flash reads back as erased.
+  * @param  hospi: OSPI handle.
+  * @param  address: Start of the area.
+  * @param  size: Size of the area.
+  * @return 1 if all of it is 0xFF, 0 otherwise.
+  */
+int OSPI_IsErased(OSPI_HandleTypeDef *hospi, uint32_t address, uint32_t size)
+{
+  uint32_t len, i;
 
-  set_cmd_lines(&sCommand, g_quad_mode, g_vendor, 1, 0);
+  for (; size > 0; address += len, size -= len) {
+    len = size > sizeof(g_erase_check) ? sizeof(g_erase_check) : size;
 
-  if (HAL_OSPI_Command(hospi, &sCommand, HAL_OSPI_TIMEOUT_DEFAULT_VALUE) != HAL_OK)
-  {
-    Error_Handler();
+    OSPI_Read(hospi, address, (uint8_t *)g_erase_check, len);
+
+    // Stop at the first programmed byte
+    for (i = 0; i < len / 4; i++) {
+      if (g_erase_check[i] != 0xFFFFFFFF) {
+        return 0;
+      }
+    }
   }
 
-  // Wait for Write In Progress Bit to be zero
-  do {
-    OSPI_ReadBytes(hospi, 0x05, &status, 1);
-  } while((status & 0x01) == 0x01);
+  return 1;
 }
 
-void  _OSPI_Program(OSPI_HandleTypeDef *hospi, uint32_t address, uint8_t *buffer, size_t buffer_size)
+/**
+  * @brief  Estimate the time to erase the given sectors of an aligned 32 or 64 kB block.
+  * @param  size: Size of the block.
+  * @param  dirty: Bit mask of the 4 kB sectors that need erasing.
+  * @return Time in ms, using the fastest mix of erases.
+  */
+uint32_t erase_time(uint32_t size, uint16_t dirty)
+{
+  uint32_t whole, split = 0;
+  int i;
+
+  if (dirty == 0) {
+    return 0;
+  }
+
+  if (size == 0x10000) {
+    whole = ERASE_TIME_64K;
+    split = erase_time(0x8000, dirty & 0xFF) + erase_time(0x8000, dirty >> 8);
+  } else {
+    whole = g_flash_info.erase_32k ? ERASE_TIME_32K : 0xFFFFFFFF;
+
+    for (i = 0; i < 8; i++) {
+      if (dirty & (1 << i)) {
+        split += ERASE_TIME_4K;
+      }
+    }
+  }
+
+  return whole <= split ? whole : split;
+}
+
+/**
+  * @brief  Erase the given sectors of an aligned 32 or 64 kB block, the fastest way.
+  * @param  hospi: OSPI handle.
+  * @param  address: Block address.
+  * @param  size: Size of the block.
+  * @param  dirty: Bit mask of the 4 kB sectors that need erasing.
+  * @return Number of erase commands used.
+  */
+int erase_block(OSPI_HandleTypeDef *hospi, uint32_t address, uint32_t size, uint16_t dirty)
+{
+  int i, count = 0;
+
+  if (dirty == 0) {
+    return 0;
+  }
+
+  if (size == 0x10000) {
+    if (ERASE_TIME_64K <= erase_time(0x8000, dirty & 0xFF) + erase_time(0x8000, dirty >> 8)) {
+      OSPI_NOR_WriteEnable(hospi);
+      OSPI_BlockErase(hospi, address);
+      return 1;
+    }
+
+    return erase_block(hospi, address, 0x8000, dirty & 0xFF) + erase_block(hospi, address + 0x8000, 0x8000, dirty >> 8);
+  }
+
+  if (g_flash_info.erase_32k && erase_time(size, dirty) == ERASE_TIME_32K) {
+    OSPI_NOR_WriteEnable(hospi);
+    OSPI_Block32Erase(hospi, address);
+    return 1;
+  }
+
+  for (i = 0; i < 8; i++) {
+    if (dirty & (1 << i)) {
+      OSPI_NOR_WriteEnable(hospi);
+      OSPI_SectorErase(hospi, address + i * 0x1000);
+      count++;
+    }
+  }
+
+  return count;
+}
+
+/**
+  * @brief  Erase a range of the flash with the fewest and fastest erases.
+  *         Uses 64 kB, 32 kB and 4 kB erases as the alignment allows, or a chip erase
+  *         if the range is the whole chip.
+  * @param  hospi: OSPI handle.
+  * @param  address: Start of the range, a multiple of 4 kB.
+  * @param  size: Size of the range, a multiple of 4 kB.
+  * @param  skip_erased: Set to read the sectors first and leave out those already erased.
+  * @return Number of erase commands used, -1 if the range is not aligned or too large.
+  */
+int OSPI_EraseRange(OSPI_HandleTypeDef *hospi, uint32_t address, uint32_t size, uint8_t skip_erased)
+{
+  uint32_t end = address + size, chip = 1UL << g_flash_info.size_log2, block, i;
+  uint16_t dirty;
+  int count = 0;
+
+  if (((address | size) & 0xFFF) || end > chip || end < address) {
+    return -1;
+  }
+
+  if (address == 0 && end == chip && !skip_erased) {
+    OSPI_NOR_WriteEnable(hospi);
+    OSPI_ChipErase(hospi);
+    return 1;
+  }
+
+  for (; address < end; address += block) {
+    // The largest aligned block that fits, sectors at the unaligned ends
+    if ((address & 0xFFFF) == 0 && end - address >= 0x10000) {
+      block = 0x10000;
+    } else if ((address & 0x7FFF) == 0 && end - address >= 0x8000) {
+      block = 0x8000;
+    } else {
+      block = 0x1000;
+    }
+
+    dirty = 0;
+
+    for (i = 0; i < block / 0x1000; i++) {
+      if (!skip_erased || !OSPI_IsErased(hospi, address + i * 0x1000, 0x1000)) {
+        dirty |= 1 << i;
+      }
+    }
+
+    if (block == 0x1000) {
+      if (dirty) {
+        OSPI_NOR_WriteEnable(hospi);
+        OSPI_SectorErase(hospi, address);
+        count++;
+      }
+    } else {
+      count += erase_block(hospi, address, block, dirty);
+    }
+  }
+
+  return count;
+}
+
+/**
+  * @brief  Send a page program command, the data follows it.
+  * @param  hospi: OSPI handle.
+  * @param  address: Destination address.
+  * @param  buffer_size: Number of bytes to program, within one page.
+  * @return Nothing.
+  */
+void send_program_cmd(OSPI_HandleTypeDef *hospi, uint32_t address, size_t buffer_size)
 {
-  uint8_t status;
   OSPI_RegularCmdTypeDef  sCommand;
 
   memset(&sCommand, 0x0, sizeof(sCommand));
@@ -293,15 +783,17 @@ void  _OSPI_Program(OSPI_HandleTypeDef *hospi, uint32_t address, uint8_t *buffer
   {
     Error_Handler();
   }
+}
+
+void  _OSPI_Program(OSPI_HandleTypeDef *hospi, uint32_t address, uint8_t *buffer, size_t buffer_size)
+{
+  send_program_cmd(hospi, address, buffer_size);
 
   if(HAL_OSPI_Transmit(hospi, buffer, HAL_OSPI_TIMEOUT_DEFAULT_VALUE) != HAL_OK) {
     Error_Handler();
   }
 
-  // Wait for Write In Progress Bit to be zero
-  do {
-    OSPI_ReadBytes(hospi, 0x05, &status, 1);
-  } while((status & 0x01) == 0x01);
+  OSPI_WaitWhileBusy(hospi, OSPI_POLL_PROGRAM);
 }
 
 /**
@@ -326,42 +818,37 @@ void OSPI_Program(OSPI_HandleTypeDef *hospi, uint32_t address, uint8_t *buffer,
 }
 
 
-void _OSPI_Read(OSPI_HandleTypeDef *hospi, uint32_t address, uint8_t *buffer, size_t buffer_size)
+/**
+  * @brief  Send a read command, the data follows it.
+  * @param  hospi: OSPI handle.
+  * @param  plan: The command, see ospi_plan_read().
+  * @return Nothing.
+  */
+void send_read_cmd(OSPI_HandleTypeDef *hospi, const ospi_read_plan_t *plan)
 {
   OSPI_RegularCmdTypeDef  sCommand;
 
   memset(&sCommand, 0x0, sizeof(sCommand));
   sCommand.OperationType         = HAL_OSPI_OPTYPE_COMMON_CFG;
   sCommand.FlashId               = 0;
-  sCommand.Instruction           = 0x0B; // FAST_READ
   sCommand.InstructionSize       = HAL_OSPI_INSTRUCTION_8_BITS;
-  sCommand.Address               = address;
   sCommand.AddressSize           = HAL_OSPI_ADDRESS_24_BITS;
   sCommand.AlternateBytesMode    = HAL_OSPI_ALTERNATE_BYTES_NONE;
-  sCommand.NbData = buffer_size;
-  sCommand.DummyCycles           = 8;
   sCommand.DQSMode               = HAL_OSPI_DQS_DISABLE;
   sCommand.SIOOMode              = HAL_OSPI_SIOO_INST_ONLY_FIRST_CMD;
   sCommand.InstructionDtrMode    = HAL_OSPI_INSTRUCTION_DTR_DISABLE;
 
-  set_cmd_lines(&sCommand, g_quad_mode, g_vendor, 1, 1);
-
-  if(buffer_size > 256) {
-    Error_Handler();
-  }
+  set_read_cmd(&sCommand, plan);
 
   if (HAL_OSPI_Command(hospi, &sCommand, HAL_OSPI_TIMEOUT_DEFAULT_VALUE) != HAL_OK)
   {
     Error_Handler();
   }
-
-  if(HAL_OSPI_Receive(hospi, buffer, HAL_OSPI_TIMEOUT_DEFAULT_VALUE) != HAL_OK) {
-    Error_Handler();
-  }
 }
 
 /**
-  * @brief  Read data from the flash.
+  * @brief  Read data from the flash. Any length at any address goes in one command,
+  *         whatever lies past the end of the chip is left as it is in the buffer.
   * @param  hospi: OSPI handle.
   * @param  address: Source address.
   * @param  buffer: Pointer to a data buffer.
@@ -370,12 +857,16 @@ void _OSPI_Read(OSPI_HandleTypeDef *hospi, uint32_t address, uint8_t *buffer, si
   */
 void OSPI_Read(OSPI_HandleTypeDef *hospi, uint32_t address, uint8_t *buffer, int32_t buffer_size)
 {
-  unsigned iterations = buffer_size / 256;
-  unsigned dest_page = address / 256;
+  ospi_read_plan_t plan;
 
-  for(int i = 0; i < iterations; i++) {
-    _OSPI_Read(hospi, (i + dest_page) * 256, buffer + (i * 256), buffer_size > 256 ? 256 : buffer_size);
-    buffer_size -= 256;
+  if (ospi_plan_read(&plan, &g_flash_info, g_quad_mode, g_vendor, address, buffer_size, 0) == 0) {
+    return;
+  }
+
+  send_read_cmd(hospi, &plan);
+
+  if(HAL_OSPI_Receive(hospi, buffer, HAL_OSPI_TIMEOUT_DEFAULT_VALUE) != HAL_OK) {
+    Error_Handler();
   }
 }
 
@@ -392,6 +883,7 @@ void OSPI_NOR_WriteEnable(OSPI_HandleTypeDef *hospi)
 void OSPI_EnableMemoryMappedMode(OSPI_HandleTypeDef *spi)
 {
   OSPI_MemoryMappedTypeDef sMemMappedCfg;
+  ospi_read_plan_t plan;
 
   OSPI_RegularCmdTypeDef sCommand = {
     .Instruction = 0x0b, // FAST READ
@@ -413,12 +905,9 @@ void OSPI_EnableMemoryMappedMode(OSPI_HandleTypeDef *spi)
     .AlternateBytes = 0x00,
   };
 
-  set_cmd_lines(&sCommand, g_quad_mode, g_vendor, 1, 1);
-
-  if (g_quad_mode) {
-    sCommand.Instruction = 0xeb;
-    sCommand.DummyCycles = 6;
-  }
+  // Same instruction and lines as an indirect read, the length comes from each access
+  ospi_plan_read(&plan, &g_flash_info, g_quad_mode, g_vendor, 0, 0, 0);
+  set_read_cmd(&sCommand, &plan);
 
   /* Memory-mapped mode configuration for Linear burst read operations */
   if (HAL_OSPI_Command(spi, &sCommand, HAL_OSPI_TIMEOUT_DEFAULT_VALUE) !=
@@ -441,3 +930,293 @@ void OSPI_EnableMemoryMappedMode(OSPI_HandleTypeDef *spi)
     Error_Handler();
   }
 }
+
+/**
+  * @brief  Probe the flash and initialize OSPI in the fastest read mode it supports.
+  *         Falls back to 1-line mode if quad reads do not match.
+  * @param  hospi: OSPI handle.
+  * @return Nothing.
+  */
+void OSPI_InitAuto(OSPI_HandleTypeDef *hospi)
+{
+  spi_chip_vendor_t vendor;
+  uint8_t single[64], quad[64];
+
+  // Starting as ISSI also takes the chip out of QPI mode
+  OSPI_Init(hospi, SPI_MODE, VENDOR_ISSI);
+  OSPI_Probe(hospi, &g_flash_info);
+
+  hospi->Init.DeviceSize = g_flash_info.size_log2;
+  MODIFY_REG(hospi->Instance->DCR1, OCTOSPI_DCR1_DEVSIZE, (g_flash_info.size_log2 - 1) << OCTOSPI_DCR1_DEVSIZE_Pos);
+
+  vendor = (g_flash_info.manufacturer == 0x9D) ? VENDOR_ISSI : VENDOR_MX;
+
+  if (g_flash_info.quad_read == 0) {
+    OSPI_Init(hospi, SPI_MODE, vendor);
+    return;
+  }
+
+  // Make sure all four data lines are connected
+  g_vendor = vendor;
+  OSPI_Read(hospi, 0, single, sizeof(single));
+
+  OSPI_Init(hospi, QUAD_MODE, vendor);
+
+  if (g_quad_mode == QUAD_MODE) {
+    OSPI_Read(hospi, 0, quad, sizeof(quad));
+
+    if (memcmp(single, quad, sizeof(single)) != 0) {
+      OSPI_Init(hospi, SPI_MODE, vendor);
+    }
+  }
+}
+
+/**
+  * @brief  Start the current part of the first queued request.
+  * @return Nothing.
+  */
+static void ospi_queue_step(void)
+{
+  ospi_request_t *req = &g_queue[g_queue_head % OSPI_QUEUE_SIZE];
+  ospi_read_plan_t plan;
+  HAL_StatusTypeDef status;
+
+  if (req->op == OSPI_OP_READ) {
+    // One command per 64 kB, as much as the MDMA moves in one block
+    g_queue_chunk = ospi_plan_read(&plan, &g_flash_info, g_quad_mode, g_vendor, req->address, req->size, 65536);
+
+    if (g_queue_chunk == 0) {
+      ospi_queue_done(-1);
+      return;
+    }
+
+    send_read_cmd(req->hospi, &plan);
+    status = HAL_OSPI_Receive_DMA(req->hospi, req->buffer);
+  } else {
+    // Programs may not cross a page
+    g_queue_chunk = 256 - (req->address & 255);
+
+    if (g_queue_chunk > req->size) {
+      g_queue_chunk = req->size;
+    }
+
+    OSPI_NOR_WriteEnable(req->hospi);
+    send_program_cmd(req->hospi, req->address, g_queue_chunk);
+    status = HAL_OSPI_Transmit_DMA(req->hospi, req->buffer);
+  }
+
+  if (status != HAL_OK) {
+    ospi_queue_done(-1);
+  }
+}
+
+/**
+  * @brief  Start the next queued request, or go back to memory-mapped mode if there is none.
+  * @return Nothing.
+  */
+static void ospi_queue_next(void)
+{
+  if (g_queue_head == g_queue_tail) {
+    OSPI_EnableMemoryMappedMode(g_queue_hospi);
+    g_queue_busy = 0;
+    return;
+  }
+
+  ospi_queue_step();
+}
+
+/**
+  * @brief  Finish the first queued request and call its callback.
+  * @param  status: 0 on success, -1 on error.
+  * @return Nothing.
+  */
+static void ospi_queue_done(int status)
+{
+  ospi_request_t *req = &g_queue[g_queue_head % OSPI_QUEUE_SIZE];
+  ospi_callback_t callback = req->callback;
+  void *context = req->context;
+
+  g_queue_head++;
+
+  if (callback != NULL) {
+    callback(context, status);
+  }
+
+  ospi_queue_next();
+}
+
+/**
+  * @brief  Carry on with the first queued request after a part of it.
+  * @return Nothing.
+  */
+static void ospi_queue_advance(void)
+{
+  ospi_request_t *req = &g_queue[g_queue_head % OSPI_QUEUE_SIZE];
+
+  req->address += g_queue_chunk;
+  req->buffer += g_queue_chunk;
+  req->size -= g_queue_chunk;
+
+  if (req->size > 0) {
+    ospi_queue_step();
+  } else {
+    ospi_queue_done(0);
+  }
+}
+
+/**
+  * @brief  Queue a request, starting it right away if the flash is idle.
+  * @return 0 if queued, -1 if the queue is full.
+  */
+static int ospi_queue_add(OSPI_HandleTypeDef *hospi, ospi_op_t op, uint32_t address, uint8_t *buffer, uint32_t buffer_size, ospi_callback_t callback, void *context)
+{
+  ospi_request_t *req;
+  uint32_t primask;
+  int start = 0;
+
+  if (buffer_size == 0) {
+    return -1;
+  }
+
+  primask = __get_PRIMASK();
+  __disable_irq();
+
+  if (g_queue_tail - g_queue_head >= OSPI_QUEUE_SIZE) {
+    __set_PRIMASK(primask);
+    return -1;
+  }
+
+  req = &g_queue[g_queue_tail % OSPI_QUEUE_SIZE];
+  req->hospi = hospi;
+  req->op = op;
+  req->address = address;
+  req->buffer = buffer;
+  req->size = buffer_size;
+  req->callback = callback;
+  req->context = context;
+
+  g_queue_tail++;
+
+  if (!g_queue_busy) {
+    g_queue_busy = 1;
+    g_queue_hospi = hospi;
+    start = 1;
+  }
+
+  __set_PRIMASK(primask);
+
+  if (start) {
+    // Memory-mapped mode has to be left first, so nothing may be reading the flash
+    mdma_copy_wait();
+
+    if (hospi->State == HAL_OSPI_STATE_BUSY_MEM_MAPPED && HAL_OSPI_Abort(hospi) != HAL_OK) {
+      Error_Handler();
+    }
+
+    ospi_queue_step();
+  }
+
+  return 0;
+}
+
+/**
+  * @brief  Read data from the flash in the background using the MDMA.
+  *         The flash is not memory-mapped until the queue is empty.
+  * @param  hospi: OSPI handle.
+  * @param  address: Source address.
+  * @param  buffer: Pointer to a data buffer.
+  * @param  buffer_size: Number of bytes to read.
+  * @param  callback: Called from the interrupt once done, can be NULL.
+  * @param  context: Passed to the callback.
+  * @return 0 if queued, -1 if the queue is full.
+  */
+int OSPI_ReadAsync(OSPI_HandleTypeDef *hospi, uint32_t address, uint8_t *buffer, uint32_t buffer_size, ospi_callback_t callback, void *context)
+{
+  return ospi_queue_add(hospi, OSPI_OP_READ, address, buffer, buffer_size, callback, context);
+}
+
+/**
+  * @brief  Write data to the flash in the background using the MDMA.
+  *         The flash is not memory-mapped until the queue is empty.
+  * @param  hospi: OSPI handle.
+  * @param  address: Destination address.
+  * @param  buffer: Pointer to a data buffer, which has to stay valid until done.
+  * @param  buffer_size: Number of bytes to write.
+  * @param  callback: Called from the interrupt once done, can be NULL.
+  * @param  context: Passed to the callback.
+  * @return 0 if queued, -1 if the queue is full.
+  */
+int OSPI_ProgramAsync(OSPI_HandleTypeDef *hospi, uint32_t address, const uint8_t *buffer, uint32_t buffer_size, ospi_callback_t callback, void *context)
+{
+  return ospi_queue_add(hospi, OSPI_OP_PROGRAM, address, (uint8_t *)buffer, buffer_size, callback, context);
+}
+
+/**
+  * @brief  Check if queued flash requests are still running.
+  * @return 1 if busy, 0 if idle.
+  */
+int OSPI_IsBusy(void)
+{
+  return g_queue_busy;
+}
+
+/**
+  * @brief  Sleep until all queued flash requests are done.
+  * @return Nothing.
+  */
+void OSPI_WaitIdle(void)
+{
+  while (g_queue_busy) {
+    __WFI();
+  }
+}
+
+/**
+  * @brief  Start polling the status register until the program is done.
+  * @param  hospi: OSPI handle.
+  * @return Nothing.
+  */
+void HAL_OSPI_TxCpltCallback(OSPI_HandleTypeDef *hospi)
+{
+  if (start_wip_polling(hospi, OSPI_POLL_PROGRAM) != 0) {
+    ospi_queue_done(-1);
+  }
+}
+
+/**
+  * @brief  Wake up OSPI_WaitWhileBusy(), or carry on once a queued page is programmed.
+  * @param  hospi: OSPI handle.
+  * @return Nothing.
+  */
+void HAL_OSPI_StatusMatchCallback(OSPI_HandleTypeDef *hospi)
+{
+  if (g_poll_waiting) {
+    g_poll_waiting = 0;
+  } else {
+    ospi_queue_advance();
+  }
+}
+
+/**
+  * @brief  Carry on once a part of a read is in.
+  * @param  hospi: OSPI handle.
+  * @return Nothing.
+  */
+void HAL_OSPI_RxCpltCallback(OSPI_HandleTypeDef *hospi)
+{
+  ospi_queue_advance();
+}
+
+/**
+  * @brief  Fail the request in progress.
+  * @param  hospi: OSPI handle.
+  * @return Nothing.
+  */
+void HAL_OSPI_ErrorCallback(OSPI_HandleTypeDef *hospi)
+{
+  if (g_poll_waiting) {
+    g_poll_waiting = 0;
+  } else if (g_queue_busy) {
+    ospi_queue_done(-1);
+  }
+}
@@ -1,20 +1,26 @@
 #include "stm32h7xx_hal.h"
+#include "flashplan.h"
 
-typedef enum {
-    SPI_MODE  = 0x00,
-    QUAD_MODE = 0x01,
-} quad_mode_t;
+extern flash_info_t g_flash_info;
 
-typedef enum {
-    VENDOR_MX   = 0x00, // MX25U8035F, Nintendo Stock Flash
-    VENDOR_ISSI = 0x01, // IS25WP128F, 128Mb large flash
-} spi_chip_vendor_t;
+typedef void (*ospi_callback_t)(void *context, int status);
 
 void OSPI_Init(OSPI_HandleTypeDef *hospi, quad_mode_t quad_mode, spi_chip_vendor_t vendor);
+void OSPI_InitAuto(OSPI_HandleTypeDef *hospi);
+void OSPI_Probe(OSPI_HandleTypeDef *hospi, flash_info_t *info);
+void OSPI_ReadSFDP(OSPI_HandleTypeDef *hospi, uint32_t address, uint8_t *buffer, size_t buffer_size);
 void OSPI_EnableMemoryMappedMode(OSPI_HandleTypeDef *hospi1);
 void OSPI_Read(OSPI_HandleTypeDef *hospi, uint32_t address, uint8_t *buffer, int32_t buffer_size);
 void OSPI_NOR_WriteEnable(OSPI_HandleTypeDef *hospi);
+void OSPI_WaitWhileBusy(OSPI_HandleTypeDef *hospi, uint16_t interval);
 void OSPI_ChipErase(OSPI_HandleTypeDef *hospi);
 void OSPI_BlockErase(OSPI_HandleTypeDef *hospi, uint32_t address);
+void OSPI_Block32Erase(OSPI_HandleTypeDef *hospi, uint32_t address);
 void OSPI_SectorErase(OSPI_HandleTypeDef *hospi, uint32_t address);
+int OSPI_IsErased(OSPI_HandleTypeDef *hospi, uint32_t address, uint32_t size);
+int OSPI_EraseRange(OSPI_HandleTypeDef *hospi, uint32_t address, uint32_t size, uint8_t skip_erased);
 void OSPI_Program(OSPI_HandleTypeDef *hospi, uint32_t address, uint8_t *buffer, int32_t buffer_size);
+int OSPI_ReadAsync(OSPI_HandleTypeDef *hospi, uint32_t address, uint8_t *buffer, uint32_t buffer_size, ospi_callback_t callback, void *context);
+int OSPI_ProgramAsync(OSPI_HandleTypeDef *hospi, uint32_t address, const uint8_t *buffer, uint32_t buffer_size, ospi_callback_t callback, void *context);
+int OSPI_IsBusy(void);
+void OSPI_WaitIdle(void);
@@ -0,0 +1,48 @@
+#include "flashplan.h"
+
+/**
+  * @brief  Work out the read command for a request, or for the next part of it.
+  *         FAST_READ and the quad read have no length or alignment limits of their
+  *         own, only the end of the chip stops them.
+  * @param  plan: Filled in with the command to send.
+  * @param  info: Flash parameters, for the size and the quad read instruction.
+  * @param  quad_mode: SPI_MODE or QUAD_MODE, the mode the flash is in.
+  * @param  vendor: VENDOR_MX or VENDOR_ISSI. Depends on the chip used.
+  * @param  address: Source address.
+  * @param  size: Number of bytes left to read.
+  * @param  max_length: Most bytes one command may read, 0 for no limit.
+  * @return Number of bytes the command reads, 0 if there is nothing to read.
+  */
+uint32_t ospi_plan_read(ospi_read_plan_t *plan, const flash_info_t *info, quad_mode_t quad_mode, spi_chip_vendor_t vendor, uint32_t address, int32_t size, uint32_t max_length)
+{
+  uint32_t chip_size = (uint32_t)1 << info->size_log2;
+
+  if (quad_mode == QUAD_MODE) {
+    plan->instruction       = info->quad_read;
+    plan->dummy_cycles      = info->quad_dummy;
+    // ISSI chips in QPI mode take the instruction on all four lines too
+    plan->instruction_lines = (vendor == VENDOR_ISSI) ? 4 : 1;
+    plan->address_lines     = 4;
+    plan->data_lines        = 4;
+  } else {
+    plan->instruction       = 0x0B; // FAST_READ
+    plan->dummy_cycles      = 8;
+    plan->instruction_lines = 1;
+    plan->address_lines     = 1;
+    plan->data_lines        = 1;
+  }
+
+  plan->address = address;
+  plan->length  = (size > 0 && address < chip_size) ? (uint32_t)size : 0;
+
+  // The OSPI flags a transfer error for anything past the DeviceSize
+  if (plan->length > chip_size - address) {
+    plan->length = chip_size - address;
+  }
+
+  if (max_length != 0 && plan->length > max_length) {
+    plan->length = max_length;
+  }
+
+  return plan->length;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdint.h>
+
+// The parts of the flash driver that do not touch the HAL, so that they also build on the PC
+
+typedef enum {
+    SPI_MODE  = 0x00,
+    QUAD_MODE = 0x01,
+} quad_mode_t;
+
+typedef enum {
+    VENDOR_MX   = 0x00, // MX25U8035F, Nintendo Stock Flash
+    VENDOR_ISSI = 0x01, // IS25WP128F, 128Mb large flash
+} spi_chip_vendor_t;
+
+typedef enum {
+    QE_NONE         = 0x00, // No quad enable bit
+    QE_SR1_BIT6     = 0x01, // Bit 6 of the status register (Macronix, ISSI)
+    QE_SR2_BIT1     = 0x02, // Bit 1 of status register 2, written together with status register 1
+    QE_SR2_BIT1_31H = 0x03, // Bit 1 of status register 2, written on its own with 0x31
+    QE_SR2_BIT7     = 0x04, // Bit 7 of status register 2, read with 0x3F and written with 0x3E
+} quad_enable_t;
+
+typedef struct {
+    uint8_t manufacturer;      // JEDEC ID
+    uint8_t memory_type;
+    uint8_t capacity;
+    uint8_t has_sfdp;          // Set if the rest comes from the SFDP tables
+    uint8_t size_log2;         // Size in bytes as a power of two, as the OSPI DeviceSize wants it
+    quad_enable_t quad_enable;
+    uint8_t quad_read;         // 1-4-4 read instruction, 0 if not supported
+    uint8_t quad_dummy;        // Dummy cycles of the 1-4-4 read, mode clocks included
+    uint8_t erase_32k;         // 32 kB block erase instruction, 0 if not supported
+} flash_info_t;
+
+typedef struct {
+    uint8_t instruction;
+    uint8_t dummy_cycles;
+    uint8_t instruction_lines; // 1 or 4
+    uint8_t address_lines;     // 1 or 4, the address is always 24 bits
+    uint8_t data_lines;        // 1 or 4
+    uint32_t address;
+    uint32_t length;           // Bytes read by this command
+} ospi_read_plan_t;
+
+uint32_t ospi_plan_read(ospi_read_plan_t *plan, const flash_info_t *info, quad_mode_t quad_mode, spi_chip_vendor_t vendor, uint32_t address, int32_t size, uint32_t max_length);
@@ -1,5 +1,5 @@
 /*
- * Generic FAT16 filesystem I/O library
+ * Generic FAT16/FAT32 filesystem I/O library
  * Written by Michal Procházka, 2021.
  * 
  * Docs: http://www.maverick-os.dk/FileSystemFormats/FAT16_FileSystem.html
@@ -8,13 +8,13 @@
 #include "fslib.h"
 
 //#define FSDEBUG
+#define FSDIRINDEX
 
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <ctype.h>
-#include <fnmatch.h>
 
 #ifdef FSDEBUG
 #include <stdio.h>
@@ -27,286 +27,2504 @@
 #define errptr(...) return NULL
 #endif
 
-uint8_t *image;
+#define FS_CHAIN_END 0x0FFFFFF8
 
-BIOSParams fsinfo;
+#define FS_SECTOR_SIZE 512
+#define FS_READ_SLOTS 4
 
-uint16_t *fat;
-DirEntry *rootdir;
+#define FS_ERASE_SIZE 4096
+#define FS_CACHE_SLOTS 4
 
-int currentdir, currentdirsize;
-int datasector;
-int freespace;
+#define FS_INDEX_DIRS 2
+#define FS_INDEX_SLOTS 1024
 
-int fsgetfilesector(int startclust, int offset) {
-	int i;
+#define FS_GENERATION_START 0x60
+#define FS_GENERATION_OFFSET 0x1F8
+#define FS_GENERATION_BITS ((FS_GENERATION_OFFSET - FS_GENERATION_START) * 8)
 
-	for(i = 0; i < offset; i++) {
-		if(startclust == 0xFFFF) return 0;
-		startclust = fat[startclust];
-	}
+#define FS_CRC_FILE "CRC32.SFV"
+#define FS_CRC_CHUNK 65536
+#define FS_NO_CRC 0xFFFFFFFF
+
+#define FS_LOG_BLOCK 1
+#define FS_LOG_IMAGES 2
+#define FS_LOG_BLOCKS (2 + FS_LOG_IMAGES)
+#define FS_LOG_MAGIC 0x474F4C52
+
+#define FS_DEFRAG_MAGIC 0x47464544
+#define FS_DEFRAG_DEPTH 4
+#define FS_DEFRAG_PASSES 4
 
-	return startclust + datasector - 2;
+FsVolume mainvolume;
+FsDir currentdir;
+
+void fsmemcpy(uint8_t *dest, const uint8_t *src, uint32_t size) {
+	memcpy(dest, src, size);
 }
 
-int fsgetclustlength(int startclust) {
-	int i;
+void fsnowait() {
+}
+
+FsCopyStart copystart = fsmemcpy;
+FsCopyWait copywait = fsnowait;
 
-	for(i = 0; ; i++) {
-		if(startclust >= 0xFFF8) return i;
-		startclust = fat[startclust];
+uint32_t fscrc32(uint32_t crc, const uint8_t *data, uint32_t size) {
+	static const uint32_t table[16] = {
+		0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+		0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+	};
+
+	// The usual CRC-32 of zlib and SFV files, a nibble at a time
+
+	crc = ~crc;
+
+	while(size--) {
+		crc ^= *data++;
+		crc = (crc >> 4) ^ table[crc & 15];
+		crc = (crc >> 4) ^ table[crc & 15];
 	}
-}
 
-DirEntry *fsreaddirentry(int id) {
-	if(currentdir == 0)
-		return &rootdir[id];
-	else
-		return &((DirEntry *)(image + fsgetfilesector(currentdir, id * sizeof(DirEntry) / fsinfo.BytesPerSector) * fsinfo.BytesPerSector))[id % (fsinfo.BytesPerSector / sizeof(DirEntry))];
+	return ~crc;
 }
 
-void fatname_to_filename(char *src, char *dest) {
+FsCrcUpdate crcupdate = fscrc32;
+
+typedef struct {
+	FsVolume *Volume;
+	int Sector;
+	uint32_t LastUse;
+	uint8_t Data[FS_SECTOR_SIZE];
+} FsReadSlot;
+
+FsReadSlot readcache[FS_READ_SLOTS];
+uint32_t readcacheclock;
+
+typedef struct {
+	FsVolume *Volume;
+	int Block;
+	int Dirty;
+	int Whole;
+	uint32_t LastUse;
+	uint8_t Data[FS_ERASE_SIZE];
+} FsCacheSlot;
+
+FsCacheSlot writecache[FS_CACHE_SLOTS];
+uint32_t writecacheclock;
+
+FsWriteStats writestats;
+
+// Erasing a block that still holds something needed loses it if the power goes
+// out before it is written back. Volumes with enough reserved sectors keep a
+// log right after the boot sector for that: a block for the defrag marker, one
+// for these records and the rest for copies of the new content of the block.
+// A block of a FAT mirror needs no copy if the FAT before it holds the same
+// content already, the record points there instead. A record is only valid
+// once its copy is complete, and is cleared once the block is written. Any
+// record still valid is replayed on the next mount. Records are padded to
+// 32 bytes, so that none of them crosses a sector.
+
+typedef struct {
+	uint32_t Magic;
+	uint32_t Block;
+	uint32_t Source;
+	uint32_t Crc;
+	uint32_t HeaderCrc;
+	uint32_t Padding[3];
+} FsLogRecord;
+
+uint8_t logsector[FS_SECTOR_SIZE];
+
+// A file being moved by fsdefragvolume(), kept in the log until it is done
+
+typedef struct {
+	uint32_t Magic;
+	uint32_t Crc;
+	uint32_t Entry;
+	uint32_t Prev;
+	uint32_t NewCluster;
+	uint32_t Clusters;
+	uint32_t Next;
+	uint32_t Count;
+	FsExtent Runs[FS_MAX_EXTENTS];
+} FsDefragMarker;
+
+FsDefragMarker defragmarker;
+uint32_t defragaddress;
+FsExtentCache defragextents;
+FsDir defragdirs[FS_DEFRAG_DEPTH];
+int defragpos[FS_DEFRAG_DEPTH];
+
+#ifdef FSDIRINDEX
+typedef struct {
+	FsVolume *Volume;
+	int Dir;
+	int Overflow;
+	uint32_t LastUse;
+	uint16_t Slots[FS_INDEX_SLOTS];
+} FsDirIndex;
+
+FsDirIndex dirindex[FS_INDEX_DIRS];
+uint32_t dirindexclock;
+#endif
+
+void fsdropreadcache(FsVolume *vol, uint32_t address, uint32_t size) {
 	int i;
 
-	// Copy the base name
+	for(i = 0; i < FS_READ_SLOTS; i++)
+		if(readcache[i].Volume == vol && (uint32_t)readcache[i].Sector * FS_SECTOR_SIZE - address < size)
+			readcache[i].Volume = NULL;
+}
 
-	for(i = 0; i < 8; i++)
-		if(src[i] != ' ')
-			*dest++ = src[i];
-		else
-			break;
+uint8_t *fsaccess(FsVolume *vol, uint32_t address) {
+	int i, sector = address / FS_SECTOR_SIZE;
+	FsReadSlot *slot = &readcache[0];
 
-	// If the file has an extension, add a period and copy the extension
+	// Memory-mapped devices are read in place
 
-	if(src[8] != ' ') {
-		*dest++ = '.';
+	if(vol->Device->Mapped != NULL) return vol->Device->Mapped + address;
 
-		for(i = 0; i < 3; i++)
-			if(src[i + 8] != ' ')
-				*dest++ = src[i + 8];
-			else
-				break;
+	for(i = 0; i < FS_READ_SLOTS; i++) {
+		if(readcache[i].Volume == vol && readcache[i].Sector == sector) {
+			readcache[i].LastUse = ++readcacheclock;
+			return readcache[i].Data + address % FS_SECTOR_SIZE;
+		}
+
+		if(readcache[i].LastUse < slot->LastUse) slot = &readcache[i];
 	}
 
-	// Zero-terminate the string
+	slot->Volume = vol;
+	slot->Sector = sector;
+	slot->LastUse = ++readcacheclock;
 
-	*dest = 0;
+	if(vol->Device->ReadSector(vol->Device, sector, slot->Data, 1)) {
+		// Reads as an empty dir entry and a free cluster, which ends any walk
+
+		msg("Could not read sector %d!\n", sector);
+
+		memset(slot->Data, 0, FS_SECTOR_SIZE);
+		slot->Volume = NULL;
+	}
+
+	return slot->Data + address % FS_SECTOR_SIZE;
 }
 
-void filename_to_fatname(char *src, char *dest) {
-	int ptr = 0, i;
+int fsdevread(FsVolume *vol, uint32_t address, uint8_t *buffer, uint32_t size) {
+	uint32_t len, count;
 
-	// Special case for ".."
+	if(vol->Device->Mapped != NULL) {
+		copystart(buffer, vol->Device->Mapped + address, size);
+		return 0;
+	}
 
-	if(!strcmp(src, "..")) {
-		memcpy(dest, "..         ", 11);
-		return;
+	while(size > 0) {
+		if(address % FS_SECTOR_SIZE == 0 && size >= FS_SECTOR_SIZE) {
+			// Whole sectors go straight to the buffer
+
+			count = size / FS_SECTOR_SIZE;
+			len = count * FS_SECTOR_SIZE;
+
+			if(vol->Device->ReadSector(vol->Device, address / FS_SECTOR_SIZE, buffer, count)) err("Could not read at 0x%08X!\n", (unsigned)address);
+		} else {
+			// Partial sectors go through the sector cache
+
+			len = FS_SECTOR_SIZE - address % FS_SECTOR_SIZE;
+			if(len > size) len = size;
+
+			memcpy(buffer, fsaccess(vol, address), len);
+		}
+
+		address += len;
+		buffer += len;
+		size -= len;
 	}
 
-	// Copy the base name
+	return 0;
+}
 
-	for(i = 0; i < 8; i++)
-		if(src[ptr] != '.' && src[ptr] != 0)
-			dest[i] = toupper(src[ptr++]);
-		else
-			break;
+int fsblank(const uint8_t *data, uint32_t size) {
+	while(size--)
+		if(*data++ != 0xFF) return 0;
 
-	// Fill the rest of the base name with blank space
+	return 1;
+}
 
-	for(; i < 8; i++) dest[i] = ' ';
+int fsdeverase(FsVolume *vol, uint32_t address) {
+	FsBlockDevice *dev = vol->Device;
 
-	// Skip the rest of the base name if it is larger than 8 chars
+	fsdropreadcache(vol, address, FS_ERASE_SIZE);
 
-	while(src[ptr] != '.' && src[ptr] != 0) ptr++;
+	if(dev->Erase != NULL && dev->Erase(dev, address)) err("Could not erase block at 0x%08X!\n", (unsigned)address);
 
-	// If the filename ends here, pad the extension with blank space
+	writestats.Erases++;
 
-	if(src[ptr] == 0) {
-		for(i = 8; i < 11; i++) dest[i] = ' ';
-		return;
+	return 0;
+}
+
+int fsdevprogram(FsVolume *vol, uint32_t address, const uint8_t *data, uint32_t size) {
+	FsBlockDevice *dev = vol->Device;
+	uint32_t sector = address / FS_SECTOR_SIZE, count = size / FS_SECTOR_SIZE, i, len;
+	const uint8_t *src = data;
+
+	// Whole sectors are written as they are, a part of one along with the rest of it
+
+	if(address % FS_SECTOR_SIZE || size % FS_SECTOR_SIZE) {
+		memcpy(logsector, fsaccess(vol, sector * FS_SECTOR_SIZE), FS_SECTOR_SIZE);
+		memcpy(logsector + address % FS_SECTOR_SIZE, data, size);
+
+		src = logsector;
+		count = 1;
 	}
 
-	// Point to the source extension
+	fsdropreadcache(vol, sector * FS_SECTOR_SIZE, count * FS_SECTOR_SIZE);
 
-	ptr++;
+	if(dev->WriteSector(dev, sector, src, count)) err("Could not write sector %d!\n", (int)sector);
 
-	// Copy the extension
+	writestats.Programs += count;
 
-	for(i = 8; i < 11; i++)
-		if(src[ptr] != 0)
-			dest[i] = toupper(src[ptr++]);
-		else
-			break;
+	for(i = 0; i < size; i += len) {
+		len = FS_SECTOR_SIZE - (address + i) % FS_SECTOR_SIZE;
+		if(len > size - i) len = size - i;
 
-	// Fill the rest of the extension with blank space
+		if(memcmp(fsaccess(vol, address + i), data + i, len)) err("Sector %d did not take the write!\n", (int)((address + i) / FS_SECTOR_SIZE));
+	}
 
-	for(; i < 11; i++) dest[i] = ' ';
+	return 0;
+}
+
+int fsgetfat(FsVolume *vol, int clust) {
+	int value;
+
+	if(vol->Fat32) return *(uint32_t *)fsaccess(vol, vol->FatOffset + clust * 4) & 0x0FFFFFFF;
+
+	// Widen the FAT16 bad cluster and end of chain marks to their FAT32 values
+
+	value = *(uint16_t *)fsaccess(vol, vol->FatOffset + clust * 2);
+
+	return (value >= 0xFFF7) ? value | 0x0FFF0000 : value;
 }
 
-void updatefreespace() {
-	freespace = 0;
-	
+int fsgetfatpending(FsVolume *vol, int clust) {
+	uint32_t address = vol->FatOffset + clust * 4;
 	int i;
-	for(i = 0; i < fsinfo.LogicalSectors - datasector; i++) {
-		if(fat[i + 2] == 0) freespace += fsinfo.BytesPerSector;
-	}
 
-	freespace /= 1024;
+	// Same as above, but sees FAT32 changes still sitting in the write cache.
+	// Only FAT32 has clusters past the free map, which is all this is used for.
+
+	if(!vol->Fat32) return fsgetfat(vol, clust);
+
+	for(i = 0; i < FS_CACHE_SLOTS; i++)
+		if(writecache[i].Volume == vol && writecache[i].Block == (int)(address / FS_ERASE_SIZE))
+			return *(uint32_t *)(writecache[i].Data + address % FS_ERASE_SIZE) & 0x0FFFFFFF;
+
+	return fsgetfat(vol, clust);
 }
 
-int fsgetfreespace() {
-	return freespace;
+int fsentrycluster(FsVolume *vol, DirEntry *entry) {
+	return entry->StartCluster | (vol->Fat32 ? entry->StartClusterHigh << 16 : 0);
 }
 
-int fsmount(uint8_t *fsimage) {
-	// First of all, check if the compiler hadn't messed with our structs
+uint32_t fsclusteroffset(FsVolume *vol, int clust) {
+	return (vol->DataSector + (clust - 2) * vol->Info.SectorsPerCluster) * vol->Info.BytesPerSector;
+}
 
-	assert(sizeof(BIOSParams) == 59);
-	assert(sizeof(DirEntry) == 32);
+void fsbuildextents(FsExtentCache *cache, FsVolume *vol, int startclust) {
+	FsExtent *run = NULL;
+
+	cache->Volume = vol;
+	cache->StartCluster = startclust;
+	cache->Count = 0;
+	cache->Tail = 0xFFFFFFFF;
+	cache->HintRun = 0;
+	cache->HintOffset = 0;
+	cache->Clusters = 0;
+
+	// Walk the chain once, merging consecutive clusters into runs
+
+	while(startclust >= 2 && startclust < FS_CHAIN_END) {
+		if(run != NULL && run->Cluster + run->Length == (uint32_t)startclust) {
+			run->Length++;
+		} else if(cache->Count < FS_MAX_EXTENTS) {
+			run = &cache->Runs[cache->Count++];
+			run->Cluster = startclust;
+			run->Length = 1;
+		} else {
+			// Out of runs, remember where the rest of the chain continues
+
+			cache->Tail = startclust;
+			cache->TailOffset = cache->Clusters;
+			cache->CursorCluster = startclust;
+			cache->CursorOffset = cache->Clusters;
+			break;
+		}
 
-	// Copy the BIOS filesystem parameters
+		cache->Clusters++;
+		startclust = fsgetfat(vol, startclust);
+	}
 
-	memcpy(&fsinfo, fsimage + 3, sizeof(BIOSParams));
+	// Count whatever did not fit into the cache
 
-	msg("Mounting volume \"%.11s\", filesystem %.8s\n", fsinfo.VolumeLabel, fsinfo.FileSystem);
-	msg("Disk contains %d sectors, %d bytes each.\n", fsinfo.LogicalSectors, fsinfo.BytesPerSector);
+	for(; startclust >= 2 && startclust < FS_CHAIN_END; startclust = fsgetfat(vol, startclust))
+		cache->Clusters++;
 
-	// Check the validity of the filesystem
+	msg("Cluster %d: %d cluster(s) in %d run(s)\n", cache->StartCluster, (int)cache->Clusters, cache->Count);
+}
 
-	if(memcmp(fsinfo.FileSystem, "FAT16   ", 8)) err("Incompatible filesystem!\n");
-	if(fsinfo.NumberOfFats != 1) err("Only 1 FAT is supported!\n");
-	if(fsinfo.SectorsPerCluster != 1) err("Only 1 sector per cluster is supported!\n");
+int fsextentcluster(FsExtentCache *cache, uint32_t offset) {
+	int i = 0, clust;
+	uint32_t base = 0;
 
-	// Initialize some variables
+	if(offset >= cache->Clusters) return 0;
+
+	// A contiguous chain is a single run, there is nothing to search
+
+	if(cache->Count == 1 && offset < cache->Runs[0].Length) return cache->Runs[0].Cluster + offset;
 
-	image = fsimage;
+	// Resume from the last run hit, since sequential access is the common case
 
-	fat = (uint16_t *)(image + fsinfo.ReservedSectors * fsinfo.BytesPerSector);
-	rootdir = (DirEntry *)(image + (fsinfo.ReservedSectors + fsinfo.SectorsPerFat) * fsinfo.BytesPerSector);
+	if(offset >= cache->HintOffset) {
+		i = cache->HintRun;
+		base = cache->HintOffset;
+	}
 
-	datasector = fsinfo.ReservedSectors + fsinfo.SectorsPerFat + (fsinfo.RootDirEntries * sizeof(DirEntry)) / fsinfo.BytesPerSector;
-	if((fsinfo.RootDirEntries * sizeof(DirEntry)) % fsinfo.BytesPerSector) datasector++;
+	for(; i < cache->Count; i++) {
+		if(offset < base + cache->Runs[i].Length) {
+			cache->HintRun = i;
+			cache->HintOffset = base;
 
-	msg("First usable cluster points to disk sector %d.\n\n", datasector);
+			return cache->Runs[i].Cluster + (offset - base);
+		}
 
-	currentdir = 0;
-	currentdirsize = fsinfo.RootDirEntries;
+		base += cache->Runs[i].Length;
+	}
 
-	updatefreespace();
+	// The chain did not fit into the cache, walk the FAT for the rest,
+	// continuing from the last position if possible
 
-	return 0;
+	if(offset >= cache->CursorOffset) {
+		clust = cache->CursorCluster;
+		base = cache->CursorOffset;
+	} else {
+		clust = cache->Tail;
+		base = cache->TailOffset;
+	}
+
+	for(; base < offset; base++)
+		clust = fsgetfat(cache->Volume, clust);
+
+	cache->CursorCluster = clust;
+	cache->CursorOffset = offset;
+
+	return clust;
 }
 
-DirEntry *fsreaddir(int dirs_only, int *entries) {
-	DirEntry *output = malloc(currentdirsize * sizeof(DirEntry));
+uint32_t fsextentrun(FsExtentCache *cache, uint32_t offset, int *clust) {
+	uint32_t length;
+	FsExtent *run;
 
-	msg("Allocated enough memory for %d entries\n", currentdirsize);
+	if((*clust = fsextentcluster(cache, offset)) == 0) return 0;
 
-	int i, ptr = 0;
-	char buf[16];
-	DirEntry *tmp;
+	run = &cache->Runs[cache->HintRun];
 
-	for(i = 0; i < currentdirsize; i++) {
-		tmp = fsreaddirentry(i);
+	// Inside a cached run, the rest of the run is known already
 
-		if(tmp->Basename[0] == 0) break;
+	if(offset >= cache->HintOffset && offset < cache->HintOffset + run->Length)
+		return cache->HintOffset + run->Length - offset;
 
-		if((uint8_t)tmp->Basename[0] == 0xE5) continue;
+	// Past the cached runs, merge consecutive clusters while following the FAT
 
-		if(tmp->Attribute & 8) continue;
+	for(length = 1; fsgetfat(cache->Volume, *clust + length - 1) == (int)(*clust + length); length++);
+
+	return length;
+}
+
+void fsrefreshdir(FsDir *dir) {
+	FsVolume *vol = dir->Volume;
 
-		fatname_to_filename((char *)tmp, buf);
+	if(dir->Cluster == 0) {
+		dir->Size = vol->Info.RootDirEntries;
+	} else {
+		fsbuildextents(&dir->Extents, vol, dir->Cluster);
 
-		if(!dirs_only || (tmp->Attribute & 0x10))
-			memcpy(output + ptr++, tmp, sizeof(DirEntry));
+		dir->Size = dir->Extents.Clusters * (vol->ClusterSize / sizeof(DirEntry));
 	}
 
-	msg("Found %d entr%s\n\n", ptr, (ptr == 1) ? "y" : "ies");
+	dir->Generation = vol->Generation;
+}
 
-	*entries = ptr;
-	return output;
+void fscheckdir(FsDir *dir) {
+	// The dir might have grown since the handle was opened
+
+	if(dir->Generation != dir->Volume->Generation) fsrefreshdir(dir);
+}
+
+uint32_t fsdirentryaddress(FsDir *dir, int id) {
+	FsVolume *vol = dir->Volume;
+	int perCluster = vol->ClusterSize / sizeof(DirEntry);
+
+	if(dir->Cluster == 0)
+		return vol->RootOffset + id * sizeof(DirEntry);
+
+	// A dir in a single run is laid out like the FAT16 root
+
+	if(dir->Extents.Count == 1 && id * sizeof(DirEntry) < dir->Extents.Runs[0].Length * vol->ClusterSize)
+		return fsclusteroffset(vol, dir->Extents.Runs[0].Cluster) + id * sizeof(DirEntry);
+
+	return fsclusteroffset(vol, fsextentcluster(&dir->Extents, id / perCluster)) + (id % perCluster) * sizeof(DirEntry);
+}
+
+DirEntry *fsreaddirentry(FsDir *dir, int id) {
+	return (DirEntry *)fsaccess(dir->Volume, fsdirentryaddress(dir, id));
 }
 
-DirEntry *fsfindfile(char *filename) {
+// Where the 13 UCS-2 characters sit in a long name entry
+
+const uint8_t fslongoffsets[13] = {1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30};
+
+uint8_t fsshortchecksum(char *fatname) {
+	uint8_t sum = 0;
 	int i;
-	char buf[16];
+
+	for(i = 0; i < 11; i++)
+		sum = ((sum & 1) << 7) + (sum >> 1) + (uint8_t)fatname[i];
+
+	return sum;
+}
+
+void fsaddlongpiece(FsDirIter *it, uint8_t *raw) {
+	int ord = raw[0] & 0x1F, i, pos;
+	uint16_t c;
+
+	// The pieces come last one first, anything out of order drops the name
+
+	if(raw[0] & 0x40) {
+		memset(it->Name, 0, sizeof(it->Name));
+		it->LongChecksum = raw[13];
+	} else if(ord != it->LongNext || raw[13] != it->LongChecksum) {
+		it->LongNext = 0;
+		return;
+	}
+
+	if(ord == 0) {
+		it->LongNext = 0;
+		return;
+	}
+
+	// Only ASCII is kept, the font has nothing else anyway
+
+	for(i = 0; i < 13; i++) {
+		c = raw[fslongoffsets[i]] | raw[fslongoffsets[i] + 1] << 8;
+		pos = (ord - 1) * 13 + i;
+
+		if(c == 0 || pos >= FS_MAX_NAME - 1) break;
+
+		it->Name[pos] = (c < 0x80) ? c : '?';
+	}
+
+	it->LongNext = (ord == 1) ? 0xFF : ord - 1;
+}
+
+int fsdir_open(FsDirIter *it, FsDir *dir, uint8_t require, uint8_t exclude) {
+	fscheckdir(dir);
+
+	it->Dir = dir;
+	it->Index = 0;
+	it->Position = 0;
+	it->Require = require;
+	it->Exclude = exclude;
+	it->LongNext = 0;
+	it->Pattern = NULL;
+	it->Contains = NULL;
+	it->Name[0] = 0;
+
+	return 0;
+}
+
+// Matches the pattern up to end, ignoring case the way the lookups do. Only
+// '*' and '?' are special. After a mismatch the last '*' takes one more char.
+
+int fsmatchpart(const char *pattern, const char *end, const char *name) {
+	const char *star = NULL, *retry = NULL;
+
+	while(*name != 0) {
+		if(pattern < end && *pattern == '*') {
+			star = ++pattern;
+			retry = name;
+		} else if(pattern < end && (*pattern == '?' || toupper((uint8_t)*pattern) == toupper((uint8_t)*name))) {
+			pattern++;
+			name++;
+		} else if(star != NULL) {
+			pattern = star;
+			name = ++retry;
+		} else return 0;
+	}
+
+	while(pattern < end && *pattern == '*') pattern++;
+
+	return pattern == end;
+}
+
+// A pattern can list alternatives separated by '|'
+
+int fsmatch(const char *pattern, const char *name) {
+	const char *end;
+
+	for(; (end = strchr(pattern, '|')) != NULL; pattern = end + 1)
+		if(fsmatchpart(pattern, end, name)) return 1;
+
+	return fsmatchpart(pattern, pattern + strlen(pattern), name);
+}
+
+void fsdir_filter(FsDirIter *it, const char *pattern, const char *contains) {
+	it->Pattern = pattern;
+	it->Contains = contains;
+}
+
+// Only the 8.3 names are checked, long names are not put together here
+
+int fsdircontains(FsVolume *vol, int clust, const char *pattern) {
+	int perCluster = vol->ClusterSize / sizeof(DirEntry), i;
 	DirEntry *tmp;
+	char name[13];
 
-	filename_to_fatname(filename, buf);
+	// Walk the subdir straight from the FAT, without opening it
 
-	msg("Matching against FAT name \"%.11s\"...\n", buf);
+	for(; clust >= 2 && clust < FS_CHAIN_END; clust = fsgetfat(vol, clust)) {
+		for(i = 0; i < perCluster; i++) {
+			tmp = (DirEntry *)fsaccess(vol, fsclusteroffset(vol, clust) + i * sizeof(DirEntry));
+
+			if(tmp->Basename[0] == 0) return 0;
+			if((uint8_t)tmp->Basename[0] == 0xE5 || (tmp->Attribute & 8)) continue;
+
+			fatname_to_filename((char *)tmp, name);
+
+			if(fsmatch(pattern, name)) return 1;
+		}
+	}
+
+	return 0;
+}
+
+DirEntry *fsdir_next(FsDirIter *it) {
+	DirEntry *tmp;
+	int longname;
+
+	fscheckdir(it->Dir);
 
-	for(i = 0; i < currentdirsize; i++) {
-		tmp = fsreaddirentry(i);
+	while(it->Index < it->Dir->Size) {
+		tmp = fsreaddirentry(it->Dir, it->Index);
 
 		if(tmp->Basename[0] == 0) break;
 
-		if((uint8_t)tmp->Basename[0] == 0xE5) continue;
+		it->Index++;
+
+		if((uint8_t)tmp->Basename[0] == 0xE5) {
+			it->LongNext = 0;
+			continue;
+		}
+
+		if(tmp->Attribute == 0x0F) {
+			fsaddlongpiece(it, (uint8_t *)tmp);
+			continue;
+		}
+
+		// A long name only belongs to the entry right after it
+
+		longname = (it->LongNext == 0xFF && it->LongChecksum == fsshortchecksum((char *)tmp));
+		it->LongNext = 0;
 
 		if(tmp->Attribute & 8) continue;
 
-		if(!memcmp(tmp, buf, 11))
-			return tmp;
+		if((tmp->Attribute & it->Require) != it->Require || (tmp->Attribute & it->Exclude)) continue;
+
+		if(!longname) fatname_to_filename((char *)tmp, it->Name);
+
+		if(it->Pattern != NULL && !fsmatch(it->Pattern, it->Name)) continue;
+
+		// Looking inside the subdir may reuse the sector the entry was read from
+
+		if(it->Contains != NULL) {
+			if(!(tmp->Attribute & 0x10) || !fsdircontains(it->Dir->Volume, fsentrycluster(it->Dir->Volume, tmp), it->Contains)) continue;
+
+			tmp = fsreaddirentry(it->Dir, it->Index - 1);
+		}
+
+		it->Position++;
+
+		return tmp;
 	}
 
 	return NULL;
 }
 
-int fschdir(char *filename) {
-	DirEntry *entry;
+int fsdir_nametable(FsNameTable *table, FsDir *dir, uint8_t require, uint8_t exclude, char *buffer, uint32_t size) {
+	FsDirIter it;
 
-	msg("Searching for dir \"%s\"...\n", filename);
+	fsdir_open(&it, dir, require, exclude);
 
-	if(!strcmp(filename, "/")) {
-		msg("Override: enter root directory\n");
+	return fsdir_nametableiter(table, &it, buffer, size);
+}
 
-		currentdir = 0;
-	} else if((entry = fsfindfile(filename)) != NULL) {
-		if(!(entry->Attribute & 0x10)) err("\"%s\" is not a dir!\n", filename);
+int fsdir_nametableiter(FsNameTable *table, FsDirIter *it, char *buffer, uint32_t size) {
+	FsDir *dir = it->Dir;
+	FsNameRef *refs;
+	uint32_t used = 0, len;
 
-		currentdir = entry->StartCluster;
-	} else err("Could not find dir \"%s\"!\n", filename);
+	// Names are packed from the front of the buffer, references from the back
 
-	if(currentdir == 0)
-		currentdirsize = fsinfo.RootDirEntries;
-	else
-		currentdirsize = fsgetclustlength(currentdir) * (fsinfo.BytesPerSector / sizeof(DirEntry));
+	size &= ~3;
+	refs = (FsNameRef *)(buffer + size);
 
-	msg("Found dir \"%s\" on cluster %d, max %d entries\n", filename, currentdir, currentdirsize);
-	return 0;
-}
+	table->Dir = dir;
+	table->Buffer = buffer;
+	table->Size = size;
+	table->Count = 0;
+	table->Complete = 1;
 
-long fsloadfile(char *filename, uint8_t *buffer, uint32_t maxsize) {
-	DirEntry *entry;
-	int i, j = 0, size, sect;
+	// The iterator comes freshly opened, with its filters set
 
-	msg("Searching for file \"%s\"...\n", filename);
-	
-	if((entry = fsfindfile(filename)) != NULL) {
-		if(entry->Attribute & 0x10) err("\"%s\" is a dir, not a file!\n", filename);
+	table->Generation = dir->Generation;
 
-		size = entry->Size;
-		i = (size < maxsize) ? size : maxsize;
+	while(fsdir_next(it) != NULL) {
+		len = strlen(it->Name) + 1;
 
-		sect = entry->StartCluster;
+		if(used + len + (table->Count + 1) * sizeof(FsNameRef) > size || used + len > 0xFFFF || it->Index > 0xFFFF) {
+			table->Complete = 0;
+			break;
+		}
 
-		while(i > 0) {
-			memcpy(buffer + (j++) * fsinfo.BytesPerSector, image + (sect + datasector - 2) * fsinfo.BytesPerSector, (i > 4096) ? 4096 : i);
+		memcpy(buffer + used, it->Name, len);
 
-			i -= fsinfo.BytesPerSector;
+		refs[-(table->Count + 1)].Name = used;
+		refs[-(table->Count + 1)].Entry = it->Index - 1;
 
-			sect = fat[sect];
-		}
+		used += len;
+		table->Count++;
+	}
 
-		return size;
-	} else err("Could not find file \"%s\"!\n", filename);
+	msg("Name table: %d name(s) in %d bytes\n", table->Count, (int)(used + table->Count * sizeof(FsNameRef)));
+
+	return table->Count;
 }
 
-int fswritefile(char *filename, uint8_t *data, uint32_t size) {
-	return 1;
+const char *fsnametable_name(FsNameTable *table, int id) {
+	if(id < 0 || id >= table->Count) return NULL;
+
+	return table->Buffer + ((FsNameRef *)(table->Buffer + table->Size))[-(id + 1)].Name;
 }
 
-int fsdeletefile(char *filename) {
-	return 1;
+int fsnametable_entry(FsNameTable *table, int id) {
+	// The entry numbers are useless once the dir has changed
+
+	if(id < 0 || id >= table->Count || table->Generation != table->Dir->Volume->Generation) return -1;
+
+	return ((FsNameRef *)(table->Buffer + table->Size))[-(id + 1)].Entry;
+}
+
+#ifdef FSDIRINDEX
+uint32_t fsnamehash(char *fatname) {
+	uint32_t hash = 2166136261u;
+	int i;
+
+	for(i = 0; i < 11; i++)
+		hash = (hash ^ (uint8_t)fatname[i]) * 16777619u;
+
+	return hash;
+}
+
+void fsdropindex(FsVolume *vol) {
+	int i;
+
+	for(i = 0; i < FS_INDEX_DIRS; i++) {
+		if(dirindex[i].Volume == vol) {
+			dirindex[i].Volume = NULL;
+			dirindex[i].LastUse = 0;
+		}
+	}
 }
 
+FsDirIndex *fsgetindex(FsDir *dir) {
+	int i, used = 0;
+	uint32_t slot;
+	FsDirIndex *index = &dirindex[0];
+	FsDirIter it;
+	DirEntry *tmp;
+
+	// Reuse the index of this dir if we have one, otherwise evict the oldest
+
+	for(i = 0; i < FS_INDEX_DIRS; i++) {
+		if(dirindex[i].Volume == dir->Volume && dirindex[i].Dir == dir->Cluster) {
+			dirindex[i].LastUse = ++dirindexclock;
+			return dirindex[i].Overflow ? NULL : &dirindex[i];
+		}
+
+		if(dirindex[i].LastUse < index->LastUse) index = &dirindex[i];
+	}
+
+	msg("Building index for dir on cluster %d\n", dir->Cluster);
+
+	memset(index->Slots, 0, sizeof(index->Slots));
+	index->Volume = dir->Volume;
+	index->Dir = dir->Cluster;
+	index->Overflow = 0;
+	index->LastUse = ++dirindexclock;
+
+	fsdir_open(&it, dir, 0, 0);
+
+	while((tmp = fsdir_next(&it)) != NULL) {
+		// Keep the table at most 3/4 full, larger dirs fall back to a linear scan
+
+		if(++used > FS_INDEX_SLOTS * 3 / 4) {
+			index->Overflow = 1;
+			return NULL;
+		}
+
+		slot = fsnamehash((char *)tmp);
+
+		while(index->Slots[slot % FS_INDEX_SLOTS] != 0)
+			slot++;
+
+		index->Slots[slot % FS_INDEX_SLOTS] = it.Index;
+	}
+
+	return index;
+}
+#endif
+
+void fatname_to_filename(char *src, char *dest) {
+	int i;
+
+	// Copy the base name
+
+	for(i = 0; i < 8; i++)
+		if(src[i] != ' ')
+			*dest++ = src[i];
+		else
+			break;
+
+	// If the file has an extension, add a period and copy the extension
+
+	if(src[8] != ' ') {
+		*dest++ = '.';
+
+		for(i = 0; i < 3; i++)
+			if(src[i + 8] != ' ')
+				*dest++ = src[i + 8];
+			else
+				break;
+	}
+
+	// Zero-terminate the string
+
+	*dest = 0;
+}
+
+void filename_to_fatname(char *src, char *dest) {
+	int ptr = 0, i;
+
+	// Special case for ".."
+
+	if(!strcmp(src, "..")) {
+		memcpy(dest, "..         ", 11);
+		return;
+	}
+
+	// Copy the base name
+
+	for(i = 0; i < 8; i++)
+		if(src[ptr] != '.' && src[ptr] != 0)
+			dest[i] = toupper(src[ptr++]);
+		else
+			break;
+
+	// Fill the rest of the base name with blank space
+
+	for(; i < 8; i++) dest[i] = ' ';
+
+	// Skip the rest of the base name if it is larger than 8 chars
+
+	while(src[ptr] != '.' && src[ptr] != 0) ptr++;
+
+	// If the filename ends here, pad the extension with blank space
+
+	if(src[ptr] == 0) {
+		for(i = 8; i < 11; i++) dest[i] = ' ';
+		return;
+	}
+
+	// Point to the source extension
+
+	ptr++;
+
+	// Copy the extension
+
+	for(i = 8; i < 11; i++)
+		if(src[ptr] != 0)
+			dest[i] = toupper(src[ptr++]);
+		else
+			break;
+
+	// Fill the rest of the extension with blank space
+
+	for(; i < 11; i++) dest[i] = ' ';
+}
+
+int fsshortchar(char c) {
+	return isalnum((uint8_t)c) || (c != 0 && strchr("!#$%&'()-@^_`{}~", c) != NULL);
+}
+
+int fsisshortname(char *filename) {
+	int i;
+
+	if(!strcmp(filename, ".") || !strcmp(filename, "..")) return 1;
+
+	// 1-8 chars of base name and an optional extension of 1-3 chars
+
+	for(i = 0; fsshortchar(filename[i]); i++);
+
+	if(i < 1 || i > 8) return 0;
+
+	if(filename[i] == 0) return 1;
+	if(filename[i++] != '.') return 0;
+
+	filename += i;
+
+	for(i = 0; fsshortchar(filename[i]); i++);
+
+	return i >= 1 && i <= 3 && filename[i] == 0;
+}
+
+int fsnamecmp(char *a, char *b) {
+	while(*a != 0 && toupper((uint8_t)*a) == toupper((uint8_t)*b)) {
+		a++;
+		b++;
+	}
+
+	return toupper((uint8_t)*a) - toupper((uint8_t)*b);
+}
+
+int fsisfree(FsVolume *vol, int clust) {
+	// Past the bitmap, look at the FAT itself
+
+	if(clust >= FS_MAX_CLUSTERS) return fsgetfatpending(vol, clust) == 0;
+
+	return (vol->FreeMap[clust >> 5] >> (clust & 31)) & 1;
+}
+
+void fsmarkcluster(FsVolume *vol, int clust, int isfree) {
+	if(clust < FS_MAX_CLUSTERS) {
+		if(fsisfree(vol, clust) == isfree) return;
+
+		vol->FreeMap[clust >> 5] ^= 1u << (clust & 31);
+	}
+
+	vol->FreeClusters += isfree ? 1 : -1;
+}
+
+void fsbuildfreemap(FsVolume *vol) {
+	uint32_t *pairs = NULL, w;
+	int i, last = vol->TotalClusters + 2;
+
+	memset(vol->FreeMap, 0, sizeof(vol->FreeMap));
+	vol->FreeClusters = 0;
+	vol->FreeMapValid = 1;
+
+	if(vol->Fat32) {
+		for(i = 2; i < last; i++) {
+			if(pairs == NULL || i % (FS_SECTOR_SIZE / 4) == 0) pairs = (uint32_t *)fsaccess(vol, vol->FatOffset + i * 4);
+
+			if((*pairs++ & 0x0FFFFFFF) == 0) fsmarkcluster(vol, i, 1);
+		}
+	} else {
+		// Check two FAT entries per read and skip pairs without a zero half
+
+		for(i = 2; i < last; i += 2) {
+			if(pairs == NULL || i % (FS_SECTOR_SIZE / 2) == 0) pairs = (uint32_t *)fsaccess(vol, vol->FatOffset + i * 2);
+
+			w = *pairs++;
+
+			if(((w - 0x00010001) & ~w & 0x80008000) == 0) continue;
+
+			if((w & 0xFFFF) == 0) fsmarkcluster(vol, i, 1);
+			if((w >> 16) == 0 && i + 1 < last) fsmarkcluster(vol, i + 1, 1);
+		}
+	}
+
+	msg("%d of %d clusters are free\n", vol->FreeClusters, vol->TotalClusters);
+}
+
+void fsloadfreemap(FsVolume *vol) {
+	// The FAT is only scanned once something needs to be allocated or freed
+
+	if(!vol->FreeMapValid) fsbuildfreemap(vol);
+}
+
+int fsfindfreerun(FsVolume *vol, int wanted, int *length) {
+	int clust = 2, start, best = 0, bestlength = 0, last = vol->TotalClusters + 2;
+
+	while(clust < last) {
+		// Skip the rest of a word without any free clusters
+
+		if(clust < FS_MAX_CLUSTERS && (vol->FreeMap[clust >> 5] >> (clust & 31)) == 0) {
+			clust = (clust | 31) + 1;
+			continue;
+		}
+
+		if(!fsisfree(vol, clust)) {
+			clust++;
+			continue;
+		}
+
+		// Measure the run, a whole word at a time where possible
+
+		for(start = clust; clust < last && fsisfree(vol, clust); ) {
+			if((clust & 31) == 0 && clust < FS_MAX_CLUSTERS && clust + 32 <= last && vol->FreeMap[clust >> 5] == 0xFFFFFFFF)
+				clust += 32;
+			else
+				clust++;
+		}
+
+		if(clust - start >= wanted) {
+			*length = clust - start;
+			return start;
+		}
+
+		if(clust - start > bestlength) {
+			best = start;
+			bestlength = clust - start;
+		}
+	}
+
+	// No run is long enough, return the longest one
+
+	*length = bestlength;
+	return best;
+}
+
+int fsgetvolumefreespace(FsVolume *vol) {
+	if(vol->FreeClusters < 0) fsbuildfreemap(vol);
+
+	return vol->FreeClusters * (vol->ClusterSize / 512) / 2;
+}
+
+uint32_t fsgetgeneration(FsVolume *vol) {
+	return vol->DiskGeneration;
+}
+
+uint32_t fsgenerationof(const uint8_t *boot) {
+	uint32_t count, i;
+	uint8_t bits;
+
+	// Rounds done so far, and the bits cleared in this one
+
+	memcpy(&count, boot + FS_GENERATION_OFFSET, sizeof(count));
+	count *= FS_GENERATION_BITS;
+
+	for(i = FS_GENERATION_START; i < FS_GENERATION_OFFSET; i++)
+		for(bits = ~boot[i]; bits != 0; bits &= bits - 1)
+			count++;
+
+	return count;
+}
+
+int fsgetfreespace() {
+	return fsgetvolumefreespace(&mainvolume);
+}
+
+void fssetcopyhooks(FsCopyStart start, FsCopyWait wait) {
+	copystart = (start != NULL) ? start : fsmemcpy;
+	copywait = (wait != NULL) ? wait : fsnowait;
+}
+
+void fssetcrchook(FsCrcUpdate update) {
+	crcupdate = (update != NULL) ? update : fscrc32;
+}
+
+int fsmountvolume(FsVolume *vol, FsBlockDevice *dev) {
+	BIOSParams *fsinfo = &vol->Info;
+	uint32_t *info, sectors;
+	int i;
+
+	// First of all, check if the compiler hadn't messed with our structs
+
+	assert(sizeof(BIOSParams) == 59);
+	assert(sizeof(BIOSParams32) == 54);
+	assert(sizeof(DirEntry) == 32);
+
+	// Forget anything cached from whatever was mounted here before
+
+	fsdropreadcache(vol, 0, 0xFFFFFFFF);
+
+	for(i = 0; i < FS_CACHE_SLOTS; i++) {
+		if(writecache[i].Volume == vol) {
+			writecache[i].Volume = NULL;
+			writecache[i].Dirty = 0;
+			writecache[i].LastUse = 0;
+		}
+	}
+
+#ifdef FSDIRINDEX
+	fsdropindex(vol);
+#endif
+
+	// Dir handles opened before are refreshed on their next use
+
+	vol->Generation++;
+	vol->Device = dev;
+	vol->LogOffset = 0;
+
+	// Finish a block write cut short by a power loss first, it might have been the boot sector
+
+	memcpy(fsinfo, fsaccess(vol, 3), sizeof(BIOSParams));
+
+	if(dev->WriteSector != NULL && (*(uint16_t *)fsaccess(vol, 510) != 0xAA55 || fsinfo->ReservedSectors * fsinfo->BytesPerSector >= (FS_LOG_BLOCK + FS_LOG_BLOCKS) * FS_ERASE_SIZE)) {
+		if(fslogreplay(vol)) err("Could not finish the interrupted write!\n");
+	}
+
+	// Copy the BIOS filesystem parameters
+
+	memcpy(fsinfo, fsaccess(vol, 3), sizeof(BIOSParams));
+	memcpy(&vol->Info32, fsaccess(vol, 36), sizeof(BIOSParams32));
+
+	sectors = fsinfo->LogicalSectors ? fsinfo->LogicalSectors : fsinfo->LargeSectors;
+
+	// FAT32 has no room for its FAT size in the old BPB
+
+	vol->Fat32 = (fsinfo->SectorsPerFat == 0);
+
+	msg("Mounting volume \"%.11s\", filesystem %.8s\n", vol->Fat32 ? vol->Info32.VolumeLabel : fsinfo->VolumeLabel, vol->Fat32 ? vol->Info32.FileSystem : fsinfo->FileSystem);
+	msg("Disk contains %d sectors, %d bytes each.\n", (int)sectors, fsinfo->BytesPerSector);
+
+	// Check the validity of the filesystem
+
+	if(vol->Fat32 ? memcmp(vol->Info32.FileSystem, "FAT32   ", 8) : memcmp(fsinfo->FileSystem, "FAT16   ", 8)) err("Incompatible filesystem!\n");
+	if(fsinfo->NumberOfFats == 0) err("No FAT on the volume!\n");
+	if(fsinfo->SectorsPerCluster == 0 || (fsinfo->SectorsPerCluster & (fsinfo->SectorsPerCluster - 1))) err("Invalid cluster size!\n");
+	if(fsinfo->BytesPerSector % FS_SECTOR_SIZE) err("Sector size must be a multiple of %d bytes!\n", FS_SECTOR_SIZE);
+
+	// Initialize some variables
+
+	vol->FatOffset = fsinfo->ReservedSectors * fsinfo->BytesPerSector;
+	vol->FatSize = (vol->Fat32 ? vol->Info32.SectorsPerFat : fsinfo->SectorsPerFat) * fsinfo->BytesPerSector;
+	vol->RootOffset = vol->FatOffset + vol->FatSize * fsinfo->NumberOfFats;
+	vol->RootCluster = vol->Fat32 ? vol->Info32.RootCluster : 0;
+	vol->ClusterSize = fsinfo->SectorsPerCluster * fsinfo->BytesPerSector;
+	vol->FatDirtyStart = 0xFFFFFFFF;
+	vol->FatDirtyEnd = 0;
+
+	// With mirroring turned off, only the active FAT is used
+
+	if(vol->Fat32 && (vol->Info32.Flags & 0x80)) vol->FatOffset += (vol->Info32.Flags & 0x0F) * vol->FatSize;
+
+	vol->DataSector = (vol->RootOffset + fsinfo->RootDirEntries * sizeof(DirEntry) + fsinfo->BytesPerSector - 1) / fsinfo->BytesPerSector;
+
+	msg("%d FAT(s), %d byte clusters\n", fsinfo->NumberOfFats, (int)vol->ClusterSize);
+	msg("First usable cluster points to disk sector %d.\n\n", vol->DataSector);
+
+	vol->TotalClusters = (sectors - vol->DataSector) / fsinfo->SectorsPerCluster;
+	if((uint32_t)vol->TotalClusters + 2 > vol->FatSize / (vol->Fat32 ? 4 : 2)) vol->TotalClusters = vol->FatSize / (vol->Fat32 ? 4 : 2) - 2;
+
+	// The free space is counted on first use, FAT32 keeps the count in its FSInfo sector
+
+	vol->FreeMapValid = 0;
+	vol->FreeClusters = -1;
+	vol->NextFree = -1;
+	vol->InfoOffset = 0;
+
+	if(vol->Fat32 && vol->Info32.InfoSector != 0 && vol->Info32.InfoSector != 0xFFFF) {
+		info = (uint32_t *)fsaccess(vol, vol->Info32.InfoSector * fsinfo->BytesPerSector);
+
+		if(info[0] == 0x41615252 && info[121] == 0x61417272 && info[127] == 0xAA550000) {
+			vol->InfoOffset = vol->Info32.InfoSector * fsinfo->BytesPerSector;
+
+			if(info[122] <= (uint32_t)vol->TotalClusters) vol->FreeClusters = info[122];
+			if(info[123] >= 2 && info[123] < (uint32_t)vol->TotalClusters + 2) vol->NextFree = info[123];
+
+			msg("FSInfo: %d free cluster(s)\n", vol->FreeClusters);
+		}
+	}
+
+	// The log needs the reserved sectors past the first erase block for itself
+
+	if(fsinfo->ReservedSectors * fsinfo->BytesPerSector >= (FS_LOG_BLOCK + FS_LOG_BLOCKS) * FS_ERASE_SIZE) vol->LogOffset = FS_LOG_BLOCK * FS_ERASE_SIZE;
+
+	if(vol->Fat32 && vol->Info32.InfoSector != 0 && vol->Info32.InfoSector != 0xFFFF && (vol->Info32.InfoSector + 1) * fsinfo->BytesPerSector > FS_LOG_BLOCK * FS_ERASE_SIZE) vol->LogOffset = 0;
+	if(vol->Fat32 && vol->Info32.BackupSector != 0 && vol->Info32.BackupSector != 0xFFFF && (vol->Info32.BackupSector + 2) * fsinfo->BytesPerSector > FS_LOG_BLOCK * FS_ERASE_SIZE) vol->LogOffset = 0;
+
+	msg("%s\n", vol->LogOffset ? "Writes are logged" : "No room for the write log");
+
+	// Count of the changes ever made to the volume, see fscountgeneration()
+
+	vol->DiskGeneration = vol->LogOffset ? fsgenerationof(fsaccess(vol, 0)) : 0;
+
+	// Finish moving a file if the power went out in the middle of it. Without
+	// the log there is nowhere a move could have been left.
+
+	if(vol->LogOffset != 0 && fsdefragresume(vol)) {
+		msg("Could not finish the interrupted defrag!\n");
+	}
+
+	return 0;
+}
+
+int fsmountimage(FsVolume *vol, uint8_t *fsimage) {
+	memset(&vol->ImageDevice, 0, sizeof(vol->ImageDevice));
+	vol->ImageDevice.Mapped = fsimage;
+
+	return fsmountvolume(vol, &vol->ImageDevice);
+}
+
+int fsmountdevice(FsBlockDevice *dev) {
+	if(fsmountvolume(&mainvolume, dev)) return -1;
+
+	fsrootdir(&currentdir, &mainvolume);
+
+	return 0;
+}
+
+int fsmount(uint8_t *fsimage) {
+	if(fsmountimage(&mainvolume, fsimage)) return -1;
+
+	fsrootdir(&currentdir, &mainvolume);
+
+	return 0;
+}
+
+FsVolume *fsgetvolume() {
+	return &mainvolume;
+}
+
+FsDir *fsgetcwd() {
+	return &currentdir;
+}
+
+DirEntry *fsreaddirat(FsDir *dir, int dirs_only, int *entries) {
+	FsDirIter it;
+	DirEntry *tmp, *output;
+	int ptr = 0;
+
+	fsdir_open(&it, dir, dirs_only ? 0x10 : 0, 0);
+
+	output = malloc(dir->Size * sizeof(DirEntry));
+
+	msg("Allocated enough memory for %d entries\n", dir->Size);
+
+	while((tmp = fsdir_next(&it)) != NULL)
+		memcpy(output + ptr++, tmp, sizeof(DirEntry));
+
+	msg("Found %d entr%s\n\n", ptr, (ptr == 1) ? "y" : "ies");
+
+	*entries = ptr;
+	return output;
+}
+
+DirEntry *fsreaddir(int dirs_only, int *entries) {
+	return fsreaddirat(&currentdir, dirs_only, entries);
+}
+
+int fsfindentry(FsDir *dir, char *filename) {
+	int i;
+	char buf[16];
+	FsDirIter it;
+	DirEntry *tmp;
+
+	fscheckdir(dir);
+
+	// Names that do not fit 8.3 can only be matched against the long names
+
+	if(!fsisshortname(filename)) {
+		fsdir_open(&it, dir, 0, 0);
+
+		while(fsdir_next(&it) != NULL)
+			if(!fsnamecmp(it.Name, filename))
+				return it.Index - 1;
+
+		return -1;
+	}
+
+	filename_to_fatname(filename, buf);
+
+	msg("Matching against FAT name \"%.11s\"...\n", buf);
+
+#ifdef FSDIRINDEX
+	FsDirIndex *index;
+	uint32_t slot;
+
+	if((index = fsgetindex(dir)) != NULL) {
+		for(slot = fsnamehash(buf); index->Slots[slot % FS_INDEX_SLOTS] != 0; slot++) {
+			i = index->Slots[slot % FS_INDEX_SLOTS] - 1;
+
+			if(!memcmp(fsreaddirentry(dir, i), buf, 11))
+				return i;
+		}
+
+		return -1;
+	}
+#endif
+
+	fsdir_open(&it, dir, 0, 0);
+
+	while((tmp = fsdir_next(&it)) != NULL)
+		if(!memcmp(tmp, buf, 11))
+			return it.Index - 1;
+
+	return -1;
+}
+
+DirEntry *fsfindfile(FsDir *dir, char *filename) {
+	int id = fsfindentry(dir, filename);
+
+	return (id < 0) ? NULL : fsreaddirentry(dir, id);
+}
+
+void fsrootdir(FsDir *dir, FsVolume *vol) {
+	dir->Volume = vol;
+	dir->Cluster = vol->RootCluster;
+
+	fsrefreshdir(dir);
+}
+
+int fsopendirentry(FsDir *dir, FsDir *parent, int entry) {
+	DirEntry *tmp;
+	int cluster;
+
+	fscheckdir(parent);
+
+	if(entry < 0 || entry >= parent->Size) err("No dir entry %d!\n", entry);
+
+	tmp = fsreaddirentry(parent, entry);
+
+	if(!(tmp->Attribute & 0x10)) err("Entry %d is not a dir!\n", entry);
+
+	// ".." of a first level dir points to cluster 0, even on FAT32
+
+	if((cluster = fsentrycluster(parent->Volume, tmp)) == 0) cluster = parent->Volume->RootCluster;
+
+	// The parent may be the very same handle
+
+	dir->Volume = parent->Volume;
+	dir->Cluster = cluster;
+
+	fsrefreshdir(dir);
+
+	msg("Opened dir on cluster %d, max %d entries\n", dir->Cluster, dir->Size);
+	return 0;
+}
+
+int fsopendir(FsDir *dir, FsDir *parent, char *filename) {
+	int id;
+
+	msg("Searching for dir \"%s\"...\n", filename);
+
+	if(!strcmp(filename, "/")) {
+		msg("Override: enter root directory\n");
+
+		fsrootdir(dir, parent->Volume);
+		return 0;
+	}
+
+	if((id = fsfindentry(parent, filename)) < 0) err("Could not find dir \"%s\"!\n", filename);
+
+	return fsopendirentry(dir, parent, id);
+}
+
+int fschdir(char *filename) {
+	return fsopendir(&currentdir, &currentdir, filename);
+}
+
+int fsopenat(FsDir *dir, FsFile *file, char *filename) {
+	DirEntry *entry;
+
+	msg("Searching for file \"%s\"...\n", filename);
+
+	if((entry = fsfindfile(dir, filename)) != NULL) {
+		if(entry->Attribute & 0x10) err("\"%s\" is a dir, not a file!\n", filename);
+
+		file->Size = entry->Size;
+		file->Position = 0;
+		file->Crc = 0;
+		file->CrcPosition = FS_NO_CRC;
+		file->PendingSize = 0;
+
+		fsbuildextents(&file->Extents, dir->Volume, fsentrycluster(dir->Volume, entry));
+
+		return 0;
+	} else err("Could not find file \"%s\"!\n", filename);
+}
+
+int fsopen(FsFile *file, char *filename) {
+	return fsopenat(&currentdir, file, filename);
+}
+
+long fsreadstart(FsFile *file, uint8_t *buffer, uint32_t size) {
+	FsVolume *vol = file->Extents.Volume;
+	uint32_t done = 0, offset, run, len, clustsize = vol->ClusterSize;
+	int clust, crc = (file->CrcPosition == file->Position);
+
+	if(size > file->Size - file->Position) size = file->Size - file->Position;
+
+	// Copy the rest of each run of consecutive clusters in one go
+
+	while(done < size) {
+		if((run = fsextentrun(&file->Extents, file->Position / clustsize, &clust)) == 0) {
+			fsreadwait(file);
+			err("File is shorter than its size!\n");
+		}
+
+		offset = file->Position % clustsize;
+		len = run * clustsize - offset;
+		if(len > size - done) len = size - done;
+
+		// Smaller copies let the checksum of one overlap the next
+
+		if(crc && len > FS_CRC_CHUNK) len = FS_CRC_CHUNK;
+
+		if(fsdevread(vol, fsclusteroffset(vol, clust) + offset, buffer + done, len)) {
+			fsreadwait(file);
+			return -1;
+		}
+
+		// Starting a copy waits for the previous one, which can be checksummed now
+
+		if(crc) {
+			if(file->PendingSize > 0) file->Crc = crcupdate(file->Crc, file->PendingData, file->PendingSize);
+
+			file->PendingData = buffer + done;
+			file->PendingSize = len;
+		}
+
+		done += len;
+		file->Position += len;
+	}
+
+	if(crc) file->CrcPosition = file->Position;
+
+	return done;
+}
+
+void fsreadwait(FsFile *file) {
+	copywait();
+
+	if(file->PendingSize > 0) {
+		file->Crc = crcupdate(file->Crc, file->PendingData, file->PendingSize);
+		file->PendingSize = 0;
+	}
+}
+
+long fsread(FsFile *file, uint8_t *buffer, uint32_t size) {
+	long done = fsreadstart(file, buffer, size);
+
+	fsreadwait(file);
+
+	return done;
+}
+
+int fsseek(FsFile *file, uint32_t position) {
+	if(position > file->Size) err("Seeking past the end of file!\n");
+
+	file->Position = position;
+
+	return 0;
+}
+
+void fsclose(FsFile *file) {
+	file->Size = 0;
+	file->Position = 0;
+}
+
+long fsloadfileat(FsDir *dir, char *filename, uint8_t *buffer, uint32_t maxsize) {
+	FsFile file;
+	long size;
+
+	if(fsopenat(dir, &file, filename)) return -1;
+
+	size = file.Size;
+
+	if(fsread(&file, buffer, maxsize) < 0) size = -1;
+
+	fsclose(&file);
+
+	return size;
+}
+
+long fsloadfile(char *filename, uint8_t *buffer, uint32_t maxsize) {
+	return fsloadfileat(&currentdir, filename, buffer, maxsize);
+}
+
+int fsparsecrc(char *line, char *filename, uint32_t *crc) {
+	char *sep, *end;
+
+	// SFV lines are the file name and its CRC in hex, or a comment
+
+	if(line[0] == ';' || (sep = strrchr(line, ' ')) == NULL) return -1;
+
+	*crc = strtoul(sep + 1, &end, 16);
+
+	if(end != sep + 9 || *end != 0) return -1;
+
+	while(sep > line && sep[-1] == ' ') sep--;
+	*sep = 0;
+
+	return fsnamecmp(line, filename) ? -1 : 0;
+}
+
+int fsfindcrc(FsDir *dir, char *filename, uint32_t *crc) {
+	FsFile file;
+	char block[128], line[FS_MAX_NAME + 16];
+	long len, i;
+	int pos = 0;
+
+	if(fsopenat(dir, &file, FS_CRC_FILE)) return -1;
+
+	while((len = fsread(&file, (uint8_t *)block, sizeof(block))) > 0) {
+		for(i = 0; i < len; i++) {
+			if(block[i] != '\n' && block[i] != '\r') {
+				if(pos < (int)sizeof(line) - 1) line[pos++] = block[i];
+				continue;
+			}
+
+			line[pos] = 0;
+			pos = 0;
+
+			if(!fsparsecrc(line, filename, crc)) return 0;
+		}
+	}
+
+	line[pos] = 0;
+
+	return fsparsecrc(line, filename, crc);
+}
+
+long fsloadfilecheckedat(FsDir *dir, char *filename, uint8_t *buffer, uint32_t maxsize) {
+	FsFile file;
+	uint32_t crc;
+	long size;
+
+	// Files without a checksum are loaded as they are
+
+	if(fsfindcrc(dir, filename, &crc)) return fsloadfileat(dir, filename, buffer, maxsize);
+
+	if(fsopenat(dir, &file, filename)) return -1;
+
+	if(file.Size > maxsize) err("\"%s\" is too large to be checked!\n", filename);
+
+	// The checksum is worked out while the file is copied
+
+	file.CrcPosition = 0;
+
+	size = fsread(&file, buffer, file.Size);
+
+	fsclose(&file);
+
+	if(size < 0) return -1;
+
+	if(file.Crc != crc) err("\"%s\" is corrupted, CRC %08X instead of %08X!\n", filename, (unsigned)file.Crc, (unsigned)crc);
+
+	return size;
+}
+
+long fsloadfilechecked(char *filename, uint8_t *buffer, uint32_t maxsize) {
+	return fsloadfilecheckedat(&currentdir, filename, buffer, maxsize);
+}
+
+const uint8_t *fsmapfileat(FsDir *dir, char *filename, uint32_t *size) {
+	FsVolume *vol = dir->Volume;
+	FsFile file;
+	FsExtent *run = &file.Extents.Runs[0];
+
+	if(vol->Device->Mapped == NULL) errptr("The device is not memory-mapped!\n");
+
+	if(fsopenat(dir, &file, filename)) return NULL;
+
+	// Only a file stored in a single run of clusters can be used in place
+
+	if(file.Extents.Count != 1 || run->Length * vol->ClusterSize < file.Size)
+		errptr("\"%s\" is not contiguous!\n", filename);
+
+	*size = file.Size;
+
+	return vol->Device->Mapped + fsclusteroffset(vol, run->Cluster);
+}
+
+const uint8_t *fsmapfile(char *filename, uint32_t *size) {
+	return fsmapfileat(&currentdir, filename, size);
+}
+
+FsWriteStats *fsgetwritestats() {
+	return &writestats;
+}
+
+uint32_t fsmirrorsource(FsVolume *vol, FsCacheSlot *slot) {
+	uint32_t base = slot->Block * FS_ERASE_SIZE, i;
+
+	// Only a block wholly inside a mirror has its content one FAT further up
+
+	if(vol->FatSize < FS_ERASE_SIZE || base < vol->FatOffset + vol->FatSize || base + FS_ERASE_SIZE > vol->FatOffset + vol->FatSize * vol->Info.NumberOfFats) return 0;
+
+	for(i = 0; i < FS_ERASE_SIZE; i += FS_SECTOR_SIZE)
+		if(memcmp(fsaccess(vol, base - vol->FatSize + i), slot->Data + i, FS_SECTOR_SIZE)) return 0;
+
+	return base - vol->FatSize;
+}
+
+int fslogbegin(FsVolume *vol, FsCacheSlot *slot) {
+	FsLogRecord record;
+	uint32_t records = vol->LogOffset + FS_ERASE_SIZE, image, i;
+
+	for(i = 0; i < FS_ERASE_SIZE / sizeof(FsLogRecord); i++)
+		if(fsblank(fsaccess(vol, records + i * sizeof(FsLogRecord)), sizeof(FsLogRecord))) break;
+
+	// Every record in a full block is cleared already, so it can go
+
+	if(i == FS_ERASE_SIZE / sizeof(FsLogRecord)) {
+		if(fsdeverase(vol, records)) return -1;
+
+		i = 0;
+	}
+
+	// The mirrors are written once the first FAT is on the flash, so they can
+	// mostly do without a copy of their own
+
+	if((image = fsmirrorsource(vol, slot)) == 0) {
+		image = vol->LogOffset + (2 + i % FS_LOG_IMAGES) * FS_ERASE_SIZE;
+
+		if(fsdeverase(vol, image) || fsdevprogram(vol, image, slot->Data, FS_ERASE_SIZE)) return -1;
+	}
+
+	memset(&record, 0xFF, sizeof(record));
+
+	record.Magic = FS_LOG_MAGIC;
+	record.Block = slot->Block;
+	record.Source = image;
+	record.Crc = fscrc32(0, slot->Data, FS_ERASE_SIZE);
+	record.HeaderCrc = fscrc32(0, (uint8_t *)&record, 16);
+
+	vol->LogRecord = records + i * sizeof(FsLogRecord);
+
+	return fsdevprogram(vol, vol->LogRecord, (uint8_t *)&record, sizeof(record));
+}
+
+int fslogend(FsVolume *vol) {
+	uint32_t zero = 0;
+
+	// Clearing the magic only clears bits, so it doesn't cost an erase
+
+	return fsdevprogram(vol, vol->LogRecord, (uint8_t *)&zero, sizeof(zero));
+}
+
+int fsflushslot(FsCacheSlot *slot) {
+	FsVolume *vol = slot->Volume;
+	FsBlockDevice *dev = vol->Device;
+	uint32_t base = slot->Block * FS_ERASE_SIZE, i, j, first, count;
+	uint8_t *old, changed = 0, erase = 0, blank;
+
+	if(!slot->Dirty) return 0;
+
+	slot->Dirty = 0;
+
+	// Find the sectors that changed. Flash can only clear bits when
+	// programming, anything else needs the whole block erased first.
+
+	for(i = 0; i < FS_ERASE_SIZE / FS_SECTOR_SIZE; i++) {
+		old = fsaccess(vol, base + i * FS_SECTOR_SIZE);
+
+		if(memcmp(slot->Data + i * FS_SECTOR_SIZE, old, FS_SECTOR_SIZE)) {
+			changed |= 1 << i;
+
+			for(j = 0; j < FS_SECTOR_SIZE && !erase && dev->Erase != NULL; j++)
+				if(slot->Data[i * FS_SECTOR_SIZE + j] & ~old[j]) erase = 1;
+		}
+	}
+
+	if(!changed) return 0;
+
+	fsdropreadcache(vol, base, FS_ERASE_SIZE);
+
+	// A block that is not rewritten completely goes to the log before it's erased
+
+	if(erase && vol->LogOffset != 0 && !slot->Whole && fslogbegin(vol, slot)) return -1;
+
+	if(erase) {
+		if(dev->Erase(dev, base)) err("Could not erase block at 0x%08X!\n", (unsigned)base);
+
+		writestats.Erases++;
+
+		// Everything but the blank sectors has to be written back now
+
+		for(changed = 0, i = 0; i < FS_ERASE_SIZE / FS_SECTOR_SIZE; i++) {
+			for(blank = 1, j = 0; j < FS_SECTOR_SIZE && blank; j++)
+				blank = slot->Data[i * FS_SECTOR_SIZE + j] == 0xFF;
+
+			if(!blank) changed |= 1 << i;
+		}
+	}
+
+	// Write consecutive changed sectors with a single call
+
+	for(i = 0; i < FS_ERASE_SIZE / FS_SECTOR_SIZE; i += count) {
+		for(count = 0; (changed >> (i + count)) & 1; count++);
+
+		if(count == 0) {
+			count = 1;
+			continue;
+		}
+
+		first = base / FS_SECTOR_SIZE + i;
+
+		if(dev->WriteSector(dev, first, slot->Data + i * FS_SECTOR_SIZE, count)) err("Could not write sector %d!\n", (int)first);
+
+		writestats.Programs += count;
+	}
+
+	// Read everything back, a worn out block does not always report a failure
+
+	for(i = 0; i < FS_ERASE_SIZE / FS_SECTOR_SIZE; i++)
+		if(memcmp(slot->Data + i * FS_SECTOR_SIZE, fsaccess(vol, base + i * FS_SECTOR_SIZE), FS_SECTOR_SIZE))
+			err("Sector %d did not take the write!\n", (int)(base / FS_SECTOR_SIZE + i));
+
+	if(erase && vol->LogOffset != 0 && !slot->Whole) return fslogend(vol);
+
+	return 0;
+}
+
+int fsflush(FsVolume *vol) {
+	int i, ret = 0;
+
+	for(i = 0; i < FS_CACHE_SLOTS; i++)
+		if(writecache[i].Volume == vol && fsflushslot(&writecache[i])) ret = -1;
+
+	if(vol->Device->Flush != NULL && vol->Device->Flush(vol->Device)) ret = -1;
+
+	return ret;
+}
+
+FsCacheSlot *fscacheblock(FsVolume *vol, int block, int fill) {
+	int i;
+	FsCacheSlot *slot = &writecache[0];
+
+	for(i = 0; i < FS_CACHE_SLOTS; i++) {
+		if(writecache[i].Volume == vol && writecache[i].Block == block) {
+			slot = &writecache[i];
+			slot->LastUse = ++writecacheclock;
+			return slot;
+		}
+
+		if(writecache[i].LastUse < slot->LastUse) slot = &writecache[i];
+	}
+
+	// Evict the least recently used block
+
+	if(slot->Volume != NULL && fsflushslot(slot)) return NULL;
+
+	slot->Volume = NULL;
+
+	if(fill) {
+		copywait();
+
+		if(fsdevread(vol, block * FS_ERASE_SIZE, slot->Data, FS_ERASE_SIZE)) return NULL;
+
+		copywait();
+	}
+
+	slot->Volume = vol;
+	slot->Block = block;
+	slot->Whole = !fill;
+	slot->LastUse = ++writecacheclock;
+
+	return slot;
+}
+
+int fslogreplay(FsVolume *vol) {
+	FsLogRecord record;
+	FsCacheSlot *slot;
+	uint32_t records = FS_LOG_BLOCK * FS_ERASE_SIZE + FS_ERASE_SIZE, base, i, j;
+
+	for(i = 0; i < FS_ERASE_SIZE / sizeof(FsLogRecord); i++) {
+		memcpy(&record, fsaccess(vol, records + i * sizeof(FsLogRecord)), sizeof(record));
+
+		if(record.Magic != FS_LOG_MAGIC || record.HeaderCrc != fscrc32(0, (uint8_t *)&record, 16)) continue;
+
+		// The copy is read into a write cache slot, which is given back right after
+
+		if((slot = fscacheblock(vol, FS_LOG_BLOCK + 2, 0)) == NULL) return -1;
+
+		slot->Volume = NULL;
+		slot->LastUse = 0;
+
+		if(fsdevread(vol, record.Source, slot->Data, FS_ERASE_SIZE)) return -1;
+
+		if((record.Block != 0 && record.Block < FS_LOG_BLOCK + FS_LOG_BLOCKS) || record.Crc != fscrc32(0, slot->Data, FS_ERASE_SIZE)) {
+			msg("The log copy of block %d is corrupted!\n", (int)record.Block);
+		} else {
+			msg("Writing block %d again from the log\n", (int)record.Block);
+
+			base = record.Block * FS_ERASE_SIZE;
+
+			if(fsdeverase(vol, base)) return -1;
+
+			for(j = 0; j < FS_ERASE_SIZE; j += FS_SECTOR_SIZE)
+				if(!fsblank(slot->Data + j, FS_SECTOR_SIZE) && fsdevprogram(vol, base + j, slot->Data + j, FS_SECTOR_SIZE)) return -1;
+		}
+
+		// Done, or never going to work
+
+		vol->LogRecord = records + i * sizeof(FsLogRecord);
+
+		if(fslogend(vol)) return -1;
+	}
+
+	return 0;
+}
+
+int fswriteimage(FsVolume *vol, uint32_t offset, const uint8_t *data, int value, uint32_t size) {
+	uint32_t len, pos;
+	FsCacheSlot *slot;
+
+	while(size > 0) {
+		pos = offset % FS_ERASE_SIZE;
+		len = (FS_ERASE_SIZE - pos < size) ? FS_ERASE_SIZE - pos : size;
+
+		// Blocks that get overwritten completely don't need to be read first
+
+		if((slot = fscacheblock(vol, offset / FS_ERASE_SIZE, len != FS_ERASE_SIZE)) == NULL) return -1;
+
+		if(len != FS_ERASE_SIZE) slot->Whole = 0;
+
+		if(data != NULL) {
+			memcpy(slot->Data + pos, data, len);
+			data += len;
+		} else {
+			memset(slot->Data + pos, value, len);
+		}
+
+		slot->Dirty = 1;
+
+		// A completely rewritten block is most likely streamed file data, write it
+		// out now so that it doesn't push the FAT and dir blocks out of the cache
+
+		if(len == FS_ERASE_SIZE) {
+			if(fsflushslot(slot)) return -1;
+
+			slot->LastUse = 0;
+		}
+
+		offset += len;
+		size -= len;
+	}
+
+	return 0;
+}
+
+int fssetfat(FsVolume *vol, int clust, uint32_t value) {
+	uint32_t size = vol->Fat32 ? 4 : 2, offset = clust * size;
+
+	// The top 4 bits of a FAT32 entry are reserved and have to be kept
+
+	if(vol->Fat32) value = (value & 0x0FFFFFFF) | (*(uint32_t *)fsaccess(vol, vol->FatOffset + offset) & 0xF0000000);
+
+	// Only the first FAT is updated here, the mirrors get the whole
+	// changed range in one go once the operation is done
+
+	if(offset < vol->FatDirtyStart) vol->FatDirtyStart = offset;
+	if(offset + size > vol->FatDirtyEnd) vol->FatDirtyEnd = offset + size;
+
+	return fswriteimage(vol, vol->FatOffset + offset, (uint8_t *)&value, 0, size);
+}
+
+int fsmirrorfat(FsVolume *vol) {
+	uint8_t chunk[64];
+	uint32_t offset, len;
+	int i;
+
+	if(vol->FatDirtyStart >= vol->FatDirtyEnd) return 0;
+
+	if(vol->Fat32 && (vol->Info32.Flags & 0x80)) {
+		vol->FatDirtyStart = 0xFFFFFFFF;
+		vol->FatDirtyEnd = 0;
+
+		return 0;
+	}
+
+	msg("Mirroring FAT bytes 0x%X-0x%X\n", (unsigned)vol->FatDirtyStart, (unsigned)vol->FatDirtyEnd);
+
+	for(offset = vol->FatDirtyStart; offset < vol->FatDirtyEnd; offset += len) {
+		len = (vol->FatDirtyEnd - offset < sizeof(chunk)) ? vol->FatDirtyEnd - offset : sizeof(chunk);
+
+		// Don't cross a sector, the next one might not be cached
+
+		if(len > FS_SECTOR_SIZE - (vol->FatOffset + offset) % FS_SECTOR_SIZE)
+			len = FS_SECTOR_SIZE - (vol->FatOffset + offset) % FS_SECTOR_SIZE;
+
+		memcpy(chunk, fsaccess(vol, vol->FatOffset + offset), len);
+
+		for(i = 1; i < vol->Info.NumberOfFats; i++)
+			if(fswriteimage(vol, vol->FatOffset + i * vol->FatSize + offset, chunk, 0, len)) return -1;
+	}
+
+	vol->FatDirtyStart = 0xFFFFFFFF;
+	vol->FatDirtyEnd = 0;
+
+	return 0;
+}
+
+int fsallocchain(FsVolume *vol, int count, const uint8_t *data, uint32_t size) {
+	uint32_t clustsize = vol->ClusterSize, len;
+	int first = 0, prev = 0, start, length, clust;
+
+	if(count > vol->FreeClusters) err("Not enough free space!\n");
+
+	// Take the first run long enough, or the longest ones available,
+	// and fill each run with its part of the data (or zeros) right away
+
+	while(count > 0) {
+		if((start = fsfindfreerun(vol, count, &length)) == 0) err("Not enough free space!\n");
+
+		if(length > count) length = count;
+
+		for(clust = start; clust < start + length; clust++) {
+			if(prev) {
+				if(fssetfat(vol, prev, clust)) return -1;
+			} else {
+				first = clust;
+			}
+
+			fsmarkcluster(vol, clust, 0);
+			prev = clust;
+		}
+
+		len = (length * clustsize < size) ? length * clustsize : size;
+
+		if(len > 0 && fswriteimage(vol, fsclusteroffset(vol, start), data, 0, len)) return -1;
+
+		if(data != NULL) data += len;
+		size -= len;
+		count -= length;
+
+		// Past the free map, only its FAT entry shows that the last cluster is taken
+
+		if(fssetfat(vol, prev, 0x0FFFFFFF)) return -1;
+	}
+
+	vol->NextFree = prev + 1;
+
+	return first;
+}
+
+int fsfreechain(FsVolume *vol, int clust) {
+	int next;
+
+	while(clust >= 2 && clust < FS_CHAIN_END) {
+		next = fsgetfat(vol, clust);
+
+		if(fssetfat(vol, clust, 0)) return -1;
+		fsmarkcluster(vol, clust, 1);
+
+		clust = next;
+	}
+
+	return 0;
+}
+
+int fscountgeneration(FsVolume *vol) {
+	FsCacheSlot *slot;
+	uint8_t *bits;
+	uint32_t i, rounds;
+
+	// Only volumes with the write log have the boot code left erased for the
+	// generation, anything else only counts it in memory
+
+	if(vol->LogOffset == 0) {
+		vol->DiskGeneration++;
+		return 0;
+	}
+
+	// The generation counts the bits cleared in the boot code, which never runs
+	// here. Clearing one more only programs the boot sector, never erases it.
+
+	if((slot = fscacheblock(vol, 0, 1)) == NULL) return -1;
+
+	bits = slot->Data + FS_GENERATION_START;
+
+	for(i = 0; i < FS_GENERATION_OFFSET - FS_GENERATION_START && bits[i] == 0; i++);
+
+	// Once every bit is used up, a new round starts. Only that costs an erase.
+
+	if(i == FS_GENERATION_OFFSET - FS_GENERATION_START) {
+		memcpy(&rounds, slot->Data + FS_GENERATION_OFFSET, sizeof(rounds));
+		rounds++;
+		memcpy(slot->Data + FS_GENERATION_OFFSET, &rounds, sizeof(rounds));
+
+		memset(bits, 0xFF, FS_GENERATION_OFFSET - FS_GENERATION_START);
+		i = 0;
+	}
+
+	bits[i] &= bits[i] - 1;
+	slot->Dirty = 1;
+
+	vol->DiskGeneration = fsgenerationof(slot->Data);
+
+	return 0;
+}
+
+int fsupdateinfo(FsVolume *vol) {
+	uint32_t *info;
+
+	if(fscountgeneration(vol)) return -1;
+
+	// Keeping the FSInfo counts up to date would erase their block on every write,
+	// so they are marked unknown once instead. They are counted here when needed.
+
+	if(vol->InfoOffset == 0) return 0;
+
+	info = (uint32_t *)fsaccess(vol, vol->InfoOffset + 488);
+
+	if(info[0] == 0xFFFFFFFF && info[1] == 0xFFFFFFFF) return 0;
+
+	return fswriteimage(vol, vol->InfoOffset + 488, NULL, 0xFF, 8);
+}
+
+int fsfinishwrite(FsVolume *vol) {
+	int ret;
+
+	ret = fsupdateinfo(vol);
+
+	if(fsflush(vol)) ret = -1;
+
+	// Bring the other FATs up to date only after the first one is on the disk
+
+	if(!ret && vol->Info.NumberOfFats > 1 && (fsmirrorfat(vol) || fsflush(vol))) ret = -1;
+
+#ifdef FSDIRINDEX
+	fsdropindex(vol);
+#endif
+
+	vol->Generation++;
+
+	msg("%d erase(s), %d sector write(s)\n", writestats.Erases, writestats.Programs);
+
+	return ret;
+}
+
+int fsabortwrite(FsVolume *vol) {
+	int i;
+
+	// Throw away whatever has not been written yet and resync with the flash
+
+	for(i = 0; i < FS_CACHE_SLOTS; i++) {
+		if(writecache[i].Volume == vol) {
+			writecache[i].Volume = NULL;
+			writecache[i].Dirty = 0;
+			writecache[i].LastUse = 0;
+		}
+	}
+
+	vol->FatDirtyStart = 0xFFFFFFFF;
+	vol->FatDirtyEnd = 0;
+
+	fsbuildfreemap(vol);
+
+#ifdef FSDIRINDEX
+	fsdropindex(vol);
+#endif
+
+	// Some of the changes might have reached the flash already
+
+	vol->Generation++;
+	vol->DiskGeneration++;
+
+	return -1;
+}
+
+int fslongstart(FsDir *dir, int id) {
+	uint8_t sum = fsshortchecksum((char *)fsreaddirentry(dir, id));
+	uint8_t *raw;
+
+	// Walk back over the long name pieces that belong to this entry
+
+	while(id > 0) {
+		raw = (uint8_t *)fsreaddirentry(dir, id - 1);
+
+		if(raw[11] != 0x0F || raw[0] == 0xE5 || raw[13] != sum) break;
+
+		id--;
+
+		if(raw[0] & 0x40) break;
+	}
+
+	return id;
+}
+
+int fsaliasexists(FsDir *dir, char *fatname) {
+	FsDirIter it;
+	DirEntry *tmp;
+
+	fsdir_open(&it, dir, 0, 0);
+
+	while((tmp = fsdir_next(&it)) != NULL)
+		if(!memcmp(tmp, fatname, 11))
+			return 1;
+
+	return 0;
+}
+
+int fsmakealias(FsDir *dir, char *filename, char *fatname) {
+	char *ext = strrchr(filename, '.'), tail[8];
+	int i, len, n;
+
+	// Base name from the valid chars up to the last period, extension after it
+
+	memset(fatname, ' ', 11);
+
+	for(i = 0, len = 0; filename[i] != 0 && filename + i != ext && len < 8; i++)
+		if(filename[i] != ' ' && filename[i] != '.')
+			fatname[len++] = fsshortchar(filename[i]) ? toupper((uint8_t)filename[i]) : '_';
+
+	if(ext != NULL && ext != filename)
+		for(i = 1, n = 8; ext[i] != 0 && n < 11; i++)
+			if(ext[i] != ' ')
+				fatname[n++] = fsshortchar(ext[i]) ? toupper((uint8_t)ext[i]) : '_';
+
+	if(len == 0) fatname[len++] = '_';
+
+	// Append ~1, ~2... until the name is unique
+
+	for(n = 1; n < 1000000; n++) {
+		for(i = sizeof(tail), len = n; len > 0; len /= 10)
+			tail[--i] = '0' + len % 10;
+
+		tail[--i] = '~';
+
+		for(len = 0; len < 8 && fatname[len] != ' ' && fatname[len] != '~'; len++);
+
+		if(len > i) len = i;
+
+		memset(fatname + len, ' ', 8 - len);
+		memcpy(fatname + len, tail + i, sizeof(tail) - i);
+
+		if(!fsaliasexists(dir, fatname)) return 0;
+	}
+
+	err("No free alias for \"%s\"!\n", filename);
+}
+
+void fsmakelongentry(uint8_t *raw, char *filename, int ord, int last, uint8_t checksum) {
+	int i, pos = (ord - 1) * 13, len = strlen(filename);
+	uint16_t c;
+
+	memset(raw, 0, sizeof(DirEntry));
+
+	raw[0] = ord | (last ? 0x40 : 0);
+	raw[11] = 0x0F;
+	raw[13] = checksum;
+
+	// The name is zero-terminated, and the rest of the last piece padded with 0xFFFF
+
+	for(i = 0; i < 13; i++, pos++) {
+		c = (pos < len) ? (uint8_t)filename[pos] : (pos == len) ? 0 : 0xFFFF;
+
+		raw[fslongoffsets[i]] = c & 0xFF;
+		raw[fslongoffsets[i] + 1] = c >> 8;
+	}
+}
+
+int fswritefileat(FsDir *dir, char *filename, uint8_t *data, uint32_t size) {
+	FsVolume *vol = dir->Volume;
+	DirEntry newentry;
+	uint8_t raw[sizeof(DirEntry)], checksum;
+	uint32_t clustsize = vol->ClusterSize, address;
+	int i, first = 0, newdir = 0, last, next, start, run, longslots = 0;
+
+	if(vol->Device->WriteSector == NULL) err("The filesystem is read-only!\n");
+
+	if(strlen(filename) >= FS_MAX_NAME) err("\"%s\" is too long!\n", filename);
+
+	memset(&writestats, 0, sizeof(writestats));
+
+	fsloadfreemap(vol);
+
+	memset(&newentry, 0, sizeof(newentry));
+	newentry.Attribute = 0x20;
+	newentry.Size = size;
+
+	// Replace the file if it exists already, keeping its names, otherwise
+	// look for enough free entries in a row for the long name and the alias
+
+	if((start = fsfindentry(dir, filename)) >= 0) {
+		if(fsreaddirentry(dir, start)->Attribute & 0x10) err("\"%s\" is a dir, not a file!\n", filename);
+
+		memcpy(&newentry, fsreaddirentry(dir, start), 11);
+
+		if(fsfreechain(vol, fsentrycluster(vol, fsreaddirentry(dir, start)))) goto fail;
+	} else {
+		if(fsisshortname(filename)) {
+			filename_to_fatname(filename, (char *)&newentry);
+		} else {
+			longslots = (strlen(filename) + 12) / 13;
+
+			if(fsmakealias(dir, filename, (char *)&newentry)) return -1;
+		}
+
+		for(i = 0, run = 0; i < dir->Size && run <= longslots; i++)
+			run = (fsreaddirentry(dir, i)->Basename[0] == 0 || (uint8_t)fsreaddirentry(dir, i)->Basename[0] == 0xE5) ? run + 1 : 0;
+
+		// Free entries at the very end carry on into the new cluster if it grows
+
+		start = i - run;
+
+		if(run <= longslots) {
+			// The root dir has a fixed size, others can grow by a cluster
+
+			if(dir->Cluster == 0) err("The root dir is full!\n");
+
+			if((newdir = fsallocchain(vol, 1, NULL, clustsize)) <= 0) goto fail;
+
+			for(last = dir->Cluster; (next = fsgetfat(vol, last)) >= 2 && next < FS_CHAIN_END; last = next);
+
+			if(fssetfat(vol, last, newdir)) goto fail;
+		}
+	}
+
+	// Allocate the clusters and copy the data run by run
+
+	if(size > 0 && (first = fsallocchain(vol, (size + clustsize - 1) / clustsize, data, size)) <= 0) goto fail;
+
+	newentry.StartCluster = first & 0xFFFF;
+	newentry.StartClusterHigh = vol->Fat32 ? first >> 16 : 0;
+
+	// The long name pieces go last one first, right before the alias
+
+	checksum = fsshortchecksum((char *)&newentry);
+
+	for(i = 0; i <= longslots; i++) {
+		if(i < longslots)
+			fsmakelongentry(raw, filename, longslots - i, i == 0, checksum);
+		else
+			memcpy(raw, &newentry, sizeof(DirEntry));
+
+		if(start + i < dir->Size)
+			address = fsdirentryaddress(dir, start + i);
+		else
+			address = fsclusteroffset(vol, newdir) + (start + i - dir->Size) * sizeof(DirEntry);
+
+		if(fswriteimage(vol, address, raw, 0, sizeof(DirEntry))) goto fail;
+	}
+
+	return fsfinishwrite(vol);
+
+fail:
+	fsabortwrite(vol);
+	err("Could not write \"%s\"!\n", filename);
+}
+
+int fswritefile(char *filename, uint8_t *data, uint32_t size) {
+	return fswritefileat(&currentdir, filename, data, size);
+}
+
+int fsdeletefileat(FsDir *dir, char *filename) {
+	FsVolume *vol = dir->Volume;
+	uint8_t deleted = 0xE5;
+	int i, id;
+
+	if(vol->Device->WriteSector == NULL) err("The filesystem is read-only!\n");
+
+	memset(&writestats, 0, sizeof(writestats));
+
+	fsloadfreemap(vol);
+
+	if((id = fsfindentry(dir, filename)) < 0) err("Could not find file \"%s\"!\n", filename);
+
+	if(fsreaddirentry(dir, id)->Attribute & 0x10) err("\"%s\" is a dir, not a file!\n", filename);
+
+	if(fsfreechain(vol, fsentrycluster(vol, fsreaddirentry(dir, id)))) goto fail;
+
+	// Delete the long name along with the alias
+
+	for(i = fslongstart(dir, id); i <= id; i++)
+		if(fswriteimage(vol, fsdirentryaddress(dir, i), &deleted, 0, 1)) goto fail;
+
+	return fsfinishwrite(vol);
+
+fail:
+	fsabortwrite(vol);
+	err("Could not delete \"%s\"!\n", filename);
+}
+
+int fsdeletefile(char *filename) {
+	return fsdeletefileat(&currentdir, filename);
+}
+
+int fsdefragapply(FsVolume *vol, FsDefragMarker *marker) {
+	DirEntry entry;
+	uint32_t i, j, clust, zero = 0;
+
+	// Everything here is set to absolute values, so it can be done again
+	// as many times as needed until the marker is cleared
+
+	for(i = 0; i < marker->Count; i++) {
+		for(j = 0; j < marker->Runs[i].Length; j++) {
+			clust = marker->Runs[i].Cluster + j;
+
+			if(fssetfat(vol, clust, 0)) return -1;
+			fsmarkcluster(vol, clust, 1);
+		}
+	}
+
+	for(i = 0; i < marker->Clusters; i++) {
+		clust = marker->NewCluster + i;
+
+		if(fssetfat(vol, clust, (i == marker->Clusters - 1) ? marker->Next : clust + 1)) return -1;
+		fsmarkcluster(vol, clust, 0);
+	}
+
+	// Link the new run in after the part of the file moved before, or make it the start
+
+	if(marker->Prev != 0) {
+		if(fssetfat(vol, marker->Prev, marker->NewCluster)) return -1;
+	} else {
+		memcpy(&entry, fsaccess(vol, marker->Entry), sizeof(DirEntry));
+
+		entry.StartCluster = marker->NewCluster & 0xFFFF;
+		entry.StartClusterHigh = vol->Fat32 ? marker->NewCluster >> 16 : 0;
+
+		if(fswriteimage(vol, marker->Entry, (uint8_t *)&entry, 0, sizeof(DirEntry))) return -1;
+	}
+
+	if(fsfinishwrite(vol)) return -1;
+
+	// Clearing the magic only clears bits, so it doesn't cost an erase
+
+	if(fsdevprogram(vol, defragaddress, (uint8_t *)&zero, sizeof(zero))) return -1;
+
+	return fsflush(vol);
+}
+
+int fsdefragmark(FsVolume *vol, FsDefragMarker *marker) {
+	uint32_t i;
+
+	// Each marker gets a sector of its own, the block is only erased once all of them were used
+
+	for(i = 0; i < FS_ERASE_SIZE; i += FS_SECTOR_SIZE)
+		if(fsblank(fsaccess(vol, vol->LogOffset + i), FS_SECTOR_SIZE)) break;
+
+	if(i == FS_ERASE_SIZE) {
+		if(fsdeverase(vol, vol->LogOffset)) return -1;
+
+		i = 0;
+	}
+
+	defragaddress = vol->LogOffset + i;
+
+	return fsdevprogram(vol, defragaddress, (uint8_t *)marker, sizeof(FsDefragMarker));
+}
+
+int fsdefragresume(FsVolume *vol) {
+	FsDefragMarker *marker = &defragmarker;
+	uint32_t i;
+
+	for(i = 0; i < FS_ERASE_SIZE; i += FS_SECTOR_SIZE) {
+		memcpy(marker, fsaccess(vol, vol->LogOffset + i), sizeof(FsDefragMarker));
+
+		if(marker->Magic == FS_DEFRAG_MAGIC && marker->Crc == fscrc32(0, (uint8_t *)&marker->Entry, sizeof(FsDefragMarker) - 8)) break;
+	}
+
+	if(i == FS_ERASE_SIZE) return 0;
+
+	defragaddress = vol->LogOffset + i;
+
+	if(marker->Count > FS_MAX_EXTENTS || marker->NewCluster < 2 || marker->NewCluster + marker->Clusters > (uint32_t)vol->TotalClusters + 2)
+		err("The defrag marker is corrupted!\n");
+
+	if(vol->Device->WriteSector == NULL) err("The filesystem is read-only, the defrag can not be finished!\n");
+
+	msg("Finishing the move of the file at 0x%08X\n", (unsigned)marker->Entry);
+
+	fsloadfreemap(vol);
+
+	if(fsdefragapply(vol, marker)) return fsabortwrite(vol);
+
+	return 0;
+}
+
+int fsdefragfile(FsDir *dir, int id, uint8_t *buffer, uint32_t size) {
+	FsVolume *vol = dir->Volume;
+	FsExtentCache *cache = &defragextents;
+	FsDefragMarker *marker = &defragmarker;
+	uint32_t offset, len, done, part, src, dest, placed = 0, first, count;
+	int clust, start, length, total, i;
+
+	fsbuildextents(cache, vol, fsentrycluster(vol, fsreaddirentry(dir, id)));
+
+	if(cache->Count <= 1) return 0;
+
+	total = cache->Clusters;
+
+	// Without a free run for the whole file, gather as much of it as fits
+
+	if((start = fsfindfreerun(vol, total, &length)) == 0) return 1;
+
+	if(length > total) length = total;
+
+	// Each step moves whole runs into the free run, appending them to the part
+	// moved already. That also keeps the runs within what the marker holds.
+
+	while(placed < (uint32_t)length) {
+		first = (placed > 0) ? 1 : 0;
+
+		for(i = first, count = 0; i < cache->Count && placed + count + cache->Runs[i].Length <= (uint32_t)length; i++)
+			count += cache->Runs[i].Length;
+
+		// Moving a single run somewhere else on its own gains nothing
+
+		if(i - (int)first < (first ? 1 : 2)) break;
+
+		msg("Moving %d cluster(s) in %d run(s) to cluster %d\n", (int)count, i - (int)first, (int)(start + placed));
+
+		// Copy the data over first, through the buffer a few erase blocks at a time.
+		// The new clusters are still free until the marker says otherwise.
+
+		for(offset = placed; offset < placed + count; offset += len) {
+			len = fsextentrun(cache, offset, &clust);
+			src = fsclusteroffset(vol, clust);
+			dest = fsclusteroffset(vol, start + offset);
+
+			for(done = 0; done < len * vol->ClusterSize; done += part) {
+				part = (len * vol->ClusterSize - done < size) ? len * vol->ClusterSize - done : size;
+
+				if(fsdevread(vol, src + done, buffer, part)) return -1;
+
+				copywait();
+
+				if(fswriteimage(vol, dest + done, buffer, 0, part)) return -1;
+			}
+		}
+
+		if(fsflush(vol)) return -1;
+
+		// From here on the step gets finished, even after a power loss. Before, the
+		// new clusters are still free and the log kept the rest of their blocks.
+
+		marker->Magic = FS_DEFRAG_MAGIC;
+		marker->Entry = fsdirentryaddress(dir, id);
+		marker->Prev = placed ? start + placed - 1 : 0;
+		marker->NewCluster = start + placed;
+		marker->Clusters = count;
+		marker->Next = (i < cache->Count) ? cache->Runs[i].Cluster : (cache->Tail != 0xFFFFFFFF) ? cache->Tail : 0x0FFFFFFF;
+		marker->Count = i - first;
+		memset(marker->Runs, 0, sizeof(marker->Runs));
+		memcpy(marker->Runs, cache->Runs + first, marker->Count * sizeof(FsExtent));
+		marker->Crc = fscrc32(0, (uint8_t *)&marker->Entry, sizeof(FsDefragMarker) - 8);
+
+		if(fsdefragmark(vol, marker)) return -1;
+
+		if(fsdefragapply(vol, marker)) return -1;
+
+		placed += count;
+
+		fsbuildextents(cache, vol, start);
+	}
+
+	return placed ? 0 : 1;
+}
+
+int fsdefragwalk(FsVolume *vol, uint8_t *buffer, uint32_t size, FsDefragStats *stats, int pass) {
+	FsDir *dir;
+	DirEntry *entry;
+	int level = 0, id, ret, moved = 0;
+
+	fsrootdir(&defragdirs[0], vol);
+	defragpos[0] = 0;
+
+	// Go through the dirs without recursion, the stack is tiny
+
+	while(level >= 0) {
+		dir = &defragdirs[level];
+
+		fscheckdir(dir);
+
+		if(defragpos[level] >= dir->Size) {
+			level--;
+			continue;
+		}
+
+		id = defragpos[level]++;
+		entry = fsreaddirentry(dir, id);
+
+		if(entry->Basename[0] == 0) {
+			defragpos[level] = dir->Size;
+			continue;
+		}
+
+		if((uint8_t)entry->Basename[0] == 0xE5 || entry->Basename[0] == '.' || (entry->Attribute & 0x08)) continue;
+
+		if(entry->Attribute & 0x10) {
+			if(level + 1 < FS_DEFRAG_DEPTH && !fsopendirentry(&defragdirs[level + 1], dir, id)) defragpos[++level] = 0;
+
+			continue;
+		}
+
+		fsbuildextents(&defragextents, vol, fsentrycluster(vol, entry));
+
+		if(defragextents.Count <= 1) continue;
+
+		// Pass 0 only counts what is left, the first one also counts what was there
+
+		if(pass == 0) {
+			stats->FragmentedAfter++;
+			stats->RunsAfter += defragextents.Count;
+			continue;
+		}
+
+		if(pass == 1) {
+			stats->FragmentedBefore++;
+			stats->RunsBefore += defragextents.Count;
+		}
+
+		if((ret = fsdefragfile(dir, id, buffer, size)) < 0) return -1;
+
+		if(ret == 0) moved++;
+	}
+
+	stats->Moved += moved;
+
+	return moved;
+}
+
+int fsdefragvolume(FsVolume *vol, uint8_t *buffer, uint32_t size, FsDefragStats *stats) {
+	int pass, moved;
+
+	if(vol->Device->WriteSector == NULL) err("The filesystem is read-only!\n");
+	if(vol->LogOffset == 0) err("There is no room for the defrag log, the volume needs %d reserved sectors!\n", (FS_LOG_BLOCK + FS_LOG_BLOCKS) * FS_ERASE_SIZE / vol->Info.BytesPerSector);
+
+	size -= size % FS_ERASE_SIZE;
+
+	if(size == 0) err("The defrag buffer has to hold at least one erase block!\n");
+
+	memset(stats, 0, sizeof(FsDefragStats));
+	memset(&writestats, 0, sizeof(writestats));
+
+	fsloadfreemap(vol);
+
+	if(fsdefragresume(vol)) return -1;
+
+	// Moving files frees up their old runs, which may let others move
+	// on the next pass. Then count again to see what is left.
+
+	for(pass = 1, moved = 1; pass <= FS_DEFRAG_PASSES && moved > 0; pass++) {
+		if((moved = fsdefragwalk(vol, buffer, size, stats, pass)) < 0) {
+			fsabortwrite(vol);
+			err("Could not finish the defrag!\n");
+		}
+	}
+
+	fsdefragwalk(vol, buffer, size, stats, 0);
+
+	stats->Erases = writestats.Erases;
+	stats->Programs = writestats.Programs;
+
+	msg("Defrag: %d fragmented file(s) before, %d after, %d erase(s)\n", stats->FragmentedBefore, stats->FragmentedAfter, stats->Erases);
+
+	return 0;
+}
+
+int fsdefrag(uint8_t *buffer, uint32_t size, FsDefragStats *stats) {
+	return fsdefragvolume(&mainvolume, buffer, size, stats);
+}
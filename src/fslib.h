@@ -1,3 +1,5 @@
+#pragma once
+
 #include <stdint.h>
 
 typedef struct __attribute__((__packed__)) {
@@ -21,6 +23,22 @@ typedef struct __attribute__((__packed__)) {
 	char FileSystem[8];
 } BIOSParams;
 
+typedef struct __attribute__((__packed__)) {
+	uint32_t SectorsPerFat;
+	uint16_t Flags;
+	uint16_t Version;
+	uint32_t RootCluster;
+	uint16_t InfoSector;
+	uint16_t BackupSector;
+	uint8_t Reserved[12];
+	uint8_t DriveNo;
+	uint8_t Reserved8;
+	uint8_t Signature;
+	uint32_t VolumeID;
+	char VolumeLabel[11];
+	char FileSystem[8];
+} BIOSParams32;
+
 typedef struct __attribute__((__packed__)) {
 	char Basename[8];
 	char Extension[3];
@@ -30,21 +48,190 @@ typedef struct __attribute__((__packed__)) {
 	uint16_t CreationTime;
 	uint16_t CreationDate;
 	uint16_t LastAccessDate;
-	uint16_t Reserved16;
+	uint16_t StartClusterHigh;
 	uint16_t LastWriteTime;
 	uint16_t LastWriteDate;
 	uint16_t StartCluster;
 	uint32_t Size;
 } DirEntry;
 
+#define FS_MAX_EXTENTS 32
+#define FS_MAX_CLUSTERS 65536
+#define FS_MAX_NAME 128
+
+typedef struct FsBlockDevice FsBlockDevice;
+
+struct FsBlockDevice {
+	uint8_t *Mapped;
+	int (*ReadSector)(FsBlockDevice *dev, uint32_t sector, uint8_t *buffer, uint32_t count);
+	int (*WriteSector)(FsBlockDevice *dev, uint32_t sector, const uint8_t *data, uint32_t count);
+	int (*Erase)(FsBlockDevice *dev, uint32_t address);
+	int (*Flush)(FsBlockDevice *dev);
+	void *Context;
+};
+
+typedef struct {
+	FsBlockDevice *Device;
+	FsBlockDevice ImageDevice;
+	BIOSParams Info;
+	BIOSParams32 Info32;
+	int Fat32;
+	uint32_t FatOffset;
+	uint32_t FatSize;
+	uint32_t RootOffset;
+	uint32_t RootCluster;
+	uint32_t InfoOffset;
+	uint32_t ClusterSize;
+	uint32_t FatDirtyStart;
+	uint32_t FatDirtyEnd;
+	int DataSector;
+	int TotalClusters;
+	int FreeClusters;
+	int FreeMapValid;
+	int NextFree;
+	uint32_t Generation;
+	uint32_t DiskGeneration;
+	uint32_t LogOffset;
+	uint32_t LogRecord;
+	uint32_t FreeMap[FS_MAX_CLUSTERS / 32];
+} FsVolume;
+
+typedef struct {
+	uint32_t Cluster;
+	uint32_t Length;
+} FsExtent;
+
+typedef struct {
+	FsVolume *Volume;
+	uint32_t StartCluster;
+	uint16_t Count;
+	uint16_t HintRun;
+	uint32_t Tail;
+	uint32_t HintOffset;
+	uint32_t TailOffset;
+	uint32_t CursorCluster;
+	uint32_t CursorOffset;
+	uint32_t Clusters;
+	FsExtent Runs[FS_MAX_EXTENTS];
+} FsExtentCache;
+
+typedef struct {
+	uint32_t Size;
+	uint32_t Position;
+	uint32_t Crc;
+	uint32_t CrcPosition;
+	uint8_t *PendingData;
+	uint32_t PendingSize;
+	FsExtentCache Extents;
+} FsFile;
+
+typedef struct {
+	FsVolume *Volume;
+	int Cluster;
+	int Size;
+	uint32_t Generation;
+	FsExtentCache Extents;
+} FsDir;
+
+typedef struct {
+	FsDir *Dir;
+	int Index;
+	int Position;
+	uint8_t Require;
+	uint8_t Exclude;
+	uint8_t LongNext;
+	uint8_t LongChecksum;
+	const char *Pattern;
+	const char *Contains;
+	char Name[FS_MAX_NAME];
+} FsDirIter;
+
+typedef struct {
+	uint16_t Name;
+	uint16_t Entry;
+} FsNameRef;
+
+typedef struct {
+	FsDir *Dir;
+	uint32_t Generation;
+	char *Buffer;
+	uint32_t Size;
+	int Count;
+	int Complete;
+} FsNameTable;
+
+typedef void (*FsCopyStart)(uint8_t *dest, const uint8_t *src, uint32_t size);
+typedef void (*FsCopyWait)();
+typedef uint32_t (*FsCrcUpdate)(uint32_t crc, const uint8_t *data, uint32_t size);
+
+typedef struct {
+	int Erases;
+	int Programs;
+} FsWriteStats;
+
+typedef struct {
+	int FragmentedBefore;
+	int FragmentedAfter;
+	int RunsBefore;
+	int RunsAfter;
+	int Moved;
+	int Erases;
+	int Programs;
+} FsDefragStats;
+
 int fsmount(uint8_t *fsimage);
+int fsmountdevice(FsBlockDevice *dev);
 long fsloadfile(char *filename, uint8_t *buffer, uint32_t maxsize);
+int fsopen(FsFile *file, char *filename);
+long fsread(FsFile *file, uint8_t *buffer, uint32_t size);
+long fsreadstart(FsFile *file, uint8_t *buffer, uint32_t size);
+void fsreadwait(FsFile *file);
+int fsseek(FsFile *file, uint32_t position);
+void fsclose(FsFile *file);
+const uint8_t *fsmapfile(char *filename, uint32_t *size);
 int fswritefile(char *filename, uint8_t *data, uint32_t size);
 int fsdeletefile(char *filename);
 DirEntry *fsreaddir(int dirs_only, int *entries);
 int fschdir(char *filename);
 int fsgetfreespace();
+void fssetcopyhooks(FsCopyStart start, FsCopyWait wait);
+void fssetcrchook(FsCrcUpdate update);
+uint32_t fscrc32(uint32_t crc, const uint8_t *data, uint32_t size);
+long fsloadfilechecked(char *filename, uint8_t *buffer, uint32_t maxsize);
+FsWriteStats *fsgetwritestats();
+int fsdefrag(uint8_t *buffer, uint32_t size, FsDefragStats *stats);
+
+int fsmountvolume(FsVolume *vol, FsBlockDevice *dev);
+int fsmountimage(FsVolume *vol, uint8_t *fsimage);
+int fsgetvolumefreespace(FsVolume *vol);
+uint32_t fsgetgeneration(FsVolume *vol);
+FsVolume *fsgetvolume();
+FsDir *fsgetcwd();
+void fsrootdir(FsDir *dir, FsVolume *vol);
+int fsopendir(FsDir *dir, FsDir *parent, char *filename);
+int fsopendirentry(FsDir *dir, FsDir *parent, int entry);
+DirEntry *fsreaddirat(FsDir *dir, int dirs_only, int *entries);
+int fsdir_open(FsDirIter *it, FsDir *dir, uint8_t require, uint8_t exclude);
+void fsdir_filter(FsDirIter *it, const char *pattern, const char *contains);
+DirEntry *fsdir_next(FsDirIter *it);
+int fsdir_nametableiter(FsNameTable *table, FsDirIter *it, char *buffer, uint32_t size);
+int fsdir_nametable(FsNameTable *table, FsDir *dir, uint8_t require, uint8_t exclude, char *buffer, uint32_t size);
+const char *fsnametable_name(FsNameTable *table, int id);
+int fsnametable_entry(FsNameTable *table, int id);
+int fsopenat(FsDir *dir, FsFile *file, char *filename);
+long fsloadfileat(FsDir *dir, char *filename, uint8_t *buffer, uint32_t maxsize);
+int fsfindcrc(FsDir *dir, char *filename, uint32_t *crc);
+long fsloadfilecheckedat(FsDir *dir, char *filename, uint8_t *buffer, uint32_t maxsize);
+const uint8_t *fsmapfileat(FsDir *dir, char *filename, uint32_t *size);
+int fswritefileat(FsDir *dir, char *filename, uint8_t *data, uint32_t size);
+int fsdeletefileat(FsDir *dir, char *filename);
+int fsdefragvolume(FsVolume *vol, uint8_t *buffer, uint32_t size, FsDefragStats *stats);
+int fsdefragresume(FsVolume *vol);
+int fslogreplay(FsVolume *vol);
+
+void fsbuildextents(FsExtentCache *cache, FsVolume *vol, int startclust);
+int fsextentcluster(FsExtentCache *cache, uint32_t offset);
+uint32_t fsextentrun(FsExtentCache *cache, uint32_t offset, int *clust);
 
 void fatname_to_filename(char *src, char *dest);
 void filename_to_fatname(char *src, char *dest);
-
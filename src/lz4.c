@@ -0,0 +1,313 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "lz4.h"
+#include "fslib.h"
+
+#define LZ4_MAGIC 0x184D2204
+
+enum {
+	LZ4_HEADER,
+	LZ4_DESCRIPTOR,
+	LZ4_SKIP,
+	LZ4_BLOCK_SIZE,
+	LZ4_RAW,
+	LZ4_TOKEN,
+	LZ4_LITERAL_LENGTH,
+	LZ4_LITERALS,
+	LZ4_OFFSET,
+	LZ4_MATCH_LENGTH,
+	LZ4_END,
+	LZ4_ERROR
+};
+
+uint8_t lz4chunks[2][LZ4_CHUNK] __attribute__((aligned(4)));
+
+/**
+  * @brief  Start decompressing an LZ4 frame.
+  * @param  stream: Decompression state.
+  * @param  dest: Buffer for the decompressed data.
+  * @param  maxsize: Size of the buffer.
+  * @return Nothing.
+  */
+void lz4_init(Lz4Stream *stream, uint8_t *dest, uint32_t maxsize) {
+	memset(stream, 0, sizeof(Lz4Stream));
+
+	stream->Dest = dest;
+	stream->MaxSize = maxsize;
+	stream->State = LZ4_HEADER;
+}
+
+/**
+  * @brief  Skip some bytes of the frame, then carry on with another state.
+  * @param  stream: Decompression state.
+  * @param  count: Number of bytes to skip.
+  * @param  next: State after the skipped bytes.
+  * @return Nothing.
+  */
+void lz4_skip(Lz4Stream *stream, int count, int next) {
+	stream->Count = count;
+	stream->Next = next;
+	stream->State = count ? LZ4_SKIP : next;
+}
+
+/**
+  * @brief  Carry on after a block, skipping its checksum if it has one.
+  * @param  stream: Decompression state.
+  * @return Nothing.
+  */
+void lz4_block_done(Lz4Stream *stream) {
+	stream->Count = 0;
+	stream->Value = 0;
+
+	lz4_skip(stream, (stream->Flags & 0x10) ? 4 : 0, LZ4_BLOCK_SIZE);
+}
+
+/**
+  * @brief  Carry on after the literals of a sequence.
+  * @param  stream: Decompression state.
+  * @return Nothing.
+  */
+void lz4_literals_done(Lz4Stream *stream) {
+	// The last sequence of a block has no match
+
+	if(stream->BlockLeft == 0) {
+		lz4_block_done(stream);
+	} else {
+		stream->Count = 0;
+		stream->Value = 0;
+		stream->State = LZ4_OFFSET;
+	}
+}
+
+/**
+  * @brief  Copy a match from the data decompressed already.
+  * @param  stream: Decompression state.
+  * @return 0 on success, -1 if the match is out of bounds.
+  */
+int lz4_copy_match(Lz4Stream *stream) {
+	uint8_t *dest = stream->Dest + stream->Size, *src = dest - stream->Value;
+	uint32_t i;
+
+	if(stream->Value == 0 || stream->Value > stream->Size || stream->Length > stream->MaxSize - stream->Size) return -1;
+
+	// The match may overlap the bytes it produces, so byte by byte
+
+	for(i = 0; i < stream->Length; i++)
+		dest[i] = src[i];
+
+	stream->Size += stream->Length;
+	stream->State = LZ4_TOKEN;
+
+	return 0;
+}
+
+/**
+  * @brief  Decompress the next part of an LZ4 frame. The parts can be split anywhere.
+  * @param  stream: Decompression state.
+  * @param  src: Compressed data.
+  * @param  size: Length of the compressed data.
+  * @return 0 on success, -1 if the data is corrupted or does not fit.
+  */
+int lz4_feed(Lz4Stream *stream, const uint8_t *src, uint32_t size) {
+	const uint8_t *end = src + size;
+	uint32_t len;
+	uint8_t c;
+
+	while(src < end && stream->State != LZ4_ERROR) {
+		// Literals and uncompressed blocks are copied in one go
+
+		if(stream->State == LZ4_RAW || stream->State == LZ4_LITERALS) {
+			len = (stream->State == LZ4_RAW) ? stream->BlockLeft : stream->Length;
+
+			if(len > stream->BlockLeft) len = stream->BlockLeft;
+			if(len > end - src) len = end - src;
+
+			if(len > stream->MaxSize - stream->Size || (stream->State == LZ4_LITERALS && stream->BlockLeft == 0)) {
+				stream->State = LZ4_ERROR;
+				break;
+			}
+
+			memcpy(stream->Dest + stream->Size, src, len);
+
+			src += len;
+			stream->Size += len;
+			stream->BlockLeft -= len;
+
+			if(stream->State == LZ4_RAW) {
+				if(stream->BlockLeft == 0) lz4_block_done(stream);
+			} else if((stream->Length -= len) == 0) {
+				lz4_literals_done(stream);
+			}
+
+			continue;
+		}
+
+		c = *src++;
+
+		// Everything from the token on counts towards the block size
+
+		if(stream->State >= LZ4_TOKEN && stream->State <= LZ4_MATCH_LENGTH) {
+			if(stream->BlockLeft == 0) {
+				stream->State = LZ4_ERROR;
+				break;
+			}
+
+			stream->BlockLeft--;
+		}
+
+		switch(stream->State) {
+			case LZ4_HEADER:
+				stream->Value |= (uint32_t)c << (stream->Count * 8);
+
+				if(++stream->Count == 4) {
+					stream->State = (stream->Value == LZ4_MAGIC) ? LZ4_DESCRIPTOR : LZ4_ERROR;
+					stream->Count = 0;
+				}
+
+				break;
+
+			case LZ4_DESCRIPTOR:
+				// Only version 1 exists, and dictionaries are not supported
+
+				if(stream->Count++ == 0) {
+					stream->Flags = c;
+
+					if((c >> 6) != 1 || (c & 1)) stream->State = LZ4_ERROR;
+				} else {
+					// Skip the content size and the header checksum
+
+					stream->Count = 0;
+					stream->Value = 0;
+
+					lz4_skip(stream, ((stream->Flags & 0x08) ? 8 : 0) + 1, LZ4_BLOCK_SIZE);
+				}
+
+				break;
+
+			case LZ4_SKIP:
+				if(--stream->Count == 0) stream->State = stream->Next;
+				break;
+
+			case LZ4_BLOCK_SIZE:
+				stream->Value |= (uint32_t)c << (stream->Count * 8);
+
+				if(++stream->Count < 4) break;
+
+				if(stream->Value == 0) {
+					// End mark, followed by the content checksum if there is one
+
+					lz4_skip(stream, (stream->Flags & 0x04) ? 4 : 0, LZ4_END);
+				} else {
+					// The top bit marks an uncompressed block
+
+					stream->BlockLeft = stream->Value & 0x7FFFFFFF;
+					stream->State = (stream->Value >> 31) ? LZ4_RAW : LZ4_TOKEN;
+				}
+
+				break;
+
+			case LZ4_TOKEN:
+				stream->Token = c;
+				stream->Length = c >> 4;
+
+				if(stream->Length == 15)
+					stream->State = LZ4_LITERAL_LENGTH;
+				else if(stream->Length > 0)
+					stream->State = LZ4_LITERALS;
+				else
+					lz4_literals_done(stream);
+
+				break;
+
+			case LZ4_LITERAL_LENGTH:
+				stream->Length += c;
+
+				if(c != 255) stream->State = LZ4_LITERALS;
+				break;
+
+			case LZ4_OFFSET:
+				stream->Value |= (uint32_t)c << (stream->Count * 8);
+
+				if(++stream->Count < 2) break;
+
+				stream->Length = (stream->Token & 15) + 4;
+
+				if((stream->Token & 15) == 15)
+					stream->State = LZ4_MATCH_LENGTH;
+				else if(lz4_copy_match(stream))
+					stream->State = LZ4_ERROR;
+
+				break;
+
+			case LZ4_MATCH_LENGTH:
+				stream->Length += c;
+
+				if(c != 255 && lz4_copy_match(stream)) stream->State = LZ4_ERROR;
+				break;
+
+			case LZ4_END:
+				// Anything after the frame is ignored
+
+				src = end;
+				break;
+		}
+	}
+
+	return (stream->State == LZ4_ERROR) ? -1 : 0;
+}
+
+/**
+  * @brief  Finish decompressing an LZ4 frame.
+  * @param  stream: Decompression state.
+  * @return Decompressed size, or -1 if the frame is incomplete or corrupted.
+  */
+long lz4_finish(Lz4Stream *stream) {
+	return (stream->State == LZ4_END) ? (long)stream->Size : -1;
+}
+
+/**
+  * @brief  Load and decompress an LZ4 compressed file. Each chunk is decompressed
+  *         while the next one is being read. Checked against CRC32.SFV if listed there.
+  * @param  dir: Directory of the file.
+  * @param  filename: Name of the file.
+  * @param  dest: Buffer for the decompressed data.
+  * @param  maxsize: Size of the buffer.
+  * @return Decompressed size, or -1 on error.
+  */
+long lz4_loadfile(FsDir *dir, char *filename, uint8_t *dest, uint32_t maxsize) {
+	FsFile file;
+	Lz4Stream stream;
+	uint32_t crc;
+	long len, next = 0;
+	int cur = 0, checked;
+
+	if(fsopenat(dir, &file, filename)) return -1;
+
+	// The checksum covers the compressed file, it is kept while reading it
+
+	if((checked = !fsfindcrc(dir, filename, &crc))) file.CrcPosition = 0;
+
+	lz4_init(&stream, dest, maxsize);
+
+	len = fsreadstart(&file, lz4chunks[0], LZ4_CHUNK);
+
+	while(len > 0) {
+		// Starting the next read waits for the current chunk. If there is no
+		// next one, the current chunk has to be waited for here.
+
+		if((next = fsreadstart(&file, lz4chunks[cur ^ 1], LZ4_CHUNK)) <= 0) fsreadwait(&file);
+
+		if(next < 0 || lz4_feed(&stream, lz4chunks[cur], len)) break;
+
+		cur ^= 1;
+		len = next;
+	}
+
+	fsreadwait(&file);
+	fsclose(&file);
+
+	if(len != 0 || (checked && file.Crc != crc)) return -1;
+
+	return lz4_finish(&stream);
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "fslib.h"
+
+#define LZ4_CHUNK 8192
+
+typedef struct {
+	uint8_t *Dest;
+	uint32_t Size;
+	uint32_t MaxSize;
+	int State;
+	int Next;
+	uint8_t Flags;
+	uint8_t Token;
+	int Count;
+	uint32_t Value;
+	uint32_t BlockLeft;
+	uint32_t Length;
+} Lz4Stream;
+
+void lz4_init(Lz4Stream *stream, uint8_t *dest, uint32_t maxsize);
+int lz4_feed(Lz4Stream *stream, const uint8_t *src, uint32_t size);
+long lz4_finish(Lz4Stream *stream);
+long lz4_loadfile(FsDir *dir, char *filename, uint8_t *dest, uint32_t maxsize);
@@ -27,6 +27,12 @@
 
 #include "mainmenu.h"
 
+FsBlockDevice flash_device = {
+	.Mapped = (uint8_t*)0x90000000,
+	.WriteSector = flash_write_sector,
+	.Erase = flash_erase_sector,
+};
+
 /**
   * @brief  The application entry point.
   * @return Nothing.
@@ -48,6 +54,8 @@ int main() {
 	MX_LTDC_Init();
 	MX_SPI2_Init();
 	MX_OCTOSPI1_Init();
+	MX_MDMA_Init();
+	MX_CRC_Init();
 	MX_DAC1_Init();
 	MX_DAC2_Init();
 	MX_RTC_Init();
@@ -65,13 +73,19 @@ int main() {
 	lcd_init();
 	lcd_backlight_level(syscfg->Brightness);
 
-	// Inintialize flash
+	// Inintialize flash, in quad mode if the chip supports it
 
-	OSPI_Init(&hospi1, SPI_MODE, VENDOR_MX);
+	OSPI_InitAuto(&hospi1);
 	OSPI_NOR_WriteEnable(&hospi1);
 	OSPI_EnableMemoryMappedMode(&hospi1);
 
-	if(fsmount((uint8_t*)0x90000000)) {
+	// Let the MDMA do the bulk copying out of the memory-mapped flash,
+	// and the CRC unit check what has been copied
+
+	fssetcopyhooks(mdma_copy_start, mdma_copy_wait);
+	fssetcrchook(crc_update);
+
+	if(fsmountdevice(&flash_device)) {
 		lcd_print_centered("Error! File system is corrupted!", 160, 116, 0xFFFF, 0x0000);
 		lcd_update();
 
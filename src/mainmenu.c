@@ -15,6 +15,26 @@ HomebrewEntry cache[3];
 
 int selection, maxselection, scroll;
 
+FsDirIter hbiter;
+
+FsNameTable hbtable;
+uint32_t hbnames[1024];
+
+SnapshotHeader hbsnapshot;
+const uint8_t *hbsnapmap;
+FsFile hbsnapfile;
+int hbsnapstale;
+
+/**
+  * @brief  Start listing the homebrew dirs, those with a MAIN.BIN or MAIN.LZ4 inside.
+  * @param  it: Directory iterator.
+  * @return Nothing.
+  */
+void open_hb_dir(FsDirIter *it) {
+	fsdir_open(it, fsgetcwd(), 0x10, 0);
+	fsdir_filter(it, NULL, HOMEBREW_MAIN);
+}
+
 /**
   * @brief  Draw a selection border.
   * @param  i: Position on the screen (0-2).
@@ -95,12 +115,24 @@ void copy_bmp(uint16_t *imgdata, int id) {
 
 /**
   * @brief  Decode bitmap to the homebrew cache.
-  * @param  bmp: Pointer to a valid BMP file.
+  * @param  bmp: Handle of an open BMP file.
   * @param  id: Homebrew cache ID (0-2).
-  * @return Nothing.
+  * @return 0 on success, -1 if the file is too short.
   */
-void decode_bmp(unsigned char *bmp, int id) {
-	copy_bmp((uint16_t *)(bmp + bmp[0x0A]), id);
+int decode_bmp(FsFile *bmp, int id) {
+	uint8_t header[54];
+
+	id %= 3;
+
+	// Read just the header, then the pixel data straight into the cache
+
+	if(fsread(bmp, header, sizeof(header)) != sizeof(header)) return -1;
+
+	if(fsseek(bmp, header[0x0A])) return -1;
+
+	if(fsread(bmp, (uint8_t *)cache[id].bitmap, sizeof(cache[id].bitmap)) != sizeof(cache[id].bitmap)) return -1;
+
+	return 0;
 }
 
 /**
@@ -116,75 +148,360 @@ void hb_error(int id, char *msg) {
 }
 
 /**
-  * @brief  Load homebrew info to the homebrew cache.
-  * @param  id: Homebrew ID.
-  * @param  dir: Directory name.
+  * @brief  Copy a manifest field to the homebrew cache, if the line contains it.
+  * @param  dest: Destination string (32 bytes).
+  * @param  key: Field name, including the equals sign.
+  * @param  line: Start of the line.
+  * @param  end: End of the line.
   * @return Nothing.
   */
-void load_hb_info(int id, char *dir) {
-	long size;
-	char *lineparser;
+void copy_field(char *dest, char *key, const char *line, const char *end) {
+	int len = strlen(key);
 
-	int i = id % 3;
+	if(end - line < len || memcmp(key, line, len)) return;
 
-	// Check if this homebrew ID has already been loaded
+	line += len;
+	if(end - line > 31) end = line + 31;
 
-	if(cache[i].id != id) {
-		// If it hasn't, then enter its directory and load the manifest & icon
+	memcpy(dest, line, end - line);
+	dest[end - line] = 0;
+}
 
-		if(!fschdir(dir)) {
-			if((size = fsloadfile("MANIFEST.TXT", data_buffer, sizeof(data_buffer))) > 0) {
-				// Use default values first
+/**
+  * @brief  Parse a manifest to the homebrew cache.
+  * @param  manifest: Manifest text, does not need to be zero-terminated.
+  * @param  size: Length of the manifest.
+  * @param  id: Homebrew cache ID (0-2).
+  * @param  name: Default name, usually the directory name.
+  * @return Nothing.
+  */
+void parse_manifest(const char *manifest, long size, int id, const char *name) {
+	const char *line, *next, *end = manifest + size;
 
-				sprintf(cache[i].name, "Unnamed homebrew");
-				sprintf(cache[i].author, "Unknown author");
-				sprintf(cache[i].version, "1.0");
+	// Use default values first
 
-				// Parse each line
+	snprintf(cache[id].name, sizeof(cache[id].name), "%s", name);
+	sprintf(cache[id].author, "Unknown author");
+	sprintf(cache[id].version, "1.0");
 
-				lineparser = strtok((char *) data_buffer, "\n");
+	// Parse each line
 
-				while(lineparser != NULL) {
-					if(!memcmp("Name=", lineparser, 5))
-						strncpy(cache[i].name, lineparser + 5, 32);
+	for(line = manifest; line < end; line = next + 1) {
+		if((next = memchr(line, '\n', end - line)) == NULL) next = end;
 
-					if(!memcmp("Author=", lineparser, 7))
-						strncpy(cache[i].author, lineparser + 7, 32);
+		copy_field(cache[id].name, "Name=", line, next);
+		copy_field(cache[id].author, "Author=", line, next);
+		copy_field(cache[id].version, "Version=", line, next);
+	}
+}
 
-					if(!memcmp("Version=", lineparser, 8))
-						strncpy(cache[i].version, lineparser + 8, 32);
+/**
+  * @brief  Find the directory of a homebrew without listing the whole directory.
+  * @param  id: Homebrew ID.
+  * @param  name: Set to the (long) directory name.
+  * @return Directory entry number, or -1 if there is no such homebrew.
+  */
+int get_hb_entry(int id, const char **name) {
+	int entry;
 
-					lineparser = strtok(NULL, "\n");
-				}
+	// Use the name table as long as the directory has not changed
+
+	if((entry = fsnametable_entry(&hbtable, id)) >= 0) {
+		*name = fsnametable_name(&hbtable, id);
+		return entry;
+	}
+
+	// Keep going from the last entry when scrolling down, start over otherwise
+
+	if(id < hbiter.Position) open_hb_dir(&hbiter);
+
+	while(hbiter.Position <= id)
+		if(fsdir_next(&hbiter) == NULL) return -1;
+
+	*name = hbiter.Name;
+	return hbiter.Index - 1;
+}
+
+/**
+  * @brief  Add bytes to an FNV-1a hash.
+  * @param  hash: Hash so far.
+  * @param  data: Bytes to add.
+  * @param  size: Number of bytes.
+  * @return Updated hash.
+  */
+uint32_t hash_bytes(uint32_t hash, const void *data, uint32_t size) {
+	const uint8_t *bytes = data;
+
+	while(size--)
+		hash = (hash ^ *bytes++) * 16777619u;
+
+	return hash;
+}
+
+/**
+  * @brief  Hash the root directory entries and names, and which of them hold a homebrew.
+  *         Nothing inside the homebrew directories is read.
+  * @return Hash of the listing.
+  */
+uint32_t hash_listing() {
+	FsDirIter it;
+	DirEntry *entry;
+	const char *name;
+	uint32_t hash = 2166136261u;
+	int id, index;
+
+	fsdir_open(&it, fsgetcwd(), 0x10, 0);
+
+	while((entry = fsdir_next(&it)) != NULL) {
+		hash = hash_bytes(hash, entry, sizeof(DirEntry));
+		hash = hash_bytes(hash, it.Name, strlen(it.Name));
+	}
+
+	for(id = 0; id < maxselection && (index = get_hb_entry(id, &name)) >= 0; id++)
+		hash = hash_bytes(hash, &index, sizeof(index));
+
+	return hash;
+}
+
+/**
+  * @brief  Hash the entries of the manifest and icon of a homebrew, so that editing them shows.
+  * @param  hbdir: Homebrew directory.
+  * @return Hash of the entries (size, date, start cluster).
+  */
+uint32_t hash_hb_files(FsDir *hbdir) {
+	FsDirIter it;
+	DirEntry *entry;
+	uint32_t hash = 2166136261u;
+	int found = 0;
+
+	fsdir_open(&it, hbdir, 0, 0x10);
+
+	while(found < 2 && (entry = fsdir_next(&it)) != NULL) {
+		if(!memcmp(entry->Basename, "MANIFESTTXT", 11) || !memcmp(entry->Basename, "ICON    BMP", 11)) {
+			hash = hash_bytes(hash, entry, sizeof(DirEntry));
+			found++;
+		}
+	}
+
+	return hash;
+}
+
+/**
+  * @brief  Check the snapshot of the homebrew info against the current listing.
+  * @return 0 if the snapshot can be used, -1 otherwise.
+  */
+int load_snapshot() {
+	SnapshotHeader header;
+	uint32_t size;
+
+	hbsnapshot.Magic = 0;
+
+	// Without the write log the generation is not kept on the volume, so
+	// nothing tells whether a snapshot there is still up to date
+
+	if(fsgetvolume()->LogOffset == 0) return -1;
+
+	// The snapshot is used straight from the flash if it is contiguous
+
+	if((hbsnapmap = fsmapfile(SNAPSHOT_FILE, &size)) != NULL && size >= sizeof(header)) {
+		memcpy(&header, hbsnapmap, sizeof(header));
+	} else if(!fsopen(&hbsnapfile, SNAPSHOT_FILE) && fsread(&hbsnapfile, (uint8_t *)&header, sizeof(header)) == sizeof(header)) {
+		hbsnapmap = NULL;
+		size = hbsnapfile.Size;
+	} else {
+		return -1;
+	}
+
+	// Anything written to the volume since makes the snapshot useless
+
+	if(header.Magic != SNAPSHOT_MAGIC || header.Generation != fsgetgeneration(fsgetvolume())) return -1;
+	if(header.Count != maxselection || size != sizeof(header) + header.Count * sizeof(HomebrewEntry)) return -1;
+	if(header.Listing != hash_listing()) return -1;
+
+	hbsnapshot = header;
+	return 0;
+}
+
+/**
+  * @brief  Load homebrew info from the snapshot to the homebrew cache.
+  * @param  id: Homebrew ID.
+  * @return 0 on success, -1 if the snapshot cannot be used.
+  */
+int read_snapshot(int id) {
+	HomebrewEntry *entry = &cache[id % 3];
+	uint32_t offset = sizeof(SnapshotHeader) + id * sizeof(HomebrewEntry);
+	const char *name;
+	FsDir hbdir;
+	int index;
+
+	if(hbsnapshot.Magic != SNAPSHOT_MAGIC || hbsnapshot.Generation != fsgetgeneration(fsgetvolume()) || id >= hbsnapshot.Count) return -1;
+
+	if(hbsnapmap != NULL)
+		memcpy(entry, hbsnapmap + offset, sizeof(HomebrewEntry));
+	else if(fsseek(&hbsnapfile, offset) || fsread(&hbsnapfile, (uint8_t *)entry, sizeof(HomebrewEntry)) != sizeof(HomebrewEntry))
+		return -1;
+
+	// The manifest or icon might have been edited on a PC, which the generation does not see.
+	// Only the entries on the screen are checked, so the startup does not open every directory.
+
+	if((index = get_hb_entry(id, &name)) < 0 || fsopendirentry(&hbdir, fsgetcwd(), index) || hash_hb_files(&hbdir) != entry->files) {
+		hbsnapstale = 1;
+		entry->id = -1;
+		return -1;
+	}
+
+	entry->id = id;
+	return 0;
+}
+
+/**
+  * @brief  Load homebrew info to the homebrew cache.
+  * @param  id: Homebrew ID.
+  * @return Nothing.
+  */
+void load_hb_info(int id) {
+	long size;
+	char manifest[256];
+	const char *name;
+	const uint8_t *mapped;
+	uint32_t mapsize;
+	FsFile file;
+	FsDir hbdir;
+
+	int i = id % 3, entry;
+
+	// Check if this homebrew ID has already been loaded, or is in the snapshot
+
+	if(cache[i].id != id && read_snapshot(id)) {
+		// If it hasn't, then open its directory and load the manifest & icon.
+		// Contiguous files are used straight from the flash, others are read first.
+
+		if((entry = get_hb_entry(id, &name)) >= 0 && !fsopendirentry(&hbdir, fsgetcwd(), entry)) {
+			cache[i].files = hash_hb_files(&hbdir);
+
+			if((mapped = fsmapfileat(&hbdir, "MANIFEST.TXT", &mapsize)) != NULL && mapsize > 0) {
+				parse_manifest((const char *)mapped, mapsize, i, name);
+			} else if(!fsopenat(&hbdir, &file, "MANIFEST.TXT") && (size = fsread(&file, (uint8_t *)manifest, sizeof(manifest))) > 0) {
+				parse_manifest(manifest, size, i, name);
 			} else {
 				hb_error(i, "Corrputed homebrew");
 			}
 
-			if(fsloadfile("ICON.BMP", data_buffer, sizeof(data_buffer)) > 0) {
-				decode_bmp(data_buffer, i);
-			} else {
+			fsclose(&file);
+
+			if((mapped = fsmapfileat(&hbdir, "ICON.BMP", &mapsize)) != NULL && mapsize >= 54 && mapped[0x0A] + sizeof(cache[i].bitmap) <= mapsize) {
+				copy_bmp((uint16_t *)(mapped + mapped[0x0A]), i);
+			} else if(fsopenat(&hbdir, &file, "ICON.BMP") || decode_bmp(&file, i)) {
 				copy_bmp((uint16_t *) default_bmp, i);
 			}
 
-			fschdir("..");
+			fsclose(&file);
 		} else {
 			hb_error(i, "Fatal error loading homebrew.");
+			cache[i].files = 0;
 		}
 
 		cache[i].id = id;
 	}
 }
 
+/**
+  * @brief  Write a new snapshot of the homebrew info.
+  * @return 0 on success, -1 if there is no room, the volume is read-only or has no write log.
+  */
+int save_snapshot() {
+	SnapshotHeader *header = (SnapshotHeader *)data_buffer;
+	HomebrewEntry *entries = (HomebrewEntry *)(data_buffer + sizeof(SnapshotHeader));
+	uint32_t size = sizeof(SnapshotHeader) + maxselection * sizeof(HomebrewEntry);
+	int i;
+
+	if(fsgetvolume()->Device->WriteSector == NULL || fsgetvolume()->LogOffset == 0 || size > sizeof(data_buffer)) return -1;
+
+	// Load everything the slow way once
+
+	for(i = 0; i < maxselection; i++) {
+		cache[i % 3].id = -1;
+		load_hb_info(i);
+
+		memcpy(&entries[i], &cache[i % 3], sizeof(HomebrewEntry));
+	}
+
+	// Writing the snapshot is the last change it covers
+
+	header->Magic = SNAPSHOT_MAGIC;
+	header->Generation = fsgetgeneration(fsgetvolume()) + 1;
+	header->Listing = hash_listing();
+	header->Count = maxselection;
+
+	return fswritefile(SNAPSHOT_FILE, data_buffer, size);
+}
+
+/**
+  * @brief  Write a new snapshot and start using it.
+  * @return Nothing.
+  */
+void refresh_snapshot() {
+	FsDirIter it;
+
+	// Without one, everything is loaded the slow way as it comes on the screen
+
+	if(save_snapshot()) {
+		hbsnapshot.Magic = 0;
+		return;
+	}
+
+	// Writing it changes the volume, so the names are read again
+
+	open_hb_dir(&it);
+	fsdir_nametableiter(&hbtable, &it, (char *)hbnames, sizeof(hbnames));
+	open_hb_dir(&hbiter);
+
+	load_snapshot();
+}
+
+/**
+  * @brief  Defragment the volume, which moves files and with them MENU.DAT.
+  * @return Nothing.
+  */
+void defrag_volume() {
+	FsDefragStats stats;
+	int i;
+
+	if(fsgetvolume()->Device->WriteSector == NULL || fsgetvolume()->LogOffset == 0) return;
+
+	for(i = 224 * 320; i < 240 * 320; i++) framebuffer[i] = LCD_COLOR_GRAYSCALE(4);
+	lcd_print("Defragmenting...", 4, 228, 0xFFFF, LCD_COLOR_GRAYSCALE(4));
+	lcd_update();
+
+	// A failed defrag may still have moved some files
+
+	if(fsdefrag(data_buffer, sizeof(data_buffer), &stats) || stats.Moved > 0) hbsnapstale = 1;
+}
+
 /**
   * @brief  Main menu loop.
   * @param  title: String to draw in the header.
   * @return -1 if B button pressed, otherwise the ID of the homebrew to load.
   */
 int mainmenu(char *title) {
+	FsDirIter it;
 	int i;
 
-	DirEntry *dir = fsreaddir(1, &maxselection);
-	char buffer[16];
+	// Decode the homebrew dir names once, only count them if they do not all fit
+
+	open_hb_dir(&hbiter);
+	open_hb_dir(&it);
+
+	fsdir_nametableiter(&hbtable, &it, (char *)hbnames, sizeof(hbnames));
+
+	if(hbtable.Complete)
+		maxselection = hbtable.Count;
+	else
+		for(maxselection = 0; fsdir_next(&hbiter) != NULL; maxselection++);
+
+	// Use the snapshot of the homebrew info if nothing has changed, otherwise make a new one
+
+	if(load_snapshot()) refresh_snapshot();
 
 	selection = 0;
 	scroll = 0;
@@ -195,13 +512,28 @@ int mainmenu(char *title) {
 	for(i = 0; i < 3; i++) {
 		cache[i].id = -1;
 
-		fatname_to_filename((char *)(&dir[i]), buffer);
-		load_hb_info(i, buffer);
+		if(i < maxselection) load_hb_info(i);
 	}
 
 	while(1) {
 		uint32_t buttons = buttons_get();
 
+		if(buttons & B_PAUSE) {
+			defrag_volume();
+		}
+
+		// A homebrew on the screen was edited since the snapshot, make a new one and redo the screen
+
+		if(hbsnapstale) {
+			refresh_snapshot();
+			hbsnapstale = 0;
+
+			for(i = scroll; i < scroll + 3 && i < maxselection; i++) {
+				cache[i % 3].id = -1;
+				load_hb_info(i);
+			}
+		}
+
 		if(buttons & B_Up) {
 			selection--;
 			if(selection == -1) {
@@ -209,15 +541,13 @@ int mainmenu(char *title) {
 				scroll = maxselection - 3;
 				if(scroll < 0) scroll = 0;
 				for(i = 0; i < 3; i++) {
-					fatname_to_filename((char *)(&dir[scroll + i]), buffer);
-					load_hb_info(scroll + i, buffer);
+					load_hb_info(scroll + i);
 				}
 			}
 			
 			if(selection - scroll == -1) {
 				scroll--;
-				fatname_to_filename((char *)(&dir[selection]), buffer);
-				load_hb_info(selection, buffer);
+				load_hb_info(selection);
 			}
 				
 		}
@@ -228,14 +558,12 @@ int mainmenu(char *title) {
 				selection = 0;
 				scroll = 0;
 				for(i = 0; i < 3; i++) {
-					fatname_to_filename((char *)(&dir[i]), buffer);
-					load_hb_info(i, buffer);
+					load_hb_info(i);
 				}
 			}
 				
 			if(selection - scroll == 3) {
-				fatname_to_filename((char *)(&dir[selection]), buffer);
-				load_hb_info(selection, buffer);
+				load_hb_info(selection);
 				scroll++;
 			}
 		}
@@ -251,12 +579,10 @@ int mainmenu(char *title) {
 		}
 
 		if(buttons & B_A) {
-			free(dir);
 			return selection;
 		}
 		
 		if(buttons & B_B) {
-			free(dir);
 			return -1;
 		}
 		
@@ -1,11 +1,24 @@
 typedef struct {
 	int id;
+	uint32_t files;
 	char name[32];
 	char author[32];
 	char version[32];
 	uint16_t bitmap[64 * 48];
 } HomebrewEntry;
 
+#define HOMEBREW_MAIN "MAIN.BIN|MAIN.LZ4"
+
+#define SNAPSHOT_FILE "MENU.DAT"
+#define SNAPSHOT_MAGIC 0x4E534247
+
+typedef struct {
+	uint32_t Magic;
+	uint32_t Generation;
+	uint32_t Listing;
+	uint32_t Count;
+} SnapshotHeader;
+
 extern HomebrewEntry cache[3];
 
 int mainmenu(char *title);
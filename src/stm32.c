@@ -1,8 +1,10 @@
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 #include <assert.h>
 
 #include "stm32.h"
+#include "flash.h"
 #include "lcd.h"
 #include "stm32h7xx_hal.h"
 
@@ -22,6 +24,13 @@ RTC_HandleTypeDef hrtc;
 DAC_HandleTypeDef hdac1;
 DAC_HandleTypeDef hdac2;
 
+MDMA_HandleTypeDef hmdma_copy;
+MDMA_HandleTypeDef hmdma_ospi;
+
+uint8_t *mdma_tail_dest;
+const uint8_t *mdma_tail_src;
+uint32_t mdma_tail_size;
+
 uint32_t reg;
 SystemConfig *syscfg = (SystemConfig *) &reg;
 
@@ -225,6 +234,10 @@ void MX_NVIC_Init() {
 	// OCTOSPI1_IRQn interrupt configuration
 	HAL_NVIC_SetPriority(OCTOSPI1_IRQn, 0, 0);
 	HAL_NVIC_EnableIRQ(OCTOSPI1_IRQn);
+
+	// MDMA_IRQn interrupt configuration
+	HAL_NVIC_SetPriority(MDMA_IRQn, 0, 0);
+	HAL_NVIC_EnableIRQ(MDMA_IRQn);
 }
 
 /**
@@ -308,7 +321,7 @@ void MX_OCTOSPI1_Init() {
 	hospi1.Init.FifoThreshold = 4;
 	hospi1.Init.DualQuad = HAL_OSPI_DUALQUAD_DISABLE;
 	hospi1.Init.MemoryType = HAL_OSPI_MEMTYPE_MACRONIX;
-	hospi1.Init.DeviceSize = 20;
+	hospi1.Init.DeviceSize = 20; // Set from the chip by OSPI_InitAuto()
 	hospi1.Init.ChipSelectHighTime = 2;
 	hospi1.Init.FreeRunningClock = HAL_OSPI_FREERUNCLK_DISABLE;
 	hospi1.Init.ClockMode = HAL_OSPI_CLOCK_MODE_0;
@@ -504,6 +517,229 @@ void MX_DMA_Init() {
 	HAL_NVIC_EnableIRQ(DMA1_Stream0_IRQn);
 }
 
+/**
+  * @brief MDMA Initialization Function (memory to memory copies).
+  * @return Nothing.
+  */
+void MX_MDMA_Init() {
+	__HAL_RCC_MDMA_CLK_ENABLE();
+
+	hmdma_copy.Instance = MDMA_Channel0;
+	hmdma_copy.Init.Request = MDMA_REQUEST_SW;
+	hmdma_copy.Init.TransferTriggerMode = MDMA_REPEAT_BLOCK_TRANSFER;
+	hmdma_copy.Init.Priority = MDMA_PRIORITY_HIGH;
+	hmdma_copy.Init.Endianness = MDMA_LITTLE_ENDIANNESS_PRESERVE;
+	hmdma_copy.Init.SourceInc = MDMA_SRC_INC_WORD;
+	hmdma_copy.Init.DestinationInc = MDMA_DEST_INC_WORD;
+	hmdma_copy.Init.SourceDataSize = MDMA_SRC_DATASIZE_WORD;
+	hmdma_copy.Init.DestDataSize = MDMA_DEST_DATASIZE_WORD;
+	hmdma_copy.Init.DataAlignment = MDMA_DATAALIGN_PACKENABLE;
+	hmdma_copy.Init.BufferTransferLength = 128;
+	hmdma_copy.Init.SourceBurst = MDMA_SOURCE_BURST_32BEATS;
+	hmdma_copy.Init.DestBurst = MDMA_DEST_BURST_32BEATS;
+	hmdma_copy.Init.SourceBlockAddressOffset = 0;
+	hmdma_copy.Init.DestBlockAddressOffset = 0;
+
+	if (HAL_MDMA_Init(&hmdma_copy) != HAL_OK) {
+		Error_Handler();
+	}
+
+	// Channel 1 moves the queued flash reads and programs through the OSPI FIFO,
+	// a byte at a time so the buffers can have any alignment
+
+	hmdma_ospi.Instance = MDMA_Channel1;
+	hmdma_ospi.Init.Request = MDMA_REQUEST_OCTOSPI1_FIFO_TH;
+	hmdma_ospi.Init.TransferTriggerMode = MDMA_BUFFER_TRANSFER;
+	hmdma_ospi.Init.Priority = MDMA_PRIORITY_VERY_HIGH;
+	hmdma_ospi.Init.Endianness = MDMA_LITTLE_ENDIANNESS_PRESERVE;
+	hmdma_ospi.Init.SourceInc = MDMA_SRC_INC_BYTE;
+	hmdma_ospi.Init.DestinationInc = MDMA_DEST_INC_BYTE;
+	hmdma_ospi.Init.SourceDataSize = MDMA_SRC_DATASIZE_BYTE;
+	hmdma_ospi.Init.DestDataSize = MDMA_DEST_DATASIZE_BYTE;
+	hmdma_ospi.Init.DataAlignment = MDMA_DATAALIGN_PACKENABLE;
+	hmdma_ospi.Init.BufferTransferLength = 4; // Same as the OSPI FIFO threshold
+	hmdma_ospi.Init.SourceBurst = MDMA_SOURCE_BURST_SINGLE;
+	hmdma_ospi.Init.DestBurst = MDMA_DEST_BURST_SINGLE;
+	hmdma_ospi.Init.SourceBlockAddressOffset = 0;
+	hmdma_ospi.Init.DestBlockAddressOffset = 0;
+
+	if (HAL_MDMA_Init(&hmdma_ospi) != HAL_OK) {
+		Error_Handler();
+	}
+
+	__HAL_LINKDMA(&hospi1, hmdma, hmdma_ospi);
+}
+
+/**
+  * @brief CRC Initialization Function (CRC-32 as used by zlib).
+  * @return Nothing.
+  */
+void MX_CRC_Init() {
+	__HAL_RCC_CRC_CLK_ENABLE();
+
+	CRC->POL = 0x04C11DB7;
+	CRC->CR = CRC_CR_REV_OUT | CRC_CR_REV_IN;
+}
+
+/**
+  * @brief Start copying memory using the MDMA. Waits for the previous copy first.
+  * @param dest = Destination address.
+  * @param src = Source address.
+  * @param size = Number of bytes to copy.
+  * @return Nothing.
+  */
+void mdma_copy_start(uint8_t *dest, const uint8_t *src, uint32_t size) {
+	uint32_t blocks = size / 65536;
+
+	mdma_copy_wait();
+
+	// The MDMA is set up for words, leave unaligned copies to the CPU
+
+	if(((uint32_t)dest | (uint32_t)src | size) & 3) {
+		memcpy(dest, src, size);
+		return;
+	}
+
+	// Whole 64 kB blocks go in one repeated block transfer, the rest is queued
+
+	if(blocks > 4096) blocks = 4096;
+
+	if(blocks == 0) {
+		mdma_tail_size = 0;
+
+		if (HAL_MDMA_Start(&hmdma_copy, (uint32_t)src, (uint32_t)dest, size, 1) != HAL_OK) {
+			Error_Handler();
+		}
+	} else {
+		mdma_tail_dest = dest + blocks * 65536;
+		mdma_tail_src = src + blocks * 65536;
+		mdma_tail_size = size - blocks * 65536;
+
+		if (HAL_MDMA_Start(&hmdma_copy, (uint32_t)src, (uint32_t)dest, 65536, blocks) != HAL_OK) {
+			Error_Handler();
+		}
+	}
+}
+
+/**
+  * @brief Wait until all MDMA copies finish.
+  * @return Nothing.
+  */
+void mdma_copy_wait() {
+	uint8_t *dest;
+	const uint8_t *src;
+	uint32_t size;
+
+	if(hmdma_copy.State != HAL_MDMA_STATE_BUSY) return;
+
+	if (HAL_MDMA_PollForTransfer(&hmdma_copy, HAL_MDMA_FULL_TRANSFER, HAL_MAX_DELAY) != HAL_OK) {
+		Error_Handler();
+	}
+
+	// Start the queued remainder, if there is one
+
+	if(mdma_tail_size > 0) {
+		dest = mdma_tail_dest;
+		src = mdma_tail_src;
+		size = mdma_tail_size;
+
+		mdma_tail_size = 0;
+
+		mdma_copy_start(dest, src, size);
+		mdma_copy_wait();
+	}
+}
+
+/**
+  * @brief Continue a CRC-32 using the CRC unit.
+  *        The CPU feeds it rather than a second DMA channel. fslib calls this on a
+  *        piece that has been copied while the MDMA copies the next one from the
+  *        much slower OSPI, so the CPU would only be waiting anyway.
+  * @param crc = CRC of the data so far, 0 at the start.
+  * @param data = Data to add.
+  * @param size = Number of bytes to add.
+  * @return The updated CRC.
+  */
+uint32_t crc_update(uint32_t crc, const uint8_t *data, uint32_t size) {
+	// The unit keeps the CRC bit-reversed and not inverted, pick up from there
+
+	CRC->INIT = __RBIT(~crc);
+	CRC->CR = CRC_CR_REV_OUT | CRC_CR_REV_IN_0 | CRC_CR_RESET;
+
+	// Bytes until the data is aligned, then whole words, then the rest
+
+	for(; size > 0 && ((uint32_t)data & 3); size--)
+		*(__IO uint8_t *)&CRC->DR = *data++;
+
+	CRC->CR = CRC_CR_REV_OUT | CRC_CR_REV_IN;
+
+	for(; size >= 4; size -= 4, data += 4)
+		CRC->DR = *(const uint32_t *)data;
+
+	CRC->CR = CRC_CR_REV_OUT | CRC_CR_REV_IN_0;
+
+	for(; size > 0; size--)
+		*(__IO uint8_t *)&CRC->DR = *data++;
+
+	return ~CRC->DR;
+}
+
+/**
+  * @brief Erase a 4 kB sector of the memory-mapped external flash.
+  * @param dev = Filesystem device of the flash.
+  * @param address = Sector address, relative to the start of the flash.
+  * @return 0 on success.
+  */
+int flash_erase_sector(FsBlockDevice *dev, uint32_t address) {
+	OSPI_WaitIdle();
+	mdma_copy_wait();
+
+	// Memory-mapped mode has to be left for any other flash command
+
+	if (HAL_OSPI_Abort(&hospi1) != HAL_OK) {
+		return -1;
+	}
+
+	OSPI_NOR_WriteEnable(&hospi1);
+	OSPI_SectorErase(&hospi1, address);
+	OSPI_EnableMemoryMappedMode(&hospi1);
+
+	return 0;
+}
+
+/**
+  * @brief Keep the result of a queued flash request.
+  * @param context = Where to store the result.
+  * @param status = 0 on success, -1 on error.
+  * @return Nothing.
+  */
+void flash_request_done(void *context, int status) {
+	*(volatile int *)context = status;
+}
+
+/**
+  * @brief Program 512 byte sectors of the memory-mapped external flash.
+  *        Sleeps while the pages are being sent and programmed.
+  * @param dev = Filesystem device of the flash.
+  * @param sector = First sector, relative to the start of the flash.
+  * @param data = Data to program (must not point to the flash itself).
+  * @param count = Number of sectors to program.
+  * @return 0 on success.
+  */
+int flash_write_sector(FsBlockDevice *dev, uint32_t sector, const uint8_t *data, uint32_t count) {
+	volatile int status = -1;
+
+	OSPI_WaitIdle();
+
+	if (OSPI_ProgramAsync(&hospi1, sector * 512, data, count * 512, flash_request_done, (void *)&status) != 0) {
+		return -1;
+	}
+
+	OSPI_WaitIdle();
+
+	return status;
+}
+
 /**
   * @brief GPIO Initialization Function.
   * @return Nothing.
@@ -1,4 +1,5 @@
 #include "stm32h7xx_hal.h"
+#include "fslib.h"
 
 typedef struct {
 	uint16_t Magic;
@@ -21,10 +22,14 @@ extern SPI_HandleTypeDef hspi2;
 extern DAC_HandleTypeDef hdac1;
 extern DAC_HandleTypeDef hdac2;
 extern RTC_HandleTypeDef hrtc;
+extern MDMA_HandleTypeDef hmdma_copy;
+extern MDMA_HandleTypeDef hmdma_ospi;
 
 void SystemClock_Config();
 void MX_GPIO_Init();
 void MX_DMA_Init();
+void MX_MDMA_Init();
+void MX_CRC_Init();
 void MX_LTDC_Init();
 void MX_SPI2_Init();
 void MX_OCTOSPI1_Init();
@@ -36,6 +41,14 @@ void MX_RTC_Init();
 void GW_Sleep();
 void Error_Handler();
 
+void mdma_copy_start(uint8_t *dest, const uint8_t *src, uint32_t size);
+void mdma_copy_wait();
+
+uint32_t crc_update(uint32_t crc, const uint8_t *data, uint32_t size);
+
+int flash_erase_sector(FsBlockDevice *dev, uint32_t address);
+int flash_write_sector(FsBlockDevice *dev, uint32_t sector, const uint8_t *data, uint32_t count);
+
 void config_init();
 void config_update();
 
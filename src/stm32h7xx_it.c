@@ -58,6 +58,7 @@
 
 /* External variables --------------------------------------------------------*/
 extern OSPI_HandleTypeDef hospi1;
+extern MDMA_HandleTypeDef hmdma_ospi;
 /* USER CODE BEGIN EV */
 
 /* USER CODE END EV */
@@ -133,6 +134,14 @@ void OCTOSPI1_IRQHandler(void)
   /* USER CODE END OCTOSPI1_IRQn 1 */
 }
 
+/**
+  * @brief This function handles MDMA global interrupt.
+  */
+void MDMA_IRQHandler(void)
+{
+  HAL_MDMA_IRQHandler(&hmdma_ospi);
+}
+
 /* USER CODE BEGIN 1 */
 
 /* USER CODE END 1 */
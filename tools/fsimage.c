@@ -0,0 +1,578 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "fsimage.h"
+
+// The tree is a list of nodes, with node 0 as the root. buildImage() lays
+// it out into a FAT16 or FAT32 image with the given cluster size and number
+// of FATs, taking the given percentage of clusters out of order.
+
+Node *nodes;
+int nodecount, nodemax;
+
+uint8_t *disk;
+static uint32_t *fat;
+static uint8_t *used;
+long disksize;
+static int clusters, datasector, cursor, fragment;
+uint32_t textsize = 65536;
+int fragmented, fragpercent, clustersectors = 1, fatcopies = 1, fat32, reserved = RESERVED;
+
+double seconds() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The content of each file follows from its node number, so it can be checked without keeping it
+
+void fillFile(uint8_t *data, int node, uint32_t size) {
+	uint32_t x = node * 2654435761U + 1, i;
+
+	for(i = 0; i < size; i++) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		data[i] = x;
+	}
+}
+
+// Text out of a few words, so that it packs about as well as code does
+
+void fillText(uint8_t *data, int node, uint32_t size) {
+	static const char *words[16] = {
+		"mov ", "ldr ", "str ", "add ", "sub ", "cmp ", "bne ", "bl ",
+		"r0, ", "r1, ", "r2, ", "r3, ", "sp, ", "#4\n", "#0\n", "[r0]\n"
+	};
+	uint32_t x = node * 2654435761U + 1, i, len;
+
+	for(i = 0; i < size; i += len) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+
+		len = strlen(words[x & 15]);
+		if(len > size - i) len = size - i;
+
+		memcpy(data + i, words[x & 15], len);
+	}
+}
+
+uint8_t *putLength(uint8_t *out, uint32_t length) {
+	for(; length >= 255; length -= 255) *out++ = 255;
+	*out++ = length;
+
+	return out;
+}
+
+uint8_t *putSequence(uint8_t *out, const uint8_t *literals, uint32_t litlen, uint32_t offset, uint32_t matchlen) {
+	*out++ = ((litlen < 15 ? litlen : 15) << 4) | (matchlen == 0 ? 0 : (matchlen - 4 < 15 ? matchlen - 4 : 15));
+
+	if(litlen >= 15) out = putLength(out, litlen - 15);
+
+	memcpy(out, literals, litlen);
+	out += litlen;
+
+	// The last sequence of a block has literals only
+
+	if(matchlen == 0) return out;
+
+	*out++ = offset & 0xFF;
+	*out++ = offset >> 8;
+
+	if(matchlen - 4 >= 15) out = putLength(out, matchlen - 4 - 15);
+
+	return out;
+}
+
+// A plain greedy LZ4 compressor, with 4 MB independent blocks and no checksums
+
+uint32_t packFrame(const uint8_t *src, uint32_t size, uint8_t *dst) {
+	static int32_t head[4096];
+	uint8_t *out = dst + 7, *block;
+	uint32_t pos, len, i, anchor, match, h, x;
+	int32_t cand;
+
+	memcpy(dst, "\x04\x22\x4D\x18\x60\x70\x73", 7);
+
+	for(pos = 0; pos < size; pos += len, src += len) {
+		len = (size - pos < 0x400000) ? size - pos : 0x400000;
+		block = out;
+		out += 4;
+
+		memset(head, 0xFF, sizeof(head));
+
+		// Matches have to start 12 bytes and end 5 bytes before the end of the block
+
+		for(i = anchor = 0; i + 12 < len; ) {
+			memcpy(&x, src + i, 4);
+			h = (x * 2654435761U) >> 20;
+			cand = head[h];
+			head[h] = i;
+
+			if(cand < 0 || i - cand > 0xFFFF || memcmp(src + cand, src + i, 4)) {
+				i++;
+				continue;
+			}
+
+			for(match = 4; i + match + 5 < len && src[cand + match] == src[i + match]; match++);
+
+			out = putSequence(out, src + anchor, i - anchor, i - cand, match);
+			i = anchor = i + match;
+		}
+
+		out = putSequence(out, src + anchor, len - anchor, 0, 0);
+
+		x = out - block - 4;
+		memcpy(block, &x, 4);
+	}
+
+	memset(out, 0, 4);
+
+	return out + 4 - dst;
+}
+
+// Every file is listed by the name it is loaded with, the long one if it has one
+
+uint32_t fileSums(int node, char *text) {
+	uint8_t *data;
+	uint32_t len = 0;
+	char name[13];
+	int i;
+
+	for(i = nodes[node].Parent + 1; i < node; i++) {
+		if(nodes[i].Parent != nodes[node].Parent || nodes[i].Dir) continue;
+
+		data = malloc(nodes[i].Size + 1);
+		fatname_to_filename(nodes[i].Name, name);
+		len += sprintf(text + len, "%s %08X\r\n", nodes[i].Long ? nodes[i].Long : name, (unsigned)fscrc32(0, data, fileContent(i, data)));
+		free(data);
+	}
+
+	return len;
+}
+
+// The size of a MAIN.LZ4 or CRC32.SFV node has to be set from what this returns
+
+uint32_t fileContent(int node, uint8_t *data) {
+	uint8_t *text;
+	uint32_t size;
+
+	switch(nodes[node].Kind) {
+		case NODE_PACKED:
+			text = malloc(textsize);
+			fillText(text, node, textsize);
+			size = packFrame(text, textsize, data);
+			free(text);
+
+			return size;
+
+		case NODE_SUMS:
+			return fileSums(node, (char *)data);
+
+		default:
+			fillFile(data, node, nodes[node].Size);
+
+			return nodes[node].Size;
+	}
+}
+
+int addNode(int parent, char *name, int dir, uint32_t size) {
+	if(nodecount == nodemax) {
+		nodemax = nodemax ? nodemax * 2 : 256;
+		nodes = realloc(nodes, nodemax * sizeof(Node));
+	}
+
+	Node *node = &nodes[nodecount];
+
+	filename_to_fatname(name, node->Name);
+	node->Long = NULL;
+	node->Dir = dir;
+	node->Kind = NODE_DATA;
+	node->Size = size;
+	node->Parent = parent;
+	node->Cluster = 0;
+
+	return nodecount++;
+}
+
+int findNode(int parent, char *name) {
+	char fatname[11];
+	int i;
+
+	filename_to_fatname(name, fatname);
+
+	for(i = 1; i < nodecount; i++)
+		if(nodes[i].Parent == parent && !memcmp(nodes[i].Name, fatname, 11)) return i;
+
+	return -1;
+}
+
+// Starts a new tree with only the root in it
+
+void clearTree() {
+	nodecount = 0;
+	addNode(-1, "", 1, 0);
+}
+
+int longEntries(int node) {
+	return nodes[node].Long ? (strlen(nodes[node].Long) + 12) / 13 : 0;
+}
+
+// Dir entries taken by the children, their long names and "." and ".."
+
+int entryCount(int dir) {
+	int i, count = (dir == 0) ? 0 : 2;
+
+	for(i = 1; i < nodecount; i++)
+		if(nodes[i].Parent == dir) count += 1 + longEntries(i);
+
+	return count;
+}
+
+int allocCluster() {
+	int c;
+
+	// Fragmentation takes a random free cluster instead of the next one
+
+	if(fragpercent > 0 && rand() % 100 < fragpercent) {
+		do c = 2 + rand() % clusters; while(used[c]);
+	} else {
+		while(used[cursor]) cursor++;
+		c = cursor;
+	}
+
+	used[c] = 1;
+	fat[c] = fat32 ? 0x0FFFFFFF : 0xFFFF;
+
+	return c;
+}
+
+int allocChain(uint32_t size) {
+	int first = 0, last = 0, c;
+	uint32_t n = (size + clustersectors * SECTOR_SIZE - 1) / (clustersectors * SECTOR_SIZE);
+
+	while(n--) {
+		c = allocCluster();
+
+		if(last) {
+			if(c != last + 1) fragment = 1;
+			fat[last] = c;
+		} else {
+			first = c;
+		}
+
+		last = c;
+	}
+
+	return first;
+}
+
+void writeChain(int c, const uint8_t *data, uint32_t size) {
+	uint32_t len, cs = clustersectors * SECTOR_SIZE;
+
+	for(; size > 0; c = fat[c], data += len, size -= len) {
+		len = (size < cs) ? size : cs;
+		memcpy(disk + (datasector + (long)(c - 2) * clustersectors) * SECTOR_SIZE, data, len);
+	}
+}
+
+void setEntry(DirEntry *entry, const char *name, int attribute, int cluster, uint32_t size) {
+	memset(entry, 0, sizeof(DirEntry));
+	memcpy(entry->Basename, name, 11);
+	entry->Attribute = attribute;
+	entry->StartCluster = cluster & 0xFFFF;
+	entry->StartClusterHigh = cluster >> 16;
+	entry->Size = size;
+}
+
+// The long name goes in front of the alias, its last part first
+
+void setLongEntries(DirEntry *entry, int node) {
+	static const int offsets[13] = { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
+	const char *name = nodes[node].Long;
+	int i, j, k, part, count = longEntries(node), len = strlen(name);
+	uint8_t *raw, sum = 0;
+	uint16_t c;
+
+	for(i = 0; i < 11; i++)
+		sum = ((sum & 1) << 7) + (sum >> 1) + (uint8_t)nodes[node].Name[i];
+
+	for(i = 0; i < count; i++) {
+		raw = (uint8_t *)&entry[i];
+		part = count - i;
+
+		memset(raw, 0, sizeof(DirEntry));
+		raw[0] = part | ((i == 0) ? 0x40 : 0);
+		raw[11] = 0x0F;
+		raw[13] = sum;
+
+		// Padded with a zero and then 0xFFFF
+
+		for(j = 0; j < 13; j++) {
+			k = (part - 1) * 13 + j;
+			c = (k < len) ? (uint8_t)name[k] : (k == len) ? 0 : 0xFFFF;
+
+			raw[offsets[j]] = c & 0xFF;
+			raw[offsets[j] + 1] = c >> 8;
+		}
+	}
+}
+
+// Dir tables fill their clusters up with zeros, since the data area starts out erased
+
+void layoutDir(int dir) {
+	int i, count = 0, cs = clustersectors * SECTOR_SIZE, size = (entryCount(dir) * sizeof(DirEntry) + cs - 1) / cs * cs;
+	DirEntry *table = calloc(size, 1);
+	uint8_t *data;
+
+	// ".." of a dir in the root is 0, even where the root has a cluster
+
+	if(dir != 0) {
+		setEntry(&table[count++], ".          ", 0x10, nodes[dir].Cluster, 0);
+		setEntry(&table[count++], "..         ", 0x10, (nodes[dir].Parent == 0) ? 0 : nodes[nodes[dir].Parent].Cluster, 0);
+	}
+
+	for(i = 1; i < nodecount; i++) {
+		if(nodes[i].Parent != dir) continue;
+
+		fragment = 0;
+
+		if(nodes[i].Dir) {
+			nodes[i].Cluster = allocChain(entryCount(i) * sizeof(DirEntry));
+			layoutDir(i);
+		} else {
+			nodes[i].Cluster = allocChain(nodes[i].Size);
+
+			data = malloc(nodes[i].Size + 1);
+			fileContent(i, data);
+			writeChain(nodes[i].Cluster, data, nodes[i].Size);
+			free(data);
+		}
+
+		fragmented += fragment;
+
+		if(nodes[i].Long) {
+			setLongEntries(&table[count], i);
+			count += longEntries(i);
+		}
+
+		setEntry(&table[count++], nodes[i].Name, nodes[i].Dir ? 0x10 : 0x20, nodes[i].Cluster, nodes[i].Size);
+	}
+
+	if(dir == 0 && !fat32)
+		memcpy(disk + (datasector - ROOT_ENTRIES * sizeof(DirEntry) / SECTOR_SIZE) * SECTOR_SIZE, table, count * sizeof(DirEntry));
+	else
+		writeChain(nodes[dir].Cluster, (uint8_t *) table, size);
+
+	free(table);
+}
+
+void buildImage() {
+	int i, fatsectors, rootsectors = fat32 ? 0 : ROOT_ENTRIES * sizeof(DirEntry) / SECTOR_SIZE, cs = clustersectors * SECTOR_SIZE;
+	uint32_t needed = 0, *info;
+	long sectors;
+
+	if(!fat32 && entryCount(0) > ROOT_ENTRIES) {
+		printf("Error: the root dir only holds %d entries!\n", ROOT_ENTRIES);
+		exit(1);
+	}
+
+	// Leave a quarter free, so that fragmentation has somewhere to go
+
+	for(i = fat32 ? 0 : 1; i < nodecount; i++)
+		needed += ((nodes[i].Dir ? entryCount(i) * sizeof(DirEntry) : nodes[i].Size) + cs - 1) / cs;
+
+	clusters = needed + needed / 4 + 16;
+
+	if(clusters < (fat32 ? MIN_CLUSTERS32 : MIN_CLUSTERS)) clusters = fat32 ? MIN_CLUSTERS32 : MIN_CLUSTERS;
+
+	if(clusters > (fat32 ? MAX_CLUSTERS32 : MAX_CLUSTERS)) {
+		printf("Error: %d clusters do not fit into FAT%d, use bigger clusters!\n", clusters, fat32 ? 32 : 16);
+		exit(1);
+	}
+
+	fatsectors = ((clusters + 2) * (fat32 ? 4 : 2) + SECTOR_SIZE - 1) / SECTOR_SIZE;
+
+	// The boot sector has its erase block to itself, and the four after it hold
+	// fslib's log, so that writes leave the boot sector alone and can be made safe
+
+	datasector = reserved + fatsectors * fatcopies + rootsectors;
+	sectors = datasector + (long)clusters * clustersectors;
+	disksize = sectors * SECTOR_SIZE;
+
+	free(disk);
+	free(fat);
+	free(used);
+
+	// The data area starts out erased, like on a freshly written flash
+
+	disk = calloc(disksize, 1);
+	memset(disk + datasector * SECTOR_SIZE, 0xFF, disksize - datasector * SECTOR_SIZE);
+	fat = calloc(fatsectors * SECTOR_SIZE / 2, sizeof(uint32_t));
+	used = calloc(clusters + 2, 1);
+	cursor = 2;
+	fragmented = 0;
+
+	fat[0] = fat32 ? 0x0FFFFFF8 : 0xFFF8;
+	fat[1] = fat32 ? 0x0FFFFFFF : 0xFFFF;
+
+	BIOSParams *bpb = (BIOSParams *)(disk + 3);
+	BIOSParams32 *bpb32 = (BIOSParams32 *)(disk + 36);
+
+	memcpy(disk, fat32 ? "\xEB\x58\x90" : "\xEB\x3C\x90", 3);
+	memcpy(bpb->OEMLabel, "GWFSTEST", 8);
+	bpb->BytesPerSector = SECTOR_SIZE;
+	bpb->SectorsPerCluster = clustersectors;
+	bpb->ReservedSectors = reserved;
+	bpb->NumberOfFats = fatcopies;
+	bpb->RootDirEntries = fat32 ? 0 : ROOT_ENTRIES;
+	bpb->LogicalSectors = (sectors < 65536 && !fat32) ? sectors : 0;
+	bpb->MediumType = 0xF8;
+	bpb->SectorsPerFat = fat32 ? 0 : fatsectors;
+	bpb->SectorsPerTrack = 32;
+	bpb->Sides = 64;
+	bpb->LargeSectors = (sectors < 65536 && !fat32) ? 0 : sectors;
+
+	// FAT32 puts its own fields where the rest of the FAT16 ones would be,
+	// and keeps an FSInfo sector with the free count unknown
+
+	if(fat32) {
+		nodes[0].Cluster = allocChain(entryCount(0) * sizeof(DirEntry));
+
+		bpb32->SectorsPerFat = fatsectors;
+		bpb32->RootCluster = nodes[0].Cluster;
+		bpb32->InfoSector = 1;
+		bpb32->BackupSector = 0;
+		bpb32->DriveNo = 0x80;
+		bpb32->Signature = 0x29;
+		bpb32->VolumeID = 0x12345678;
+		memcpy(bpb32->VolumeLabel, "GW FSTEST  ", 11);
+		memcpy(bpb32->FileSystem, "FAT32   ", 8);
+
+		info = (uint32_t *)(disk + SECTOR_SIZE);
+		info[0] = 0x41615252;
+		info[121] = 0x61417272;
+		info[122] = 0xFFFFFFFF;
+		info[123] = 0xFFFFFFFF;
+		info[127] = 0xAA550000;
+	} else {
+		nodes[0].Cluster = 0;
+
+		bpb->DriveNo = 0x80;
+		bpb->Signature = 0x29;
+		bpb->VolumeID = 0x12345678;
+		memcpy(bpb->VolumeLabel, "GW FSTEST  ", 11);
+		memcpy(bpb->FileSystem, "FAT16   ", 8);
+	}
+
+	disk[510] = 0x55;
+	disk[511] = 0xAA;
+
+	// With room for the log, the boot code holds the generation counter, which
+	// counts by clearing bits. Otherwise it is filled in like a PC would.
+
+	if(reserved >= RESERVED) {
+		memset(disk + 0x60, 0xFF, 0x1F8 - 0x60);
+
+		// The log only ever gets programmed, so it has to start out erased
+
+		memset(disk + ERASE_SIZE, 0xFF, (reserved * SECTOR_SIZE) - ERASE_SIZE);
+	} else {
+		for(i = 0x60; i < 0x1F8; i++)
+			disk[i] = i * 7;
+	}
+
+	layoutDir(0);
+
+	for(i = 0; i < fatsectors * SECTOR_SIZE / (fat32 ? 4 : 2); i++) {
+		if(fat32)
+			((uint32_t *)(disk + reserved * SECTOR_SIZE))[i] = fat[i];
+		else
+			((uint16_t *)(disk + reserved * SECTOR_SIZE))[i] = fat[i];
+	}
+
+	for(i = 1; i < fatcopies; i++)
+		memcpy(disk + (reserved + i * fatsectors) * SECTOR_SIZE, disk + reserved * SECTOR_SIZE, fatsectors * SECTOR_SIZE);
+}
+
+// A NOR flash holding the image. Programming can only clear bits and
+// erasing sets a whole 4 kB block back to 0xFF, so any write that skips a
+// needed erase reads back wrong. A power cut stops the chosen operation
+// halfway through and fails all of the ones after it, and a worn out flash
+// takes writes without storing them.
+
+int norerases, norprograms, norbooterases, nordropping, norops, norcut = -1;
+
+// 1 for a complete operation, 0 for the one cut short and -1 after that
+
+int norStep() {
+	int op = norops++;
+
+	if(norcut < 0 || op < norcut) return 1;
+
+	return (op == norcut) ? 0 : -1;
+}
+
+int norWrite(FsBlockDevice *dev, uint32_t sector, const uint8_t *data, uint32_t count) {
+	uint8_t *dest = (uint8_t *)dev->Context + sector * (long)SECTOR_SIZE;
+	uint32_t i;
+	int step;
+
+	if((sector + count) * (long)SECTOR_SIZE > disksize) return -1;
+
+	if((step = norStep()) < 0) return -1;
+
+	for(i = 0; i < count * SECTOR_SIZE / (step ? 1 : 2) && !nordropping; i++)
+		dest[i] &= data[i];
+
+	norprograms += count;
+
+	return step ? 0 : -1;
+}
+
+int norErase(FsBlockDevice *dev, uint32_t address) {
+	uint32_t i;
+	int step;
+
+	if(address % ERASE_SIZE || address + ERASE_SIZE > disksize) return -1;
+
+	if((step = norStep()) < 0) return -1;
+
+	// Cut short, only some of the block is erased
+
+	for(i = 0; i < ERASE_SIZE; i += step ? ERASE_SIZE : 512)
+		memset((uint8_t *)dev->Context + address + i, 0xFF, step ? ERASE_SIZE : 256);
+
+	norerases++;
+	if(address == 0) norbooterases++;
+
+	return step ? 0 : -1;
+}
+
+// The flash only takes whole erase blocks, so the image gets padded to them
+
+void norMount(FsBlockDevice *dev) {
+	long size = (disksize + ERASE_SIZE - 1) / ERASE_SIZE * ERASE_SIZE;
+
+	if(size != disksize) {
+		disk = realloc(disk, size);
+		memset(disk + disksize, 0xFF, size - disksize);
+		disksize = size;
+	}
+
+	memset(dev, 0, sizeof(FsBlockDevice));
+	dev->Mapped = disk;
+	dev->WriteSector = norWrite;
+	dev->Erase = norErase;
+	dev->Context = disk;
+
+	if(fsmountdevice(dev)) {
+		printf("Error: the image does not mount as a NOR flash!\n");
+		exit(1);
+	}
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "fslib.h"
+
+// Synthetic FAT16 and FAT32 images for the fslib host tools
+
+#define SECTOR_SIZE 512
+#define RESERVED 40
+#define ROOT_ENTRIES 512
+#define MIN_CLUSTERS 4085
+#define MAX_CLUSTERS 65524
+#define MIN_CLUSTERS32 65525
+#define MAX_CLUSTERS32 0x0FFFFFF5
+#define ERASE_SIZE 4096
+
+// Files hold data, an LZ4 frame of some text, or the CRCs of the files
+// before them in their dir
+
+enum {
+	NODE_DATA,
+	NODE_PACKED,
+	NODE_SUMS
+};
+
+typedef struct {
+	char Name[11];
+	char *Long;
+	int Dir;
+	int Kind;
+	uint32_t Size;
+	int Parent;
+	int Cluster;
+} Node;
+
+extern Node *nodes;
+extern int nodecount;
+
+extern uint8_t *disk;
+extern long disksize;
+// Size of the text that each MAIN.LZ4 unpacks to
+
+extern uint32_t textsize;
+extern int fragpercent, fragmented, clustersectors, fatcopies, fat32, reserved;
+
+double seconds();
+void fillFile(uint8_t *data, int node, uint32_t size);
+void fillText(uint8_t *data, int node, uint32_t size);
+uint32_t packFrame(const uint8_t *src, uint32_t size, uint8_t *dst);
+uint32_t fileContent(int node, uint8_t *data);
+
+int addNode(int parent, char *name, int dir, uint32_t size);
+int findNode(int parent, char *name);
+void clearTree();
+void buildImage();
+
+extern int norerases, norprograms, norbooterases, nordropping, norops, norcut;
+
+void norMount(FsBlockDevice *dev);
@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+// Reference CRC-32 (the one zlib uses), one bit at a time
+
+uint32_t crc32(uint32_t crc, const unsigned char *data, long size) {
+	int i;
+
+	crc = ~crc;
+
+	while(size--) {
+		crc ^= *data++;
+
+		for(i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ ((crc & 1) ? 0xEDB88320 : 0);
+	}
+
+	return ~crc;
+}
+
+unsigned char *loadFile(char *filename, long *size) {
+	FILE *f = fopen(filename, "rb");
+
+	if(f == NULL) {
+		fprintf(stderr, "Error opening file %s!\n", filename);
+		exit(1);
+	}
+
+	fseek(f, 0, SEEK_END);
+	*size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	unsigned char *data = (unsigned char *) malloc(*size + 1);
+	fread(data, 1, *size, f);
+	fclose(f);
+
+	return data;
+}
+
+int main(int argc, char *argv[]) {
+	if(argc < 2) {
+		printf("Usage: %s files... > CRC32.SFV\n", argv[0]);
+		printf("Writes the CRC-32 of each file in the SFV format, which the loader checks MAIN.BIN & co. against.\n");
+		exit(0);
+	}
+
+	int i;
+	long size;
+	char *name;
+
+	// Self test against the standard check value
+
+	if(crc32(0, (const unsigned char *) "123456789", 9) != 0xCBF43926) {
+		fprintf(stderr, "Error: CRC-32 self test failed!\n");
+		exit(1);
+	}
+
+	printf("; Generated by gwcrc\n");
+
+	for(i = 1; i < argc; i++) {
+		unsigned char *data = loadFile(argv[i], &size);
+
+		// Only the file name goes into the list, it sits next to the files
+
+		name = strrchr(argv[i], '/');
+		name = (name == NULL) ? argv[i] : name + 1;
+
+		printf("%s %08X\n", name, crc32(0, data, size));
+
+		free(data);
+	}
+}
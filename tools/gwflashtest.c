@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "flashplan.h"
+
+// The read commands that flash.c sends, checked against a fake chip. Every
+// command is carried out on it the way the OSPI would, which fails the
+// transfer for anything past the end of the chip.
+
+#define SIZE_LOG2 20
+#define CHIP_SIZE (1 << SIZE_LOG2)
+
+uint8_t *chip, *buffer, *expected;
+int errors, commands;
+
+flash_info_t info = {
+	.manufacturer = 0xC2,
+	.memory_type  = 0x25,
+	.capacity     = 0x34,
+	.size_log2    = SIZE_LOG2,
+	.quad_enable  = QE_SR1_BIT6,
+	.quad_read    = 0xEB,
+	.quad_dummy   = 6,
+	.erase_32k    = 0x52,
+};
+
+void fail(const char *what, uint32_t address, int32_t size, uint32_t max) {
+	printf("Error: %s reading %d byte(s) at 0x%06X, at most %u per command!\n", what, (int)size, (unsigned)address, (unsigned)max);
+	errors++;
+}
+
+int run(const ospi_read_plan_t *plan, uint8_t *dest) {
+	commands++;
+
+	if(plan->address >= CHIP_SIZE || plan->length > CHIP_SIZE - plan->address) return -1;
+
+	memcpy(dest, chip + plan->address, plan->length);
+
+	return 0;
+}
+
+// Like OSPI_Read() with max 0, and like the queued reads otherwise
+
+void checkRead(quad_mode_t mode, spi_chip_vendor_t vendor, uint32_t address, int32_t size, uint32_t max) {
+	ospi_read_plan_t plan;
+	uint32_t done = 0, len, valid;
+	int32_t left = size;
+
+	memset(buffer, 0x55, CHIP_SIZE + 4096);
+	commands = 0;
+
+	while((len = ospi_plan_read(&plan, &info, mode, vendor, address + done, left, max)) > 0) {
+		if(plan.address != address + done) fail("Wrong address", address, size, max);
+		if(max != 0 && len > max) fail("Too long a command", address, size, max);
+
+		if(run(&plan, buffer + done)) {
+			fail("Transfer error", address, size, max);
+			return;
+		}
+
+		done += len;
+		left -= len;
+
+		if(commands > CHIP_SIZE) {
+			fail("No end", address, size, max);
+			return;
+		}
+	}
+
+	// Everything up to the end of the chip is read, nothing after it is touched
+
+	valid = (size <= 0 || address >= CHIP_SIZE) ? 0 : ((uint32_t)size < CHIP_SIZE - address) ? (uint32_t)size : CHIP_SIZE - address;
+
+	memset(expected, 0x55, CHIP_SIZE + 4096);
+	if(valid) memcpy(expected, chip + address, valid);
+
+	if(done != valid || memcmp(buffer, expected, CHIP_SIZE + 4096)) fail("Wrong data", address, size, max);
+
+	if(valid && commands != (int)((max == 0) ? 1 : (valid + max - 1) / max)) fail("Wrong number of commands", address, size, max);
+}
+
+void checkCommand(quad_mode_t mode, spi_chip_vendor_t vendor, int instruction, int dummy, int ilines, int alines, int dlines) {
+	ospi_read_plan_t plan;
+
+	ospi_plan_read(&plan, &info, mode, vendor, 0, 0, 0);
+
+	if(plan.instruction != instruction || plan.dummy_cycles != dummy || plan.instruction_lines != ilines || plan.address_lines != alines || plan.data_lines != dlines) {
+		printf("Error: %s %s sends %02Xh with %d dummy cycles on %d-%d-%d lines, expected %02Xh, %d, %d-%d-%d!\n", mode == QUAD_MODE ? "quad" : "1-line", vendor == VENDOR_ISSI ? "ISSI" : "MX",
+			plan.instruction, plan.dummy_cycles, plan.instruction_lines, plan.address_lines, plan.data_lines, instruction, dummy, ilines, alines, dlines);
+		errors++;
+	}
+}
+
+int main() {
+	static const int32_t sizes[] = { -1, 0, 1, 2, 63, 255, 256, 257, 4095, 4096, 65535, 65536, 65537, 200000, CHIP_SIZE };
+	static const uint32_t addresses[] = { 0, 1, 255, 256, 4097, 0x12345, CHIP_SIZE - 65536, CHIP_SIZE - 300, CHIP_SIZE - 1, CHIP_SIZE, CHIP_SIZE + 5 };
+	static const uint32_t maxes[] = { 0, 256, 65536 };
+	uint32_t i, j, k, x = 1;
+
+	chip = malloc(CHIP_SIZE);
+	buffer = malloc(CHIP_SIZE + 4096);
+	expected = malloc(CHIP_SIZE + 4096);
+
+	for(i = 0; i < CHIP_SIZE; i++) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		chip[i] = x;
+	}
+
+	// FAST_READ on one line, the quad read with the instruction on one line
+	// for MX and on all four for ISSI, which runs in QPI mode
+
+	checkCommand(SPI_MODE, VENDOR_MX, 0x0B, 8, 1, 1, 1);
+	checkCommand(SPI_MODE, VENDOR_ISSI, 0x0B, 8, 1, 1, 1);
+	checkCommand(QUAD_MODE, VENDOR_MX, 0xEB, 6, 1, 4, 4);
+	checkCommand(QUAD_MODE, VENDOR_ISSI, 0xEB, 6, 4, 4, 4);
+
+	for(i = 0; i < sizeof(addresses) / sizeof(addresses[0]); i++)
+		for(j = 0; j < sizeof(sizes) / sizeof(sizes[0]); j++)
+			for(k = 0; k < sizeof(maxes) / sizeof(maxes[0]); k++)
+				checkRead(QUAD_MODE, VENDOR_MX, addresses[i], sizes[j], maxes[k]);
+
+	printf("Checked %d reads: %s (%d errors).\n", (int)(sizeof(addresses) / sizeof(addresses[0]) * sizeof(sizes) / sizeof(sizes[0]) * sizeof(maxes) / sizeof(maxes[0])), errors ? "FAILED" : "OK", errors);
+
+	return errors ? 1 : 0;
+}
@@ -0,0 +1,477 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "fsimage.h"
+#include "lz4.h"
+
+// Generates a tree of homebrew dirs, checks that every listing and file
+// reads back right through the legacy API, both mapped and through a
+// sector read callback, then times mounts, lookups and loads.
+
+int dirs = 100, files = 2, depth = 1, lookups = 100000, errors;
+uint32_t mainsize = 65536, bufsize;
+uint8_t *expected, *loaded;
+char *output = NULL, *input = NULL;
+
+unsigned char *loadFile(char *filename, long *size) {
+	FILE *f = fopen(filename, "rb");
+
+	if(f == NULL) {
+		printf("Error opening file %s!\n", filename);
+		exit(1);
+	}
+
+	fseek(f, 0, SEEK_END);
+	*size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	unsigned char *data = (unsigned char *) malloc(*size + 1);
+	fread(data, 1, *size, f);
+	fclose(f);
+
+	return data;
+}
+
+void buildTree() {
+	uint8_t *data = malloc(bufsize);
+	char name[20];
+	int i, j, hb, level;
+
+	clearTree();
+
+	for(i = 0; i < dirs; i++) {
+		sprintf(name, "HB%05d", i);
+		hb = addNode(0, name, 1, 0);
+
+		addNode(hb, "MAIN.BIN", 0, mainsize);
+		addNode(hb, "MANIFEST.TXT", 0, 48);
+
+		for(j = 0; j < files; j++) {
+			sprintf(name, "FILE%04d.DAT", j);
+			addNode(hb, name, 0, 1 + rand() % 8192);
+		}
+
+		j = addNode(hb, "README~1.TXT", 0, 1 + rand() % 8192);
+		nodes[j].Long = "Read me first, it is long.txt";
+
+		j = addNode(hb, "MAIN.LZ4", 0, 0);
+		nodes[j].Kind = NODE_PACKED;
+		nodes[j].Size = fileContent(j, data);
+
+		j = addNode(hb, "CRC32.SFV", 0, 0);
+		nodes[j].Kind = NODE_SUMS;
+		nodes[j].Size = fileContent(j, data);
+
+		// Nesting puts a file at the bottom of a chain of subdirs
+
+		for(level = 1, j = hb; level <= depth; level++) {
+			sprintf(name, "LEVEL%d", level);
+			j = addNode(j, name, 1, 0);
+			nodes[j].Long = "A subdir with a long name";
+		}
+
+		if(depth > 0) addNode(j, "DEEP.BIN", 0, 4096);
+	}
+
+	// A dir without a MAIN.BIN or MAIN.LZ4 is not a homebrew, and a file in the root is not either
+
+	hb = addNode(0, "SAVES", 1, 0);
+	addNode(hb, "MAIN.TXT", 0, 100);
+	addNode(hb, "SLOT0.SAV", 0, 8192);
+	addNode(0, "NOTES.TXT", 0, 100);
+
+	free(data);
+}
+
+// Everything is checked twice, once mapped and once through a sector read callback
+
+int readSector(FsBlockDevice *dev, uint32_t sector, uint8_t *buffer, uint32_t count) {
+	if((sector + count) * (long)SECTOR_SIZE > disksize) return -1;
+
+	memcpy(buffer, (uint8_t *)dev->Context + sector * (long)SECTOR_SIZE, count * SECTOR_SIZE);
+
+	return 0;
+}
+
+void fail(const char *what, int node) {
+	printf("Error: %s for %.11s (node %d)!\n", what, nodes[node].Name, node);
+	errors++;
+}
+
+int childCount(int parent) {
+	int i, count = 0;
+
+	for(i = 1; i < nodecount; i++)
+		if(nodes[i].Parent == parent) count++;
+
+	return count;
+}
+
+int countNamed(FsDir *dir, char *name) {
+	FsDirIter it;
+	int count = 0;
+
+	fsdir_open(&it, dir, 0, 0);
+
+	while(fsdir_next(&it) != NULL)
+		if(!strcmp(it.Name, name)) count++;
+
+	return count;
+}
+
+void checkDir(int dir) {
+	DirEntry *list;
+	FsDir saved, sub;
+	char name[13], *loadname;
+	int i, j, count;
+	long size;
+
+	// The listing has to match, apart from "." and ".."
+
+	list = fsreaddir(0, &count);
+
+	if(count != childCount(dir) + ((dir == 0) ? 0 : 2)) fail("Wrong number of entries", dir);
+
+	for(i = 1; i < nodecount; i++) {
+		if(nodes[i].Parent != dir) continue;
+
+		for(j = 0; j < count && memcmp(list[j].Basename, nodes[i].Name, 11); j++);
+
+		if(j == count || list[j].Size != nodes[i].Size || !(list[j].Attribute & 0x10) != !nodes[i].Dir) fail("Missing from the listing", i);
+
+		fatname_to_filename(nodes[i].Name, name);
+
+		// A long name is listed instead of the alias, and both of them open the same entry
+
+		loadname = nodes[i].Long ? nodes[i].Long : name;
+
+		if(nodes[i].Long && (countNamed(fsgetcwd(), nodes[i].Long) != 1 || countNamed(fsgetcwd(), name) != 0)) fail("Long name not listed", i);
+
+		if(nodes[i].Dir) {
+			if(nodes[i].Long && (fsopendir(&sub, fsgetcwd(), nodes[i].Long) || sub.Cluster != nodes[i].Cluster)) fail("Could not open the dir by its long name", i);
+
+			saved = *fsgetcwd();
+
+			if(fschdir(name)) {
+				fail("Could not enter the dir", i);
+			} else {
+				checkDir(i);
+			}
+
+			*fsgetcwd() = saved;
+
+			if(fsloadfile(name, loaded, mainsize) >= 0) fail("Loaded a dir as a file", i);
+		} else {
+			size = fsloadfile(name, loaded, nodes[i].Size);
+			fileContent(i, expected);
+
+			if(size != nodes[i].Size || memcmp(expected, loaded, size)) fail("Wrong content", i);
+
+			if(nodes[i].Long && (fsloadfile(nodes[i].Long, loaded, nodes[i].Size) != nodes[i].Size || memcmp(expected, loaded, nodes[i].Size))) fail("Wrong content by the long name", i);
+
+			// Everything but CRC32.SFV itself is listed in it
+
+			if(nodes[i].Kind != NODE_SUMS && fsloadfilechecked(loadname, loaded, nodes[i].Size) != nodes[i].Size) fail("Failed its CRC check", i);
+
+			if(nodes[i].Kind == NODE_PACKED) {
+				fillText(expected, i, textsize);
+
+				if(lz4_loadfile(fsgetcwd(), name, loaded, textsize) != textsize || memcmp(expected, loaded, textsize)) fail("Wrong unpacked content", i);
+
+				fileContent(i, expected);
+			}
+
+			// A short buffer gets as much as fits, and the full size is returned
+
+			if(nodes[i].Size > 0) {
+				loaded[nodes[i].Size - 1] = ~expected[nodes[i].Size - 1];
+
+				if(fsloadfile(name, loaded, nodes[i].Size - 1) != nodes[i].Size || loaded[nodes[i].Size - 1] == expected[nodes[i].Size - 1]) fail("Overran a short buffer", i);
+			}
+
+			if(!fschdir(name)) fail("Entered a file as a dir", i);
+		}
+	}
+
+	if(fsloadfile("NOSUCH.BIN", loaded, mainsize) >= 0) fail("Loaded a missing file", dir);
+	if(!fschdir("NOSUCH")) fail("Entered a missing dir", dir);
+
+	free(list);
+}
+
+// Only the homebrew dirs are listed with the menu's filter
+
+int countFiltered(uint8_t require, const char *pattern, const char *contains) {
+	FsDirIter it;
+	int count = 0;
+
+	fsdir_open(&it, fsgetcwd(), require, 0);
+	fsdir_filter(&it, pattern, contains);
+
+	while(fsdir_next(&it) != NULL)
+		if(strncmp(it.Name, "HB", 2)) return -1; else count++;
+
+	return count;
+}
+
+void checkFilter() {
+	FsNameTable table;
+	FsDirIter it;
+	char *buffer = malloc(65536);
+
+	fschdir("/");
+
+	if(countFiltered(0x10, NULL, "MAIN.BIN|MAIN.LZ4") != dirs) fail("Wrong dirs with a MAIN.BIN or MAIN.LZ4", 0);
+	if(countFiltered(0x10, NULL, "MAIN.*") != -1) fail("Missed SAVES with its MAIN.TXT", 0);
+	if(countFiltered(0, NULL, "MAIN.LZ4") != dirs) fail("Wrong dirs with a MAIN.LZ4", 0);
+	if(countFiltered(0, "HB0000?", NULL) != ((dirs < 10) ? dirs : 10)) fail("Wrong dirs matching HB0000?", 0);
+	if(countFiltered(0, "HB*", "DEEP.BIN") != 0) fail("Found DEEP.BIN a level up", 0);
+
+	// Case does not matter, the same as for the lookups
+
+	if(countFiltered(0, NULL, "main.lz4") != dirs) fail("Wrong dirs with a main.lz4", 0);
+	if(countFiltered(0, "hb0000?", NULL) != ((dirs < 10) ? dirs : 10)) fail("Wrong dirs matching hb0000?", 0);
+	if(countFiltered(0, "h*0000?", "*.Lz4|x") != ((dirs < 10) ? dirs : 10)) fail("Wrong dirs matching h*0000?", 0);
+	if(countFiltered(0, "*", "MAIN.LZ") != 0 || countFiltered(0, "HB*X", NULL) != 0) fail("Matched a name that only starts the same", 0);
+
+	fsdir_open(&it, fsgetcwd(), 0x10, 0);
+	fsdir_filter(&it, NULL, "MAIN.BIN|MAIN.LZ4");
+
+	if(fsdir_nametableiter(&table, &it, buffer, 65536) != dirs || !table.Complete || table.Count != dirs || strcmp(fsnametable_name(&table, 0), "HB00000")) fail("Wrong filtered name table", 0);
+
+	free(buffer);
+}
+
+void check() {
+	FsBlockDevice device;
+
+	printf("Generated %ld kB FAT%d image: %d byte clusters, %d nodes, %d fragmented.\n", disksize / 1024, fat32 ? 32 : 16, clustersectors * SECTOR_SIZE, nodecount, fragmented);
+
+	if(fsmount(disk)) {
+		printf("Error: the image does not mount!\n");
+		exit(1);
+	}
+
+	checkDir(0);
+	checkFilter();
+
+	memset(&device, 0, sizeof(device));
+	device.ReadSector = readSector;
+	device.Context = disk;
+
+	if(fsmountdevice(&device)) {
+		printf("Error: the image does not mount through the read callback!\n");
+		exit(1);
+	}
+
+	checkDir(0);
+	checkFilter();
+
+	printf("Checked the image both mapped and unmapped: %s (%d errors).\n", errors ? "FAILED" : "OK", errors);
+}
+
+void benchmark() {
+	FsDir root, dir;
+	FsFile file;
+	DirEntry *list;
+	char (*names)[13];
+	uint8_t *buffer;
+	double start, time;
+	long bytes, size;
+	int count, i, runs;
+
+	if(fsmount(disk)) {
+		printf("Error: the image does not mount!\n");
+		exit(1);
+	}
+
+	fsrootdir(&root, fsgetvolume());
+
+	list = fsreaddir(1, &count);
+
+	if(count == 0) {
+		printf("Error: there are no dirs to look up!\n");
+		exit(1);
+	}
+
+	names = malloc(count * sizeof(*names));
+
+	for(i = 0; i < count; i++)
+		fatname_to_filename(list[i].Basename, names[i]);
+
+	free(list);
+
+	start = seconds();
+
+	for(runs = 0; seconds() - start < 0.2; runs++)
+		fsmount(disk);
+
+	printf("Mount:            %10.0f ns\n", (seconds() - start) / runs * 1e9);
+
+	start = seconds();
+
+	for(runs = 0; seconds() - start < 0.2; runs++)
+		free(fsreaddir(1, &i));
+
+	time = (seconds() - start) / runs;
+	printf("Root listing:     %10.0f ns (%.0f ns per entry)\n", time * 1e9, time / count * 1e9);
+
+	// Lookups go through the names in a random order
+
+	fsrootdir(&root, fsgetvolume());
+	start = seconds();
+
+	for(i = 0; i < lookups; i++)
+		fsopendir(&dir, &root, names[rand() % count]);
+
+	printf("Dir lookup:       %10.0f ns\n", (seconds() - start) / lookups * 1e9);
+
+	start = seconds();
+
+	for(i = 0; i < lookups; i++) {
+		fsopendir(&dir, &root, names[rand() % count]);
+		fsopenat(&dir, &file, "MAIN.BIN");
+	}
+
+	printf("Dir + file lookup:%10.0f ns\n", (seconds() - start) / lookups * 1e9);
+
+	// Loads read MAIN.BIN out of every dir that has one
+
+	// Touch the buffer first, so that the loop does not pay for faulting it in
+
+	buffer = malloc(16 * 1024 * 1024);
+	memset(buffer, 0, 16 * 1024 * 1024);
+	bytes = 0;
+	start = seconds();
+
+	for(runs = 0; runs == 0 || seconds() - start < 0.2; runs++) {
+		for(i = 0; i < count; i++) {
+			fsopendir(&dir, &root, names[i]);
+
+			if((size = fsloadfileat(&dir, "MAIN.BIN", buffer, 16 * 1024 * 1024)) > 0) bytes += size;
+		}
+	}
+
+	time = seconds() - start;
+	printf("MAIN.BIN loads:   %10.1f MB/s (%ld bytes per pass)\n", bytes / time / 1e6, bytes / runs);
+
+	// The same loads checked against CRC32.SFV, then the packed copies
+
+	bytes = 0;
+	start = seconds();
+
+	for(runs = 0; runs == 0 || seconds() - start < 0.2; runs++) {
+		for(i = 0; i < count; i++) {
+			fsopendir(&dir, &root, names[i]);
+
+			if((size = fsloadfilecheckedat(&dir, "MAIN.BIN", buffer, 16 * 1024 * 1024)) > 0) bytes += size;
+		}
+	}
+
+	printf("  CRC checked:    %10.1f MB/s\n", bytes / (seconds() - start) / 1e6);
+
+	bytes = 0;
+	start = seconds();
+
+	for(runs = 0; runs == 0 || seconds() - start < 0.2; runs++) {
+		for(i = 0; i < count; i++) {
+			fsopendir(&dir, &root, names[i]);
+
+			if((size = lz4_loadfile(&dir, "MAIN.LZ4", buffer, 16 * 1024 * 1024)) > 0) bytes += size;
+		}
+	}
+
+	time = seconds() - start;
+
+	if(bytes > 0) printf("MAIN.LZ4 loads:   %10.1f MB/s (%ld unpacked bytes per pass)\n", bytes / time / 1e6, bytes / runs);
+
+	free(buffer);
+	free(names);
+}
+
+int main(int argc, char *argv[]) {
+	int i;
+
+	clustersectors = 8;
+	fatcopies = 2;
+
+	for(i = 1; i < argc - 1; i += 2) {
+		if(!strcmp(argv[i], "-d")) dirs = atoi(argv[i + 1]);
+		else if(!strcmp(argv[i], "-f")) files = atoi(argv[i + 1]);
+		else if(!strcmp(argv[i], "-n")) depth = atoi(argv[i + 1]);
+		else if(!strcmp(argv[i], "-s")) mainsize = atoi(argv[i + 1]);
+		else if(!strcmp(argv[i], "-x")) fragpercent = atoi(argv[i + 1]);
+		else if(!strcmp(argv[i], "-c")) clustersectors = atoi(argv[i + 1]);
+		else if(!strcmp(argv[i], "-l")) lookups = atoi(argv[i + 1]);
+		else if(!strcmp(argv[i], "-o")) output = argv[i + 1];
+		else if(!strcmp(argv[i], "-i")) input = argv[i + 1];
+		else break;
+	}
+
+	if(i < argc || clustersectors <= 0 || clustersectors > 128 || (clustersectors & (clustersectors - 1)) || fragpercent < 0 || fragpercent > 100 || lookups <= 0) {
+		printf("Usage: %s <options>\n", argv[0]);
+		printf("Generates a FAT16 image, checks that fslib reads it correctly and times it.\n");
+		printf("The same files are also checked on a FAT32 image with 512 byte clusters.\n");
+		printf("  -d dirs        Homebrew dirs in the root (default 100)\n");
+		printf("  -f files       Extra files in each of them (default 2)\n");
+		printf("  -n depth       Nesting of subdirs below each of them (default 1)\n");
+		printf("  -s size        Size of MAIN.BIN (default 65536)\n");
+		printf("  -x percent     Clusters taken out of order (default 0)\n");
+		printf("  -c sectors     Sectors per cluster (default 8)\n");
+		printf("  -l lookups     Number of timed lookups (default 100000)\n");
+		printf("  -o image       Save the generated image\n");
+		printf("  -i image       Only time an existing image instead\n");
+		exit(0);
+	}
+
+	srand(1);
+
+	// Room for a file and for the worst case of packing it
+
+	bufsize = mainsize + mainsize / 64 + 8192;
+	textsize = mainsize;
+	expected = malloc(bufsize);
+	loaded = malloc(bufsize);
+
+	if(input != NULL) {
+		disk = loadFile(input, &disksize);
+	} else {
+		buildTree();
+
+		// FAT32 only gets checked, with the smallest clusters to keep its image small
+
+		fat32 = 1;
+		i = clustersectors;
+		clustersectors = 1;
+
+		buildImage();
+		check();
+
+		fat32 = 0;
+		clustersectors = i;
+
+		buildImage();
+		check();
+
+		if(output != NULL) {
+			FILE *f = fopen(output, "wb");
+
+			if(f == NULL) {
+				printf("Error opening file %s for writing!\n", output);
+				exit(1);
+			}
+
+			fwrite(disk, 1, disksize, f);
+			fclose(f);
+		}
+	}
+
+	benchmark();
+
+	free(expected);
+	free(loaded);
+
+	return errors ? 1 : 0;
+}
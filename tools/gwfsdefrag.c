@@ -0,0 +1,349 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "fsimage.h"
+
+// Defragments a generated image with some of the clusters out of order on
+// a flash that behaves like NOR, then splits up a new file on purpose and
+// defragments again. Every file has to read back the same afterwards, and
+// the split up file has to be in a single run. A power cut in the middle of
+// a defrag has to be finished or dropped by the next mount.
+
+int dirs = 10, errors, cuts = 1;
+uint32_t ballast;
+uint8_t *expected, *loaded, *buffer;
+FsBlockDevice nor;
+
+#define BUFFER_SIZE (64 * 1024)
+
+void buildTree() {
+	char name[16];
+	int i, j, hb;
+
+	clearTree();
+
+	// Takes up fslib's whole map of the free clusters, so the files come after it
+
+	if(ballast) addNode(0, "BALLAST.BIN", 0, ballast);
+
+	for(i = 0; i < dirs; i++) {
+		sprintf(name, "HB%05d", i);
+		hb = addNode(0, name, 1, 0);
+
+		addNode(hb, "MAIN.BIN", 0, 65536);
+		addNode(hb, "MANIFEST.TXT", 0, 48);
+		addNode(hb, "FILE0000.DAT", 0, 1 + rand() % 8192);
+
+		j = addNode(hb, "README~1.TXT", 0, 1 + rand() % 8192);
+		nodes[j].Long = "Read me first, it is long.txt";
+	}
+}
+
+int countRuns(char *name) {
+	FsExtentCache runs;
+	FsFile file;
+
+	if(fsopen(&file, name)) return 0;
+
+	fsbuildextents(&runs, fsgetvolume(), file.Extents.StartCluster);
+
+	return runs.Count;
+}
+
+// Every file of the dir has to read back the same
+
+int checkDir(int dir) {
+	char name[13];
+	int i, before = errors;
+
+	fschdir("/");
+	fatname_to_filename(nodes[dir].Name, name);
+
+	if(fschdir(name)) {
+		printf("Error: could not enter %.11s!\n", nodes[dir].Name);
+		errors++;
+		return 0;
+	}
+
+	for(i = dir + 1; i < nodecount && nodes[i].Parent == dir; i++) {
+		fatname_to_filename(nodes[i].Name, name);
+		fileContent(i, expected);
+
+		if(fsloadfile(nodes[i].Long ? nodes[i].Long : name, loaded, nodes[i].Size) != nodes[i].Size || memcmp(expected, loaded, nodes[i].Size)) {
+			printf("Error: %s in %.11s reads back wrong!\n", name, nodes[dir].Name);
+			errors++;
+		}
+	}
+
+	return errors == before;
+}
+
+void checkTree() {
+	int i;
+
+	for(i = 1; i < nodecount; i++)
+		if(nodes[i].Parent == 0 && nodes[i].Dir) checkDir(i);
+
+	fschdir("/");
+}
+
+// FRAG.BIN always has a free run big enough to move it into
+
+void checkMoved(int dir, const char *when) {
+	char name[13];
+
+	fschdir("/");
+	fatname_to_filename(nodes[dir].Name, name);
+	fschdir(name);
+
+	if(countRuns("FRAG.BIN") != 1) {
+		printf("Error: FRAG.BIN is still in %d run(s) %s!\n", countRuns("FRAG.BIN"), when);
+		errors++;
+	}
+
+	fschdir("/");
+}
+
+// Fills the volume up apart from single clusters between small files, which
+// is all FRAG.BIN gets then. The two spare clusters are for the dir, in case
+// it has to grow. The files that are left get nodes, so the checks cover
+// them. Returns the node of FRAG.BIN.
+
+int fragmentFile(int parent) {
+	uint32_t cs = fsgetvolume()->ClusterSize, fill;
+	uint8_t *filler;
+	char name[16];
+	int i, node, ok;
+
+	fschdir("/");
+	fatname_to_filename(nodes[parent].Name, name);
+	fschdir(name);
+
+	for(i = 0, ok = 1; i < 8 && ok; i++) {
+		sprintf(name, "H%d.DAT", i);
+		node = (i & 1) ? addNode(parent, name, 0, cs) : 3000 + i;
+		fillFile(expected, node, cs);
+		ok = !fswritefile(name, expected, cs);
+	}
+
+	fill = (fsgetvolume()->FreeClusters - 2) * cs;
+	filler = malloc(fill);
+	fillFile(filler, 3010, fill);
+
+	ok = ok && !fswritefile("FILL.BIN", filler, fill);
+
+	free(filler);
+
+	for(i = 0; i < 8 && ok; i += 2) {
+		sprintf(name, "H%d.DAT", i);
+		ok = !fsdeletefile(name);
+	}
+
+	node = addNode(parent, "FRAG.BIN", 0, 4 * cs);
+	fillFile(expected, node, 4 * cs);
+
+	ok = ok && !fswritefile("FRAG.BIN", expected, 4 * cs);
+	ok = ok && !fsdeletefile("FILL.BIN");
+
+	if(!ok || countRuns("FRAG.BIN") < 2 || fsloadfile("FRAG.BIN", loaded, 4 * cs) != 4 * cs || memcmp(expected, loaded, 4 * cs)) {
+		printf("Error: could not split up FRAG.BIN!\n");
+		errors++;
+	}
+
+	fschdir("/");
+
+	return node;
+}
+
+// The log rebuilds a mirror block from the FAT before it, so after a power
+// cut all of the copies have to match again
+
+void checkMirrors(int cut) {
+	FsVolume *vol = fsgetvolume();
+	uint8_t *first = disk + vol->FatOffset;
+	int i;
+
+	for(i = 1; i < vol->Info.NumberOfFats; i++) {
+		if(memcmp(first, first + i * vol->FatSize, vol->FatSize)) {
+			printf("Error: FAT %d differs from the first one after a power cut at operation %d!\n", i + 1, cut);
+			errors++;
+		}
+	}
+}
+
+void defrag(const char *what) {
+	FsDefragStats stats;
+	int ok;
+
+	norerases = norprograms = norbooterases = 0;
+
+	// Files without a free run big enough for them only get partly merged
+
+	ok = !fsdefrag(buffer, BUFFER_SIZE, &stats);
+
+	if(!ok || stats.FragmentedAfter > stats.FragmentedBefore || (stats.FragmentedBefore > 0 && (stats.RunsAfter >= stats.RunsBefore || stats.Moved == 0))) {
+		printf("Error: %s failed!\n", what);
+		errors++;
+	}
+
+	if(stats.Erases != norerases || stats.Programs != norprograms) {
+		printf("Error: %s reported %d/%d erases and %d/%d sector writes!\n", what, stats.Erases, norerases, stats.Programs, norprograms);
+		errors++;
+	}
+
+	// The marker and the log live in blocks of their own
+
+	if(norbooterases != 0) {
+		printf("Error: %s erased the boot sector %d time(s)!\n", what, norbooterases);
+		errors++;
+	}
+
+	printf("  %-26s %4d -> %d fragmented file(s), %5d -> %d run(s), %3d moved, %4d erase(s) %6d sector write(s)\n", what, stats.FragmentedBefore, stats.FragmentedAfter, stats.RunsBefore, stats.RunsAfter, stats.Moved, norerases, norprograms);
+}
+
+// Cuts the power at points spread over a defrag of FRAG.BIN. The next mount
+// has to finish or drop the move that was cut short, leave everything else
+// as it was, and defragmenting again has to work.
+
+void checkPowerCuts(int dir) {
+	FsDefragStats stats;
+	uint8_t *snapshot;
+	int total, step, cut, count = 0, failed = 0, before;
+
+	// Whatever else is fragmented gets moved first, so that the cuts only hit FRAG.BIN
+
+	buildTree();
+	buildImage();
+	norMount(&nor);
+	fsdefrag(buffer, BUFFER_SIZE, &stats);
+	fragmentFile(dir);
+
+	snapshot = malloc(disksize);
+	memcpy(snapshot, disk, disksize);
+
+	// A defrag without a cut tells how many operations there are to cut
+
+	norops = 0;
+	fsdefrag(buffer, BUFFER_SIZE, &stats);
+
+	total = norops;
+	step = (total + 199) / 200;
+
+	for(cut = 0; cut < total; cut += step) {
+		memcpy(disk, snapshot, disksize);
+		norMount(&nor);
+
+		norops = 0;
+		norcut = cut;
+		fsdefrag(buffer, BUFFER_SIZE, &stats);
+		norcut = -1;
+
+		// Only the dir with the moved file is checked each time, the whole
+		// volume takes too long. The last cut gets the full check below.
+
+		before = errors;
+
+		norMount(&nor);
+		checkDir(dir);
+
+		if(fsdefrag(buffer, BUFFER_SIZE, &stats)) {
+			printf("Error: the defrag after a power cut at operation %d failed!\n", cut);
+			errors++;
+		}
+
+		norMount(&nor);
+		checkDir(dir);
+		checkMoved(dir, "after a power cut");
+		checkMirrors(cut);
+
+		count++;
+		if(errors != before) failed++;
+	}
+
+	norMount(&nor);
+	checkTree();
+
+	printf("  %d power cut(s) in %d flash operations, %d of them lost data\n", count, total, failed);
+
+	free(snapshot);
+}
+
+void checkDefrag() {
+	int dir;
+
+	buildTree();
+	buildImage();
+	norMount(&nor);
+
+	dir = findNode(0, "HB00000");
+
+	printf("Defragmenting a %ld kB FAT%d image as a NOR flash, %d byte clusters, %d file(s) fragmented:\n", disksize / 1024, fat32 ? 32 : 16, clustersectors * SECTOR_SIZE, fragmented);
+
+	// The scattered files first, then a file split up on purpose
+
+	defrag("Scattered files");
+
+	norMount(&nor);
+	checkTree();
+
+	fragmentFile(dir);
+	defrag("Split up FRAG.BIN");
+
+	norMount(&nor);
+	checkTree();
+	checkMoved(dir, "after the defrag");
+
+	if(cuts) checkPowerCuts(dir);
+}
+
+int main(int argc, char *argv[]) {
+	int i;
+
+	fragpercent = 25;
+	fatcopies = 2;
+
+	for(i = 1; i < argc - 1; i += 2) {
+		if(!strcmp(argv[i], "-d")) dirs = atoi(argv[i + 1]);
+		else if(!strcmp(argv[i], "-x")) fragpercent = atoi(argv[i + 1]);
+		else if(!strcmp(argv[i], "-c")) clustersectors = atoi(argv[i + 1]);
+		else if(!strcmp(argv[i], "-p")) cuts = atoi(argv[i + 1]);
+		else break;
+	}
+
+	if(i < argc || dirs <= 0 || clustersectors <= 0 || clustersectors > 128 || (clustersectors & (clustersectors - 1)) || fragpercent < 0 || fragpercent > 100) {
+		printf("Usage: %s <options>\n", argv[0]);
+		printf("Defragments generated FAT16 and FAT32 images that behave like a NOR flash.\n");
+		printf("  -d dirs        Homebrew dirs in the root (default 10)\n");
+		printf("  -x percent     Clusters taken out of order (default 25)\n");
+		printf("  -c sectors     Sectors per cluster, a power of two (default 1)\n");
+		printf("  -p 0|1         Cut the power during a defrag (default 1)\n");
+		exit(0);
+	}
+
+	srand(1);
+
+	expected = malloc(65536);
+	loaded = malloc(65536);
+	buffer = malloc(BUFFER_SIZE);
+
+	for(fat32 = 0; fat32 < 2; fat32++)
+		checkDefrag();
+
+	// Past the free map, only the FAT shows which clusters are taken. Nothing
+	// gets scattered, so that every free cluster is past it.
+
+	fat32 = 1;
+	fragpercent = 0;
+	ballast = (FS_MAX_CLUSTERS + FS_MAX_CLUSTERS / 4) * clustersectors * SECTOR_SIZE;
+	checkDefrag();
+
+	printf("Checked defragmenting the image: %s (%d errors).\n", errors ? "FAILED" : "OK", errors);
+
+	free(expected);
+	free(loaded);
+	free(buffer);
+
+	return errors ? 1 : 0;
+}
@@ -0,0 +1,310 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "fsimage.h"
+
+// Times dir scans and loads through fslib against the way it did them before
+// the extent cache, on an image with some of the clusters out of order. Every
+// dir entry used to walk the FAT from the start of its dir, and loads went
+// cluster by cluster. Both scans put together the long names that half of the
+// files have.
+
+#define MAX_FILE (1024 * 1024)
+
+static const int dirsizes[] = { 10, 100, 1000, 4000 };
+static const uint32_t filesizes[] = { 4096, 65536, 262144, MAX_FILE };
+
+#define COUNT(x) (int)(sizeof(x) / sizeof(x[0]))
+
+int errors;
+uint8_t *expected, *loaded;
+char (*longnames)[32];
+
+// The old walk reads the FAT straight out of the image
+
+BIOSParams *bpb;
+
+int refNext(int clust) {
+	return ((uint16_t *)(disk + bpb->ReservedSectors * SECTOR_SIZE))[clust];
+}
+
+int refChained(int clust) {
+	return clust >= 2 && clust < 0xFFF8;
+}
+
+uint8_t *refCluster(int clust) {
+	int datasector = bpb->ReservedSectors + bpb->SectorsPerFat * bpb->NumberOfFats + bpb->RootDirEntries * sizeof(DirEntry) / SECTOR_SIZE;
+
+	return disk + (datasector + (long)(clust - 2) * bpb->SectorsPerCluster) * SECTOR_SIZE;
+}
+
+// Lists the names in the dir the way fsdir_next() does. A long name comes
+// in pieces, last one first, and only belongs to the entry right after it.
+
+int refScanDir(int first, char (*names)[FS_MAX_NAME]) {
+	static const uint8_t offsets[13] = {1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30};
+	int perCluster = bpb->SectorsPerCluster * SECTOR_SIZE / sizeof(DirEntry), id, i, clust, count = 0, next = 0, pos;
+	uint8_t *raw, sum = 0, check;
+	char name[FS_MAX_NAME];
+	uint16_t c;
+
+	for(id = 0; ; id++) {
+		for(i = 0, clust = first; i < id / perCluster && refChained(clust); i++)
+			clust = refNext(clust);
+
+		if(!refChained(clust)) break;
+
+		raw = refCluster(clust) + (id % perCluster) * sizeof(DirEntry);
+
+		if(raw[0] == 0) break;
+
+		if(raw[0] == 0xE5) {
+			next = 0;
+			continue;
+		}
+
+		if(raw[11] == 0x0F) {
+			if(raw[0] & 0x40) {
+				memset(name, 0, sizeof(name));
+				sum = raw[13];
+			} else if((raw[0] & 0x1F) != next || raw[13] != sum) {
+				next = 0;
+				continue;
+			}
+
+			if((raw[0] & 0x1F) == 0) {
+				next = 0;
+				continue;
+			}
+
+			for(i = 0; i < 13; i++) {
+				c = raw[offsets[i]] | raw[offsets[i] + 1] << 8;
+				pos = ((raw[0] & 0x1F) - 1) * 13 + i;
+
+				if(c == 0 || pos >= FS_MAX_NAME - 1) break;
+
+				name[pos] = (c < 0x80) ? c : '?';
+			}
+
+			next = ((raw[0] & 0x1F) == 1) ? 0xFF : (raw[0] & 0x1F) - 1;
+			continue;
+		}
+
+		for(i = 0, check = 0; i < 11; i++)
+			check = ((check & 1) << 7) + (check >> 1) + raw[i];
+
+		if(raw[11] & 8) {
+			next = 0;
+			continue;
+		}
+
+		if(next == 0xFF && check == sum)
+			strcpy(names[count++], name);
+		else
+			fatname_to_filename((char *)raw, names[count++]);
+
+		next = 0;
+	}
+
+	return count;
+}
+
+long refLoad(int clust, uint8_t *buffer, uint32_t size) {
+	uint32_t len, done, cs = bpb->SectorsPerCluster * SECTOR_SIZE;
+
+	for(done = 0; done < size && refChained(clust); done += len, clust = refNext(clust)) {
+		len = (size - done < cs) ? size - done : cs;
+		memcpy(buffer + done, refCluster(clust), len);
+	}
+
+	return done;
+}
+
+void buildTree() {
+	char name[16];
+	int i, j, dir, node;
+
+	clearTree();
+
+	for(j = 0; j < dirsizes[COUNT(dirsizes) - 1]; j++)
+		sprintf(longnames[j], "File number %05d.data", j);
+
+	for(i = 0; i < COUNT(dirsizes); i++) {
+		sprintf(name, "DIR%d", dirsizes[i]);
+		dir = addNode(0, name, 1, 0);
+
+		for(j = 0; j < dirsizes[i]; j++) {
+			sprintf(name, "F%05d.DAT", j);
+			node = addNode(dir, name, 0, 100);
+
+			if(j & 1) nodes[node].Long = longnames[j];
+		}
+	}
+
+	for(i = 0; i < COUNT(filesizes); i++) {
+		sprintf(name, "F%u.BIN", (unsigned)filesizes[i]);
+		addNode(0, name, 0, filesizes[i]);
+	}
+}
+
+void scanDirs() {
+	char (*list)[FS_MAX_NAME], (*reflist)[FS_MAX_NAME], name[16];
+	double start, time, reftime;
+	int i, j, count = 0, refcount, longcount, runs, node;
+	FsDirIter it;
+
+	printf("Dir scan:\n");
+	printf("  %8s %12s %12s\n", "entries", "fslib", "old walk");
+
+	for(i = 0; i < COUNT(dirsizes); i++) {
+		sprintf(name, "DIR%d", dirsizes[i]);
+		node = findNode(0, name);
+
+		fschdir("/");
+
+		if(fschdir(name)) {
+			printf("Error: could not enter %s!\n", name);
+			errors++;
+			continue;
+		}
+
+		list = malloc((dirsizes[i] + 2) * sizeof(*list));
+		reflist = malloc((dirsizes[i] + 2) * sizeof(*reflist));
+
+		start = seconds();
+
+		for(runs = 0; runs == 0 || seconds() - start < 0.2; runs++) {
+			fsdir_open(&it, fsgetcwd(), 0, 0);
+
+			for(count = 0; count < dirsizes[i] + 2 && fsdir_next(&it) != NULL; count++)
+				strcpy(list[count], it.Name);
+		}
+
+		time = (seconds() - start) / runs;
+		start = seconds();
+
+		for(runs = 0; runs == 0 || seconds() - start < 0.2; runs++)
+			refcount = refScanDir(nodes[node].Cluster, reflist);
+
+		reftime = (seconds() - start) / runs;
+
+		if(count != dirsizes[i] + 2 || refcount != count) {
+			printf("Error: listed %d and %d entries in %s, expected %d!\n", count, refcount, name, dirsizes[i] + 2);
+			errors++;
+		} else {
+			for(j = 0, longcount = 0; j < count && !strcmp(list[j], reflist[j]); j++)
+				if(!strncmp(list[j], "File number", 11)) longcount++;
+
+			if(j < count) {
+				printf("Error: %s is listed as %s by the old walk!\n", list[j], reflist[j]);
+				errors++;
+			} else if(longcount != dirsizes[i] / 2) {
+				printf("Error: listed %d long names in %s, expected %d!\n", longcount, name, dirsizes[i] / 2);
+				errors++;
+			}
+		}
+
+		printf("  %8d %9.0f ns %9.0f ns\n", count, time * 1e9, reftime * 1e9);
+
+		free(list);
+		free(reflist);
+	}
+
+	fschdir("/");
+}
+
+void loadFiles() {
+	double start, time, reftime;
+	char name[16];
+	long size = 0, refsize = 0;
+	int i, runs, node;
+
+	printf("Load:\n");
+	printf("  %8s %12s %12s\n", "bytes", "fslib", "old walk");
+
+	for(i = 0; i < COUNT(filesizes); i++) {
+		sprintf(name, "F%u.BIN", (unsigned)filesizes[i]);
+		node = findNode(0, name);
+		fillFile(expected, node, filesizes[i]);
+
+		start = seconds();
+
+		for(runs = 0; runs == 0 || seconds() - start < 0.2; runs++)
+			size = fsloadfile(name, loaded, MAX_FILE);
+
+		time = (seconds() - start) / runs;
+
+		if(size != (long)filesizes[i] || memcmp(expected, loaded, size)) {
+			printf("Error: %s loaded wrong!\n", name);
+			errors++;
+		}
+
+		start = seconds();
+
+		for(runs = 0; runs == 0 || seconds() - start < 0.2; runs++)
+			refsize = refLoad(nodes[node].Cluster, loaded, filesizes[i]);
+
+		reftime = (seconds() - start) / runs;
+
+		if(refsize != (long)filesizes[i] || memcmp(expected, loaded, refsize)) {
+			printf("Error: %s loaded wrong by the old walk!\n", name);
+			errors++;
+		}
+
+		printf("  %8u %7.1f MB/s %7.1f MB/s\n", (unsigned)filesizes[i], filesizes[i] / time / 1e6, filesizes[i] / reftime / 1e6);
+	}
+}
+
+int main(int argc, char *argv[]) {
+	fragpercent = 25;
+
+	if(argc == 3 && !strcmp(argv[1], "-x")) {
+		fragpercent = atoi(argv[2]);
+	} else if(argc != 1) {
+		printf("Usage: %s <-x percent>\n", argv[0]);
+		printf("Times dir scans and loads against dir and file size, with the given percentage\n");
+		printf("of clusters taken out of order (default 25).\n");
+		exit(0);
+	}
+
+	if(fragpercent < 0 || fragpercent > 100) {
+		printf("Error: the percentage has to be between 0 and 100!\n");
+		exit(1);
+	}
+
+	srand(1);
+
+	expected = malloc(MAX_FILE);
+	loaded = malloc(MAX_FILE);
+
+	// Touch the buffer first, so that neither loop pays for faulting it in
+
+	memset(loaded, 0, MAX_FILE);
+
+	longnames = malloc(dirsizes[COUNT(dirsizes) - 1] * sizeof(*longnames));
+
+	buildTree();
+	buildImage();
+
+	printf("Generated %ld kB FAT16 image, %d%% of clusters out of order, %d fragmented.\n", disksize / 1024, fragpercent, fragmented);
+
+	bpb = (BIOSParams *)(disk + 3);
+
+	if(fsmount(disk)) {
+		printf("Error: the image does not mount!\n");
+		exit(1);
+	}
+
+	scanDirs();
+	loadFiles();
+
+	printf("Checked the results: %s (%d errors).\n", errors ? "FAILED" : "OK", errors);
+
+	free(expected);
+	free(loaded);
+	free(longnames);
+
+	return errors ? 1 : 0;
+}
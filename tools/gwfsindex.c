@@ -0,0 +1,146 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "fsimage.h"
+
+// Times dir lookups in the root through the name index against the linear
+// scan that every lookup did before it, for roots of a growing number of
+// homebrew dirs.
+
+static const int dircounts[] = { 30, 100, 300, 500 };
+
+#define COUNT(x) (int)(sizeof(x) / sizeof(x[0]))
+
+int errors, lookups = 100000;
+uint8_t *expected, *loaded;
+
+// What fschdir() did without the index: a scan over the root entries,
+// then the extents of the dir it found
+
+BIOSParams *bpb;
+FsExtentCache refcache;
+
+int refChdir(char *filename) {
+	DirEntry *root = (DirEntry *)(disk + (bpb->ReservedSectors + bpb->SectorsPerFat * bpb->NumberOfFats) * SECTOR_SIZE);
+	char fatname[11];
+	int i;
+
+	filename_to_fatname(filename, fatname);
+
+	for(i = 0; i < bpb->RootDirEntries; i++) {
+		if(root[i].Basename[0] == 0) break;
+		if((uint8_t)root[i].Basename[0] == 0xE5 || (root[i].Attribute & 8)) continue;
+
+		if(!memcmp(root[i].Basename, fatname, 11)) {
+			if(!(root[i].Attribute & 0x10)) return -1;
+
+			fsbuildextents(&refcache, fsgetvolume(), root[i].StartCluster);
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+void timeLookups(int count) {
+	char (*names)[16] = malloc(count * sizeof(*names));
+	double start, time, reftime;
+	int i, node;
+
+	clearTree();
+
+	for(i = 0; i < count; i++) {
+		sprintf(names[i], "HB%05d", i);
+		node = addNode(0, names[i], 1, 0);
+		addNode(node, "MAIN.BIN", 0, 4096);
+	}
+
+	buildImage();
+	bpb = (BIOSParams *)(disk + 3);
+
+	if(fsmount(disk)) {
+		printf("Error: the image does not mount!\n");
+		exit(1);
+	}
+
+	// Every dir has to be found, with the right MAIN.BIN in it
+
+	for(i = 0; i < count; i++) {
+		fillFile(expected, findNode(0, names[i]) + 1, 4096);
+
+		fschdir("/");
+
+		if(fschdir(names[i]) || refChdir(names[i]) || fsloadfile("MAIN.BIN", loaded, 4096) != 4096 || memcmp(expected, loaded, 4096)) {
+			printf("Error: could not look up %s!\n", names[i]);
+			errors++;
+		}
+	}
+
+	fschdir("/");
+
+	if(!fschdir("NOSUCH") || !refChdir("NOSUCH")) {
+		printf("Error: found a dir that does not exist!\n");
+		errors++;
+	}
+
+	// Lookups go through the names in a random order
+
+	start = seconds();
+
+	for(i = 0; i < lookups; i++) {
+		fschdir("/");
+		fschdir(names[rand() % count]);
+	}
+
+	time = (seconds() - start) / lookups;
+	start = seconds();
+
+	for(i = 0; i < lookups; i++) {
+		fschdir("/");
+		refChdir(names[rand() % count]);
+	}
+
+	reftime = (seconds() - start) / lookups;
+
+	printf("  %8d %9.0f ns %9.0f ns\n", count, time * 1e9, reftime * 1e9);
+
+	free(names);
+}
+
+int main(int argc, char *argv[]) {
+	int i;
+
+	if(argc == 3 && !strcmp(argv[1], "-l")) {
+		lookups = atoi(argv[2]);
+	} else if(argc != 1) {
+		printf("Usage: %s <-l lookups>\n", argv[0]);
+		printf("Times dir lookups in roots of 30 to 500 dirs, with the given number of\n");
+		printf("lookups each (default 100000).\n");
+		exit(0);
+	}
+
+	if(lookups <= 0) {
+		printf("Error: there has to be at least one lookup!\n");
+		exit(1);
+	}
+
+	srand(1);
+
+	expected = malloc(4096);
+	loaded = malloc(4096);
+
+	printf("Dir lookup:\n");
+	printf("  %8s %12s %12s\n", "dirs", "index", "scan");
+
+	for(i = 0; i < COUNT(dircounts); i++)
+		timeLookups(dircounts[i]);
+
+	printf("Checked the lookups: %s (%d errors).\n", errors ? "FAILED" : "OK", errors);
+
+	free(expected);
+	free(loaded);
+
+	return errors ? 1 : 0;
+}
@@ -0,0 +1,407 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "fsimage.h"
+#include "lz4.h"
+
+// Writes to a generated image through a flash that behaves like NOR. Each
+// step is read back, and its erase and sector write counts are checked
+// against what fslib reports. The image has two FATs by default, and every
+// copy has to match the first one once a step is done. The same steps run
+// on a FAT16 and on a FAT32 image.
+
+int dirs = 10, errors;
+uint32_t mainsize = 65536;
+uint8_t *expected, *loaded;
+FsBlockDevice nor;
+
+void buildTree() {
+	uint8_t *data = malloc(textsize * 2 + 4096);
+	char name[16];
+	int i, j, hb;
+
+	clearTree();
+
+	for(i = 0; i < dirs; i++) {
+		sprintf(name, "HB%05d", i);
+		hb = addNode(0, name, 1, 0);
+
+		addNode(hb, "MAIN.BIN", 0, mainsize);
+		addNode(hb, "MANIFEST.TXT", 0, 48);
+		addNode(hb, "FILE0000.DAT", 0, 1 + rand() % 8192);
+
+		j = addNode(hb, "README~1.TXT", 0, 1 + rand() % 8192);
+		nodes[j].Long = "Read me first, it is long.txt";
+
+		j = addNode(hb, "MAIN.LZ4", 0, 0);
+		nodes[j].Kind = NODE_PACKED;
+		nodes[j].Size = fileContent(j, data);
+
+		j = addNode(hb, "CRC32.SFV", 0, 0);
+		nodes[j].Kind = NODE_SUMS;
+		nodes[j].Size = fileContent(j, data);
+	}
+
+	free(data);
+}
+
+int countNamed(char *name) {
+	FsDirIter it;
+	int count = 0;
+
+	fsdir_open(&it, fsgetcwd(), 0, 0);
+
+	while(fsdir_next(&it) != NULL)
+		if(!strcmp(it.Name, name)) count++;
+
+	return count;
+}
+
+// The name table has to hold the same names and entries as the iterator
+// lists, and say so when they do not fit
+
+void checkNameTable(int node) {
+	FsNameTable table;
+	FsDirIter it;
+	char buffer[4096];
+	int id = 0;
+
+	fsdir_nametable(&table, fsgetcwd(), 0, 0, buffer, sizeof(buffer));
+	fsdir_open(&it, fsgetcwd(), 0, 0);
+
+	for(; fsdir_next(&it) != NULL; id++) {
+		if(id >= table.Count || strcmp(fsnametable_name(&table, id), it.Name) || fsnametable_entry(&table, id) != it.Index - 1) {
+			printf("Error: the name table of %.11s differs at %s!\n", nodes[node].Name, it.Name);
+			errors++;
+			return;
+		}
+	}
+
+	if(id != table.Count || !table.Complete) {
+		printf("Error: the name table of %.11s has %d names, expected %d!\n", nodes[node].Name, table.Count, id);
+		errors++;
+	}
+
+	fsdir_nametable(&table, fsgetcwd(), 0, 0, buffer, 64);
+
+	if(table.Complete || table.Count >= id) {
+		printf("Error: the name table of %.11s did not run out of room!\n", nodes[node].Name);
+		errors++;
+	}
+}
+
+// Every file of the tree has to read back the same, by its long name too,
+// and match its CRC in CRC32.SFV. MAIN.LZ4 has to unpack to its text.
+
+void checkTree() {
+	DirEntry *list;
+	char name[13];
+	int i, j, count;
+
+	for(i = 1; i < nodecount; i++) {
+		if(nodes[i].Parent != 0) continue;
+
+		fatname_to_filename(nodes[i].Name, name);
+
+		fschdir("/");
+
+		if(fschdir(name)) {
+			printf("Error: could not enter %s!\n", name);
+			errors++;
+			continue;
+		}
+
+		list = fsreaddir(0, &count);
+		free(list);
+
+		checkNameTable(i);
+
+		for(j = i + 1, count -= 2; j < nodecount && nodes[j].Parent == i; j++, count--) {
+			fatname_to_filename(nodes[j].Name, name);
+			fileContent(j, expected);
+
+			if(fsloadfile(name, loaded, nodes[j].Size) != nodes[j].Size || memcmp(expected, loaded, nodes[j].Size)) {
+				printf("Error: %s in %.11s reads back wrong!\n", name, nodes[i].Name);
+				errors++;
+			}
+
+			if(nodes[j].Long && (countNamed(nodes[j].Long) != 1 || countNamed(name) != 0 || fsloadfile(nodes[j].Long, loaded, nodes[j].Size) != nodes[j].Size || memcmp(expected, loaded, nodes[j].Size))) {
+				printf("Error: %s in %.11s does not read back by its long name!\n", name, nodes[i].Name);
+				errors++;
+			}
+
+			if(nodes[j].Kind != NODE_SUMS && fsloadfilechecked(nodes[j].Long ? nodes[j].Long : name, loaded, nodes[j].Size) != nodes[j].Size) {
+				printf("Error: %s in %.11s fails its CRC check!\n", name, nodes[i].Name);
+				errors++;
+			}
+
+			if(nodes[j].Kind == NODE_PACKED) {
+				fillText(expected, j, textsize);
+
+				if(lz4_loadfile(fsgetcwd(), name, loaded, textsize) != textsize || memcmp(expected, loaded, textsize)) {
+					printf("Error: %s in %.11s unpacks wrong!\n", name, nodes[i].Name);
+					errors++;
+				}
+			}
+		}
+
+		if(count != 0) {
+			printf("Error: %.11s lists %d entries too many!\n", nodes[i].Name, count);
+			errors++;
+		}
+	}
+
+	fschdir("/");
+}
+
+int checkFile(char *name, int seed, uint32_t size) {
+	fillFile(expected, seed, size);
+
+	return fsloadfile(name, loaded, size) == size && !memcmp(expected, loaded, size);
+}
+
+// The mirrors are copied over at the end of each step, so they must never lag behind
+
+void checkMirrors(const char *what) {
+	FsVolume *vol = fsgetvolume();
+	uint8_t *first = disk + vol->FatOffset;
+	int i;
+
+	for(i = 1; i < vol->Info.NumberOfFats; i++) {
+		if(memcmp(first, first + i * vol->FatSize, vol->FatSize)) {
+			printf("Error: FAT %d differs from the first one after: %s!\n", i + 1, what);
+			errors++;
+		}
+	}
+}
+
+// Counts of each step, checked against what the flash saw
+
+int fserases, fsprograms, writes;
+
+int written(int ret) {
+	writes++;
+	fserases += fsgetwritestats()->Erases;
+	fsprograms += fsgetwritestats()->Programs;
+
+	return ret == 0;
+}
+
+void writeStats(const char *what, int ok) {
+	if(!ok) {
+		printf("Error: %s failed!\n", what);
+		errors++;
+	}
+
+	if(fserases != norerases || fsprograms != norprograms) {
+		printf("Error: %s reported %d/%d erases and %d/%d sector writes!\n", what, fserases, norerases, fsprograms, norprograms);
+		errors++;
+	}
+
+	checkMirrors(what);
+
+	printf("  %-30s %4d erase(s) %5d sector write(s)\n", what, norerases, norprograms);
+
+	norerases = norprograms = fserases = fsprograms = 0;
+}
+
+void checkWrites() {
+	char *longname = "Save data of a game.bin", name[16];
+	int before, perCluster, i, ok, binary, packed;
+	uint32_t size = mainsize + 4096, generation;
+
+	if(fschdir("HB00000")) {
+		printf("Error: there is no HB00000 dir to write to!\n");
+		exit(1);
+	}
+
+	before = fsgetfreespace();
+	generation = fsgetgeneration(fsgetvolume());
+	writes = norbooterases = 0;
+	perCluster = clustersectors * SECTOR_SIZE / sizeof(DirEntry);
+
+	// A new file, then the same one again with different content and size
+
+	fillFile(expected, 1001, size);
+	ok = written(fswritefile("NEW.BIN", expected, size));
+	writeStats("New file", ok && checkFile("NEW.BIN", 1001, size));
+
+	fillFile(expected, 1002, size / 3);
+	ok = written(fswritefile("NEW.BIN", expected, size / 3));
+	writeStats("Overwrite with a smaller one", ok && checkFile("NEW.BIN", 1002, size / 3) && countNamed("NEW.BIN") == 1);
+
+	fillFile(expected, 1003, size);
+	ok = written(fswritefile("NEW.BIN", expected, size));
+	writeStats("Overwrite with a larger one", ok && checkFile("NEW.BIN", 1003, size));
+
+	ok = written(fsdeletefile("NEW.BIN"));
+	writeStats("Delete", ok && fsloadfile("NEW.BIN", loaded, size) < 0 && countNamed("NEW.BIN") == 0);
+
+	if(fsgetfreespace() != before) {
+		printf("Error: %d kB free after deleting the file, expected %d!\n", fsgetfreespace(), before);
+		errors++;
+	}
+
+	// A long name gets its own entries in front of the alias, and loses them on delete
+
+	fillFile(expected, 1004, 1000);
+	ok = written(fswritefile(longname, expected, 1000));
+	writeStats("New file with a long name", ok && checkFile(longname, 1004, 1000) && countNamed(longname) == 1);
+
+	fillFile(expected, 1005, 3000);
+	ok = written(fswritefile(longname, expected, 3000));
+	writeStats("Overwrite it", ok && checkFile(longname, 1005, 3000) && countNamed(longname) == 1);
+
+	ok = written(fsdeletefile(longname));
+	writeStats("Delete it", ok && countNamed(longname) == 0);
+
+	// A flash that drops a write has to fail it, and it does not count the
+	// generation up. What the write erased is lost, MAIN.BIN gets put back below.
+
+	nordropping = 1;
+	fillFile(expected, 1007, size);
+	ok = written(fswritefile("MAIN.BIN", expected, size));
+	nordropping = 0;
+	writes--;
+
+	writeStats("Write the flash drops", !ok);
+
+	// Files that do not match CRC32.SFV any more are refused, then put back
+
+	binary = findNode(findNode(0, "HB00000"), "MAIN.BIN");
+	packed = findNode(findNode(0, "HB00000"), "MAIN.LZ4");
+
+	fillFile(expected, 1006, 1000);
+	ok = written(fswritefile("MAIN.BIN", expected, 1000));
+
+	fillText(loaded, 1007, textsize);
+	ok = ok && written(fswritefile("MAIN.LZ4", expected, packFrame(loaded, textsize, expected)));
+
+	writeStats("Files failing their CRC", ok && fsloadfilechecked("MAIN.BIN", loaded, size) < 0 && fsloadfile("MAIN.BIN", loaded, size) == 1000 && lz4_loadfile(fsgetcwd(), "MAIN.LZ4", loaded, textsize) < 0);
+
+	ok = written(fswritefile("MAIN.BIN", expected, fileContent(binary, expected)));
+	ok = ok && written(fswritefile("MAIN.LZ4", expected, fileContent(packed, expected)));
+
+	writeStats("Putting them back", ok && fsloadfilechecked("MAIN.BIN", loaded, size) == mainsize && lz4_loadfile(fsgetcwd(), "MAIN.LZ4", loaded, textsize) == textsize);
+
+	// Enough small files to make the dir grow past its last cluster
+
+	for(i = 0, ok = 1; i < perCluster && ok; i++) {
+		sprintf(name, "G%04d.DAT", i);
+		fillFile(expected, 2000 + i, 100 + i);
+
+		ok = written(fswritefile(name, expected, 100 + i));
+	}
+
+	for(i = 0; i < perCluster && ok; i++) {
+		sprintf(name, "G%04d.DAT", i);
+		ok = checkFile(name, 2000 + i, 100 + i);
+	}
+
+	writeStats("Files to grow a dir", ok && countNamed("G0000.DAT") == 1);
+
+	for(i = 0, ok = 1; i < perCluster && ok; i++) {
+		sprintf(name, "G%04d.DAT", i);
+		ok = written(fsdeletefile(name));
+	}
+
+	writeStats("Their deletes", ok);
+
+	// Remount and check that none of the other files were touched, and
+	// that every write counted the generation up for good
+
+	norMount(&nor);
+	checkTree();
+
+	if(norbooterases != 0) {
+		printf("Error: the boot sector was erased %d time(s)!\n", norbooterases);
+		errors++;
+	}
+
+	if(fsgetgeneration(fsgetvolume()) != generation + writes) {
+		printf("Error: %d write(s) took the generation from %u to %u!\n", writes, (unsigned)generation, (unsigned)fsgetgeneration(fsgetvolume()));
+		errors++;
+	}
+}
+
+// Without room for the log the boot code belongs to whatever put it there, so
+// writes must leave it alone, and the generation only lasts until a remount
+
+void checkNoLog() {
+	uint8_t bootcode[0x1F8 - 0x60];
+	uint32_t size = 5000;
+	int ok;
+
+	reserved = 2;
+	buildTree();
+	buildImage();
+	norMount(&nor);
+	memcpy(bootcode, disk + 0x60, sizeof(bootcode));
+
+	fillFile(expected, 3001, size);
+	ok = fsgetvolume()->LogOffset == 0 && !fschdir("HB00000") && !fswritefile("NOLOG.BIN", expected, size) && fsgetgeneration(fsgetvolume()) == 1;
+
+	norMount(&nor);
+	ok = ok && !fschdir("HB00000") && checkFile("NOLOG.BIN", 3001, size) && fsgetgeneration(fsgetvolume()) == 0;
+
+	if(!ok || memcmp(bootcode, disk + 0x60, sizeof(bootcode))) {
+		printf("Error: writing without the log failed or changed the boot code!\n");
+		errors++;
+	}
+
+	printf("  %-30s %s\n", "Write without the log", ok ? "OK" : "FAILED");
+
+	norerases = norprograms = 0;
+	reserved = RESERVED;
+}
+
+int main(int argc, char *argv[]) {
+	int i;
+
+	fatcopies = 2;
+
+	for(i = 1; i < argc - 1; i += 2) {
+		if(!strcmp(argv[i], "-d")) dirs = atoi(argv[i + 1]);
+		else if(!strcmp(argv[i], "-s")) mainsize = atoi(argv[i + 1]);
+		else if(!strcmp(argv[i], "-c")) clustersectors = atoi(argv[i + 1]);
+		else if(!strcmp(argv[i], "-f")) fatcopies = atoi(argv[i + 1]);
+		else break;
+	}
+
+	if(i < argc || dirs <= 0 || clustersectors <= 0 || clustersectors > 128 || (clustersectors & (clustersectors - 1)) || fatcopies <= 0) {
+		printf("Usage: %s <options>\n", argv[0]);
+		printf("Writes and deletes files on generated FAT16 and FAT32 images that behave like a NOR flash.\n");
+		printf("  -d dirs        Homebrew dirs in the root (default 10)\n");
+		printf("  -s size        Size of MAIN.BIN (default 65536)\n");
+		printf("  -c sectors     Sectors per cluster, a power of two (default 1)\n");
+		printf("  -f fats        Number of FATs (default 2)\n");
+		exit(0);
+	}
+
+	srand(1);
+
+	textsize = mainsize;
+	expected = malloc(mainsize * 2 + 8192);
+	loaded = malloc(mainsize * 2 + 8192);
+
+	for(fat32 = 0; fat32 < 2; fat32++) {
+		buildTree();
+		buildImage();
+		norMount(&nor);
+
+		printf("Writing to a FAT%d image as a NOR flash, %d byte clusters and %d FAT(s):\n", fat32 ? 32 : 16, clustersectors * SECTOR_SIZE, fatcopies);
+
+		checkTree();
+		checkWrites();
+		checkNoLog();
+	}
+
+	printf("Checked writing to the image: %s (%d errors).\n", errors ? "FAILED" : "OK", errors);
+
+	free(expected);
+	free(loaded);
+
+	return errors ? 1 : 0;
+}
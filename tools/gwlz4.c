@@ -0,0 +1,318 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#define BLOCK_SIZE (4 * 1024 * 1024)
+#define WINDOW 65536
+#define HASH_BITS 16
+
+// Bus speed of single-line SPI at 64 MHz, which the loader uses by default
+
+#define DEFAULT_RATE 8000
+
+int head[1 << HASH_BITS], chain[WINDOW];
+
+unsigned char *loadFile(char *filename, long *size) {
+	FILE *f = fopen(filename, "rb");
+
+	if(f == NULL) {
+		printf("Error opening file %s!\n", filename);
+		exit(1);
+	}
+
+	fseek(f, 0, SEEK_END);
+	*size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	unsigned char *data = (unsigned char *) malloc(*size + 1);
+	fread(data, 1, *size, f);
+	fclose(f);
+
+	return data;
+}
+
+uint32_t rotl(uint32_t x, int r) {
+	return (x << r) | (x >> (32 - r));
+}
+
+uint32_t read32(const unsigned char *p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+// xxHash32, which the LZ4 frame format uses for its checksums
+
+uint32_t xxh32(const unsigned char *data, long size) {
+	const uint32_t p1 = 2654435761U, p2 = 2246822519U, p3 = 3266489917U, p4 = 668265263U, p5 = 374761393U;
+	const unsigned char *end = data + size;
+	uint32_t h, v[4] = { p1 + p2, p2, 0, -p1 };
+	int i;
+
+	if(size >= 16) {
+		for(; data + 16 <= end; data += 16)
+			for(i = 0; i < 4; i++)
+				v[i] = rotl(v[i] + read32(data + i * 4) * p2, 13) * p1;
+
+		h = rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18);
+	} else {
+		h = p5;
+	}
+
+	h += size;
+
+	for(; data + 4 <= end; data += 4)
+		h = rotl(h + read32(data) * p3, 17) * p4;
+
+	for(; data < end; data++)
+		h = rotl(h + *data * p5, 11) * p1;
+
+	h ^= h >> 15;
+	h *= p2;
+	h ^= h >> 13;
+	h *= p3;
+	h ^= h >> 16;
+
+	return h;
+}
+
+uint32_t hash(const unsigned char *p) {
+	return (read32(p) * 2654435761U) >> (32 - HASH_BITS);
+}
+
+unsigned char *putLength(unsigned char *out, long length) {
+	for(; length >= 255; length -= 255) *out++ = 255;
+	*out++ = length;
+
+	return out;
+}
+
+unsigned char *putSequence(unsigned char *out, const unsigned char *literals, long litlen, int offset, long matchlen) {
+	*out++ = ((litlen < 15 ? litlen : 15) << 4) | (matchlen == 0 ? 0 : (matchlen - 4 < 15 ? matchlen - 4 : 15));
+
+	if(litlen >= 15) out = putLength(out, litlen - 15);
+
+	memcpy(out, literals, litlen);
+	out += litlen;
+
+	// The last sequence of a block has literals only
+
+	if(matchlen == 0) return out;
+
+	*out++ = offset & 0xFF;
+	*out++ = offset >> 8;
+
+	if(matchlen - 4 >= 15) out = putLength(out, matchlen - 4 - 15);
+
+	return out;
+}
+
+// Compress a block, following up to depth earlier positions with the same hash
+
+long compressBlock(const unsigned char *src, long size, unsigned char *dst, int depth) {
+	long i = 0, anchor = 0, best, len, cand, limit = size - 12, last = size - 5;
+	unsigned char *out = dst;
+	int tries, offset = 0;
+
+	memset(head, 0xFF, sizeof(head));
+
+	while(i < limit) {
+		best = 0;
+
+		for(cand = head[hash(src + i)], tries = 0; cand >= 0 && i - cand < WINDOW && tries < depth; cand = chain[cand % WINDOW], tries++) {
+			for(len = 0; i + len < last && src[cand + len] == src[i + len]; len++);
+
+			if(len > best) {
+				best = len;
+				offset = i - cand;
+			}
+		}
+
+		// Remember this position, and every one inside a match too
+
+		if(best < 4) best = 0;
+
+		for(len = 0; len < best || len == 0; len++) {
+			if(i + len >= limit) break;
+
+			chain[(i + len) % WINDOW] = head[hash(src + i + len)];
+			head[hash(src + i + len)] = i + len;
+		}
+
+		if(best == 0) {
+			i++;
+		} else {
+			out = putSequence(out, src + anchor, i - anchor, offset, best);
+			i = anchor = i + best;
+		}
+	}
+
+	return putSequence(out, src + anchor, size - anchor, 0, 0) - dst;
+}
+
+// Decompress a block, to check the output and time it
+
+long decompressBlock(const unsigned char *src, long size, unsigned char *dst) {
+	const unsigned char *end = src + size;
+	unsigned char *out = dst;
+	long litlen, matchlen;
+	int token, offset;
+
+	while(src < end) {
+		token = *src++;
+
+		if((litlen = token >> 4) == 15)
+			do litlen += *src; while(*src++ == 255);
+
+		memcpy(out, src, litlen);
+		out += litlen;
+		src += litlen;
+
+		if(src >= end) break;
+
+		offset = src[0] | (src[1] << 8);
+		src += 2;
+
+		if((matchlen = (token & 15) + 4) == 19)
+			do matchlen += *src; while(*src++ == 255);
+
+		for(; matchlen > 0; matchlen--, out++)
+			*out = out[-offset];
+	}
+
+	return out - dst;
+}
+
+// Write an LZ4 frame with independent blocks and a content checksum
+
+long compressFrame(const unsigned char *src, long size, unsigned char *dst, int depth) {
+	unsigned char *out = dst;
+	long pos, len, packed;
+
+	memcpy(out, "\x04\x22\x4D\x18\x64\x70", 6);
+	out[6] = (xxh32(out + 4, 2) >> 8) & 0xFF;
+	out += 7;
+
+	for(pos = 0; pos < size; pos += len) {
+		len = (size - pos < BLOCK_SIZE) ? size - pos : BLOCK_SIZE;
+		packed = (depth > 0) ? compressBlock(src + pos, len, out + 4, depth) : len;
+
+		// Store the block as it is if it did not get any smaller
+
+		if(packed >= len) {
+			memcpy(out + 4, src + pos, len);
+			packed = len | 0x80000000;
+		}
+
+		out[0] = packed & 0xFF;
+		out[1] = (packed >> 8) & 0xFF;
+		out[2] = (packed >> 16) & 0xFF;
+		out[3] = (packed >> 24) & 0xFF;
+		out += 4 + (packed & 0x7FFFFFFF);
+	}
+
+	memset(out, 0, 4);
+	out += 4;
+
+	len = xxh32(src, size);
+	memcpy(out, &len, 4);
+
+	return out + 4 - dst;
+}
+
+long decompressFrame(const unsigned char *src, unsigned char *dst) {
+	unsigned char *out = dst;
+	uint32_t packed;
+
+	for(src += 7; (packed = read32(src)) != 0; src += 4 + (packed & 0x7FFFFFFF)) {
+		if(packed & 0x80000000) {
+			memcpy(out, src + 4, packed & 0x7FFFFFFF);
+			out += packed & 0x7FFFFFFF;
+		} else {
+			out += decompressBlock(src + 4, packed, out);
+		}
+	}
+
+	return out - dst;
+}
+
+double seconds() {
+	return (double) clock() / CLOCKS_PER_SEC;
+}
+
+void benchmark(unsigned char *data, long size, int rate) {
+	int depths[] = { 0, 1, 4, 16, 64, 256 }, i;
+	unsigned char *packed = malloc(size + size / 255 + 64), *check = malloc(size + 64);
+	long packedsize, runs, n;
+	double start, ctime, dtime;
+
+	printf("Depth      Size   Ratio   Compress   Decompress   Load @ %d kB/s\n", rate);
+
+	for(i = 0; i < (int)(sizeof(depths) / sizeof(depths[0])); i++) {
+		start = seconds();
+		packedsize = compressFrame(data, size, packed, depths[i]);
+		ctime = seconds() - start;
+
+		// Run the decompression a few times for a usable time
+
+		start = seconds();
+
+		for(runs = 0; runs == 0 || (seconds() - start < 0.2 && runs < 1000); runs++)
+			n = decompressFrame(packed, check);
+
+		dtime = (seconds() - start) / runs;
+
+		if(n != size || memcmp(data, check, size)) {
+			printf("Error: depth %d does not decompress correctly!\n", depths[i]);
+			exit(1);
+		}
+
+		// The loader decompresses while it reads, so the bus sets the pace
+
+		printf("%5d %9ld %6.1f%% %8.1f ms %7.1f MB/s %10.1f ms\n", depths[i], packedsize, 100.0 * packedsize / size,
+			ctime * 1000, size / dtime / 1e6, (double) packedsize / rate);
+	}
+
+	printf("\nUncompressed MAIN.BIN loads in %.1f ms.\n", (double) size / rate);
+
+	free(packed);
+	free(check);
+}
+
+int main(int argc, char *argv[]) {
+	if(argc < 3 || (strcmp(argv[1], "-b") && argc > 4)) {
+		printf("Usage: %s input output <depth (default 16)>\n", argv[0]);
+		printf("       %s -b input <bus speed in kB/s (default %d)>\n", argv[0], DEFAULT_RATE);
+		printf("Compresses MAIN.BIN into MAIN.LZ4 (LZ4 frame format), or compares the compression levels.\n");
+		exit(0);
+	}
+
+	long size, packedsize;
+	unsigned char *data, *packed;
+
+	if(!strcmp(argv[1], "-b")) {
+		data = loadFile(argv[2], &size);
+		benchmark(data, size, (argc > 3) ? atoi(argv[3]) : DEFAULT_RATE);
+		free(data);
+		return 0;
+	}
+
+	data = loadFile(argv[1], &size);
+	packed = malloc(size + size / 255 + 64);
+	packedsize = compressFrame(data, size, packed, (argc > 3) ? atoi(argv[3]) : 16);
+
+	FILE *outfile = fopen(argv[2], "wb");
+
+	if(outfile == NULL) {
+		printf("Error opening file %s for writing!\n", argv[2]);
+		exit(1);
+	}
+
+	fwrite(packed, 1, packedsize, outfile);
+	fclose(outfile);
+
+	printf("Compressed %ld bytes to %ld (%.1f%%).\n", size, packedsize, 100.0 * packedsize / size);
+
+	free(data);
+	free(packed);
+}
@@ -0,0 +1,555 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "fslib.h"
+
+#define SECTOR_SIZE 512
+#define ERASE_SIZE 4096
+#define ROOT_ENTRIES 512
+#define MIN_CLUSTERS 4085
+#define MAX_CLUSTERS 65524
+#define MAX_PATH 1024
+#define LOG_SECTORS 40
+
+typedef struct {
+	char Path[MAX_PATH];
+	char Name[256];
+	char Short[11];
+	int Dir;
+	uint32_t Size;
+	int Parent;
+	int First;
+	int Count;
+	int Long;
+	int Entries;
+	int Cluster;
+} Node;
+
+Node *nodes;
+int nodecount, nodemax;
+
+uint8_t *image;
+uint16_t *fat;
+long imagesize;
+int clusters, spc, fats = 2, fatsectors, reserved, datasector, cursor = 2;
+
+// Statistics
+
+long filebytes, slack, gaps;
+int filecount, dircount, mains, mainsaligned, aligned, fragmented;
+
+unsigned char *loadFile(char *filename, long *size) {
+	FILE *f = fopen(filename, "rb");
+
+	if(f == NULL) {
+		printf("Error opening file %s!\n", filename);
+		exit(1);
+	}
+
+	fseek(f, 0, SEEK_END);
+	*size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	unsigned char *data = (unsigned char *) malloc(*size + 1);
+	fread(data, 1, *size, f);
+	fclose(f);
+
+	return data;
+}
+
+int addNode() {
+	if(nodecount == nodemax) {
+		nodemax = nodemax ? nodemax * 2 : 256;
+		nodes = realloc(nodes, nodemax * sizeof(Node));
+	}
+
+	memset(&nodes[nodecount], 0, sizeof(Node));
+
+	return nodecount++;
+}
+
+int compareNodes(const void *a, const void *b) {
+	return strcasecmp(((const Node *)a)->Name, ((const Node *)b)->Name);
+}
+
+int shortChar(char c) {
+	return isalnum((unsigned char)c) || (c != 0 && strchr("!#$%&'()-@^_`{}~", c) != NULL);
+}
+
+// A name that fits 8.3 keeps it in upper case, like fslib looks it up
+
+int makeShortName(const char *name, char *dest) {
+	const char *dot = strrchr(name, '.');
+	int i, base = dot ? (int)(dot - name) : (int)strlen(name), ext = dot ? (int)strlen(dot + 1) : 0;
+
+	memset(dest, ' ', 11);
+
+	if(base < 1 || base > 8 || ext > 3 || (dot && ext == 0)) return 0;
+
+	for(i = 0; name[i]; i++)
+		if(name + i != dot && !shortChar(name[i])) return 0;
+
+	for(i = 0; i < base; i++) dest[i] = toupper((unsigned char)name[i]);
+	for(i = 0; i < ext; i++) dest[8 + i] = toupper((unsigned char)dot[1 + i]);
+
+	return 1;
+}
+
+int hasLowerCase(const char *name) {
+	for(; *name; name++)
+		if(islower((unsigned char)*name)) return 1;
+
+	return 0;
+}
+
+int shortNameTaken(int dir, int upto, const char *name) {
+	int i;
+
+	for(i = nodes[dir].First; i < upto; i++)
+		if(!memcmp(nodes[i].Short, name, 11)) return 1;
+
+	return 0;
+}
+
+// Otherwise it gets a BASE~N alias, and the long name goes into VFAT entries
+
+void makeAlias(int dir, int id) {
+	Node *node = &nodes[id];
+	const char *dot = strrchr(node->Name, '.');
+	char base[9], ext[4], tail[8];
+	int i, len = 0, extlen = 0, n;
+
+	if(dot == node->Name) dot = NULL;
+
+	for(i = 0; node->Name[i] && node->Name + i != dot && len < 8; i++)
+		if(shortChar(node->Name[i])) base[len++] = toupper((unsigned char)node->Name[i]);
+
+	if(dot)
+		for(i = 1; dot[i] && extlen < 3; i++)
+			if(shortChar(dot[i])) ext[extlen++] = toupper((unsigned char)dot[i]);
+
+	if(len == 0) base[len++] = '_';
+
+	for(n = 1; n < 1000000; n++) {
+		sprintf(tail, "~%d", n);
+
+		memset(node->Short, ' ', 11);
+		memcpy(node->Short, base, (len + (int)strlen(tail) > 8) ? 8 - (int)strlen(tail) : len);
+		memcpy(node->Short + ((len + (int)strlen(tail) > 8) ? 8 - (int)strlen(tail) : len), tail, strlen(tail));
+		memcpy(node->Short + 8, ext, extlen);
+
+		if(!shortNameTaken(dir, id, node->Short)) return;
+	}
+}
+
+void scanDir(int dir) {
+	DIR *d = opendir(nodes[dir].Path);
+	struct dirent *ent;
+	struct stat st;
+	char path[MAX_PATH + 256];
+	int i, id;
+
+	if(d == NULL) {
+		printf("Error opening dir %s!\n", nodes[dir].Path);
+		exit(1);
+	}
+
+	nodes[dir].First = nodecount;
+
+	while((ent = readdir(d)) != NULL) {
+		// Hidden files stay on the PC
+
+		if(ent->d_name[0] == '.') continue;
+
+		snprintf(path, sizeof(path), "%s/%s", nodes[dir].Path, ent->d_name);
+
+		if(strlen(path) >= MAX_PATH || strlen(ent->d_name) >= FS_MAX_NAME) {
+			printf("Error: the name %s is too long!\n", path);
+			exit(1);
+		}
+
+		if(stat(path, &st)) {
+			printf("Error reading %s!\n", path);
+			exit(1);
+		}
+
+		id = addNode();
+		strcpy(nodes[id].Path, path);
+		strcpy(nodes[id].Name, ent->d_name);
+		nodes[id].Parent = dir;
+
+		nodes[id].Dir = S_ISDIR(st.st_mode);
+		nodes[id].Size = nodes[id].Dir ? 0 : st.st_size;
+	}
+
+	closedir(d);
+
+	// The listings come out sorted, which is the order the menu shows them in
+
+	nodes[dir].Count = nodecount - nodes[dir].First;
+	qsort(nodes + nodes[dir].First, nodes[dir].Count, sizeof(Node), compareNodes);
+
+	nodes[dir].Entries = (dir == 0) ? 0 : 2;
+
+	for(i = nodes[dir].First; i < nodecount; i++) {
+		if(!makeShortName(nodes[i].Name, nodes[i].Short) || shortNameTaken(dir, i, nodes[i].Short)) {
+			makeAlias(dir, i);
+			nodes[i].Long = 1;
+		}
+
+		// Long names also keep the case of the ones that fit 8.3
+
+		if(nodes[i].Long || hasLowerCase(nodes[i].Name)) {
+			nodes[i].Long = 1;
+			nodes[dir].Entries += (strlen(nodes[i].Name) + 12) / 13;
+		}
+
+		nodes[dir].Entries++;
+	}
+
+	for(i = nodes[dir].First; i < nodes[dir].First + nodes[dir].Count; i++)
+		if(nodes[i].Dir) scanDir(i);
+}
+
+int clusterCount(uint32_t size) {
+	return (size + spc * SECTOR_SIZE - 1) / (spc * SECTOR_SIZE);
+}
+
+long clusterOffset(int c) {
+	return (datasector + (long)(c - 2) * spc) * SECTOR_SIZE;
+}
+
+// Everything is placed in one contiguous run, big files start on an erase sector
+
+int allocChain(uint32_t size, int align) {
+	int n = clusterCount(size), first = cursor, i;
+
+	if(n == 0) return 0;
+
+	if(align)
+		while(clusterOffset(first) % ERASE_SIZE) first++;
+
+	if(first + n > clusters + 2) {
+		printf("Error: the files do not fit, use a bigger image!\n");
+		exit(1);
+	}
+
+	gaps += first - cursor;
+
+	for(i = 0; i < n; i++)
+		fat[first + i] = (i == n - 1) ? 0xFFFF : first + i + 1;
+
+	cursor = first + n;
+
+	return first;
+}
+
+int isMetadata(Node *node) {
+	return !node->Dir && (!strcasecmp(node->Name, "MANIFEST.TXT") || !strcasecmp(node->Name, "ICON.BMP"));
+}
+
+int isMain(Node *node) {
+	return !node->Dir && (!strcasecmp(node->Name, "MAIN.BIN") || !strcasecmp(node->Name, "MAIN.LZ4"));
+}
+
+void placeFile(int id, int align) {
+	Node *node = &nodes[id];
+	long size;
+	uint8_t *data = loadFile(node->Path, &size);
+
+	if(size != node->Size) {
+		printf("Error: %s changed while it was being read!\n", node->Path);
+		exit(1);
+	}
+
+	node->Cluster = allocChain(size, align);
+	if(size > 0) memcpy(image + clusterOffset(node->Cluster), data, size);
+
+	filecount++;
+	filebytes += size;
+	slack += (long)clusterCount(size) * spc * SECTOR_SIZE - size;
+
+	if(node->Cluster && clusterOffset(node->Cluster) % ERASE_SIZE == 0) {
+		aligned++;
+		if(isMain(node)) mainsaligned++;
+	}
+
+	free(data);
+}
+
+// First come the dirs, each followed by the files the menu reads out of it
+
+void placeDirs(int dir) {
+	int i;
+
+	for(i = nodes[dir].First; i < nodes[dir].First + nodes[dir].Count; i++) {
+		if(!nodes[i].Dir) continue;
+
+		nodes[i].Cluster = allocChain(nodes[i].Entries * sizeof(DirEntry), 0);
+		slack += (long)clusterCount(nodes[i].Entries * sizeof(DirEntry)) * spc * SECTOR_SIZE - nodes[i].Entries * sizeof(DirEntry);
+		dircount++;
+	}
+
+	for(i = nodes[dir].First; i < nodes[dir].First + nodes[dir].Count; i++)
+		if(isMetadata(&nodes[i])) placeFile(i, 0);
+
+	for(i = nodes[dir].First; i < nodes[dir].First + nodes[dir].Count; i++)
+		if(nodes[i].Dir) placeDirs(i);
+}
+
+// Then all of the programs, and then everything else
+
+void placeFiles(int mainonly) {
+	int i;
+
+	for(i = 1; i < nodecount; i++) {
+		if(nodes[i].Dir || isMetadata(&nodes[i]) || isMain(&nodes[i]) != mainonly) continue;
+
+		placeFile(i, mainonly || nodes[i].Size >= ERASE_SIZE);
+
+		if(mainonly) mains++;
+	}
+}
+
+uint8_t longChecksum(const char *name) {
+	uint8_t sum = 0;
+	int i;
+
+	for(i = 0; i < 11; i++)
+		sum = ((sum & 1) << 7) + (sum >> 1) + (uint8_t)name[i];
+
+	return sum;
+}
+
+DirEntry *putEntry(DirEntry *entry, const char *name, int attribute, int cluster, uint32_t size) {
+	memset(entry, 0, sizeof(DirEntry));
+	memcpy(entry->Basename, name, 11);
+	entry->Attribute = attribute;
+	entry->StartCluster = cluster;
+	entry->Size = size;
+
+	return entry + 1;
+}
+
+DirEntry *putLongEntries(DirEntry *entry, Node *node) {
+	static const int offsets[13] = { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
+	int len = strlen(node->Name), pieces = (len + 12) / 13, i, j, pos;
+	uint8_t *raw;
+	uint16_t c;
+
+	// The pieces go in backwards, the last one is flagged with 0x40
+
+	for(i = pieces; i > 0; i--, entry++) {
+		raw = (uint8_t *)entry;
+		memset(raw, 0, sizeof(DirEntry));
+
+		raw[0] = i | ((i == pieces) ? 0x40 : 0);
+		raw[11] = 0x0F;
+		raw[13] = longChecksum(node->Short);
+
+		for(j = 0; j < 13; j++) {
+			pos = (i - 1) * 13 + j;
+			c = (pos < len) ? (uint8_t)node->Name[pos] : (pos == len) ? 0 : 0xFFFF;
+
+			raw[offsets[j]] = c & 0xFF;
+			raw[offsets[j] + 1] = c >> 8;
+		}
+	}
+
+	return entry;
+}
+
+void writeDir(int dir) {
+	int i, size = clusterCount(nodes[dir].Entries * sizeof(DirEntry)) * spc * SECTOR_SIZE;
+	DirEntry *table, *entry;
+
+	if(dir == 0) size = ROOT_ENTRIES * sizeof(DirEntry);
+
+	table = entry = calloc(size, 1);
+
+	if(dir != 0) {
+		entry = putEntry(entry, ".          ", 0x10, nodes[dir].Cluster, 0);
+		entry = putEntry(entry, "..         ", 0x10, nodes[nodes[dir].Parent].Cluster, 0);
+	}
+
+	for(i = nodes[dir].First; i < nodes[dir].First + nodes[dir].Count; i++) {
+		if(nodes[i].Long) entry = putLongEntries(entry, &nodes[i]);
+
+		entry = putEntry(entry, nodes[i].Short, nodes[i].Dir ? 0x10 : 0x20, nodes[i].Cluster, nodes[i].Size);
+
+		if(nodes[i].Dir) writeDir(i);
+	}
+
+	if(dir == 0)
+		memcpy(image + (datasector - ROOT_ENTRIES * sizeof(DirEntry) / SECTOR_SIZE) * SECTOR_SIZE, table, size);
+	else
+		memcpy(image + clusterOffset(nodes[dir].Cluster), table, size);
+
+	free(table);
+}
+
+long parseSize(const char *str) {
+	char *end;
+	long size = strtol(str, &end, 0);
+
+	if(*end == 'k' || *end == 'K') size *= 1024;
+	if(*end == 'm' || *end == 'M') size *= 1024 * 1024;
+
+	return size;
+}
+
+// The reserved area holds the boot sector's erase block and the write log
+// fslib keeps in the four after it. Pad it, so that the clusters line up
+// with the erase sectors.
+
+int layout(long sectors) {
+	fatsectors = ((sectors / spc + 2) * 2 + SECTOR_SIZE - 1) / SECTOR_SIZE;
+	datasector = LOG_SECTORS + fats * fatsectors + ROOT_ENTRIES * sizeof(DirEntry) / SECTOR_SIZE;
+	reserved = LOG_SECTORS + (ERASE_SIZE / SECTOR_SIZE - datasector % (ERASE_SIZE / SECTOR_SIZE)) % (ERASE_SIZE / SECTOR_SIZE);
+	datasector += reserved - LOG_SECTORS;
+
+	return (sectors - datasector) / spc;
+}
+
+int main(int argc, char *argv[]) {
+	long size = 16 * 1024 * 1024, sectors;
+	char *label = "GAME&WATCH ";
+	int i, c;
+
+	for(i = 1; i < argc - 2; i += 2) {
+		if(!strcmp(argv[i], "-s")) size = parseSize(argv[i + 1]);
+		else if(!strcmp(argv[i], "-c")) spc = atoi(argv[i + 1]);
+		else if(!strcmp(argv[i], "-f")) fats = atoi(argv[i + 1]);
+		else if(!strcmp(argv[i], "-n")) label = argv[i + 1];
+		else break;
+	}
+
+	if(argc < 3 || i != argc - 2 || spc < 0 || spc > 128 || (spc & (spc - 1)) || fats < 1 || fats > 2 || size <= 0 || size % ERASE_SIZE) {
+		printf("Usage: %s <options> inputdir output.img\n", argv[0]);
+		printf("Builds a FAT16 image of the external flash out of a dir, with every MAIN.BIN in one piece.\n");
+		printf("  -s size        Size of the image, a multiple of 4K and about 2M at the least,\n");
+		printf("                 since smaller ones only fit FAT12 (default 16M)\n");
+		printf("  -c sectors     Sectors per cluster (default 8, which is one erase sector, or the\n");
+		printf("                 nearest size that gives FAT16 its %d to %d clusters, so 16M gets 4\n", MIN_CLUSTERS, MAX_CLUSTERS);
+		printf("                 and only 17M to 256M get 8)\n");
+		printf("  -f fats        Number of FATs (default 2)\n");
+		printf("  -n label       Volume label\n");
+		exit(0);
+	}
+
+	// Scan the input
+
+	i = addNode();
+	snprintf(nodes[i].Path, MAX_PATH, "%s", argv[argc - 2]);
+	nodes[i].Dir = 1;
+	scanDir(0);
+
+	if(nodes[0].Entries > ROOT_ENTRIES) {
+		printf("Error: the root dir only holds %d entries!\n", ROOT_ENTRIES);
+		exit(1);
+	}
+
+	// Anything under 4085 clusters is FAT12 to the PC, whatever the boot sector says
+
+	sectors = size / SECTOR_SIZE;
+
+	if(spc == 0) {
+		for(spc = ERASE_SIZE / SECTOR_SIZE; spc < 128 && layout(sectors) > MAX_CLUSTERS; spc *= 2);
+		for(; spc > 1 && layout(sectors) < MIN_CLUSTERS; spc /= 2);
+	}
+
+	clusters = layout(sectors);
+
+	if(clusters > MAX_CLUSTERS) {
+		printf("Error: %d clusters do not fit into FAT16, use bigger clusters!\n", clusters);
+		exit(1);
+	}
+
+	if(clusters < MIN_CLUSTERS) {
+		printf("Error: only %d clusters of %d bytes fit, FAT16 needs at least %d. Use %s!\n", clusters, spc * SECTOR_SIZE, MIN_CLUSTERS, (spc > 1) ? "smaller clusters" : "a bigger image");
+		exit(1);
+	}
+
+	imagesize = sectors * SECTOR_SIZE;
+	image = malloc(imagesize);
+	fat = calloc(fatsectors * SECTOR_SIZE / 2, 2);
+
+	// Unused space is left erased, so that it does not need to be programmed
+
+	memset(image, 0, datasector * SECTOR_SIZE);
+	memset(image + ERASE_SIZE, 0xFF, LOG_SECTORS * SECTOR_SIZE - ERASE_SIZE);
+	memset(image + datasector * SECTOR_SIZE, 0xFF, imagesize - datasector * SECTOR_SIZE);
+
+	fat[0] = 0xFFF8;
+	fat[1] = 0xFFFF;
+
+	placeDirs(0);
+	placeFiles(1);
+	placeFiles(0);
+	writeDir(0);
+
+	for(i = 0; i < fats; i++)
+		memcpy(image + (reserved + i * fatsectors) * SECTOR_SIZE, fat, fatsectors * SECTOR_SIZE);
+
+	BIOSParams *bpb = (BIOSParams *)(image + 3);
+
+	memcpy(image, "\xEB\x3C\x90", 3);
+	memcpy(bpb->OEMLabel, "GWMKFS  ", 8);
+	bpb->BytesPerSector = SECTOR_SIZE;
+	bpb->SectorsPerCluster = spc;
+	bpb->ReservedSectors = reserved;
+	bpb->NumberOfFats = fats;
+	bpb->RootDirEntries = ROOT_ENTRIES;
+	bpb->LogicalSectors = (sectors < 65536) ? sectors : 0;
+	bpb->MediumType = 0xF8;
+	bpb->SectorsPerFat = fatsectors;
+	bpb->SectorsPerTrack = 32;
+	bpb->Sides = 64;
+	bpb->LargeSectors = (sectors < 65536) ? 0 : sectors;
+	bpb->DriveNo = 0x80;
+	bpb->Signature = 0x29;
+	bpb->VolumeID = time(NULL);
+	memset(bpb->VolumeLabel, ' ', 11);
+	memcpy(bpb->VolumeLabel, label, (strlen(label) < 11) ? strlen(label) : 11);
+	memcpy(bpb->FileSystem, "FAT16   ", 8);
+	image[510] = 0x55;
+	image[511] = 0xAA;
+
+	// fslib counts its generation by clearing the bits of the boot code
+
+	memset(image + 0x60, 0xFF, 0x1F8 - 0x60);
+
+	FILE *outfile = fopen(argv[argc - 1], "wb");
+
+	if(outfile == NULL) {
+		printf("Error opening file %s for writing!\n", argv[argc - 1]);
+		exit(1);
+	}
+
+	fwrite(image, 1, imagesize, outfile);
+	fclose(outfile);
+
+	// Check the chains the way a reader would see them
+
+	for(i = 1; i < nodecount; i++)
+		for(c = nodes[i].Cluster; c && fat[c] < 0xFFF8; c = fat[c])
+			if(fat[c] != c + 1) {
+				fragmented++;
+				break;
+			}
+
+	printf("%d files (%ld kB) in %d dirs, %d byte clusters.\n", filecount, filebytes / 1024, dircount, spc * SECTOR_SIZE);
+	printf("Fragmented files: %d\n", fragmented);
+	printf("Programs aligned to 4K: %d of %d (%d files in total)\n", mainsaligned, mains, aligned);
+	printf("Slack: %ld kB (%.1f%% of the used space)\n", slack / 1024, 100.0 * slack / (slack + filebytes + 1));
+	printf("Alignment gaps: %ld kB\n", gaps * spc * SECTOR_SIZE / 1024);
+	printf("Free: %ld of %ld kB\n", (clusters + 2 - cursor + gaps) * spc * SECTOR_SIZE / 1024, imagesize / 1024);
+
+	return 0;
+}